@@ -8,6 +8,63 @@ Please direct all questions and problems to me.
 
 This module is a python wrapper for the GD library (version 1.8.3)
 
+version 0.60
+    -- encoding, decoding, copy, resample, fill and polygon calls now
+       release the global interpreter lock.  each image carries its
+       own lock so two threads can't work on the same gdImage at once.
+    -- PNG, JPEG, GIF and WBMP output to an object with a write()
+       method is streamed in 64K chunks rather than built in memory
+       first.  writeWbmp() to such an object now works.
+    -- images read from an object with a read() method are read in
+       64K blocks (with readinto() where available) instead of one
+       read() call per byte.  seek() and tell() are supported, so gd2
+       images can be read from such objects.
+    -- gd.image(data, type) and gd.frombuffer(data, type) decode an
+       image held in a bytearray, memoryview or other buffer object
+       directly from its memory via the gd*Ptr readers.
+    -- gd.probe() returns the type, size and truecolor flag of an
+       image from its header alone.
+    -- images loaded by filename are memory mapped and decoded in
+       place, rather than read through stdio (except for xbm and xpm
+       files, and where mmap isn't available).
+    -- gif, wbmp, xbm and xpm images can be read from objects with a
+       read() method and from buffers, and wbmp images from files.
+    -- gd.PngWriter encodes a PNG from bands of rows, so very large
+       PNGs can be written without building the whole image.
+    -- image.encode_many() encodes an image in several formats at
+       once, on parallel threads.
+    -- writePng() takes a zlib compression level or a preset name
+       (fast, balanced, small), and both it and PngWriter take a row
+       filter strategy (truecolor images only, for writePng()).
+       demo/gdbench.py compares the presets.
+    -- gd.GifAnimWriter writes animated GIFs a frame at a time,
+       encoding only the area which changed from the last frame.
+    -- JPEG images can be decoded at 1/2, 1/4 or 1/8 size with the
+       scale or max_size options to gd.image().
+    -- gd.thumbnail() decodes, shrinks and encodes an image in one call
+       without holding the GIL.
+    -- gd.batch_thumbnail() runs many thumbnail jobs on a thread pool.
+       gd.setThumbnailCache() limits the memory they keep for reuse.
+    -- optional cache of encoded output (gd.setEncodeCache).
+    -- images support the buffer interface and __array_interface__, and
+       row() gives a view of one row's pixels.
+    -- setPixels() and getPixels() set and get many pixels at once.
+    -- lines(), polygon() and filledPolygon() take flat arrays of x,y
+       ints, and no longer leak references in lines().
+    -- gd.DisplayList records drawing calls for replay onto any image.
+    -- draw() runs a batch of drawing commands in one call.
+    -- DisplayList.replay() and draw() can render in bands on several
+       threads.
+    -- copyResampledTo() resamples truecolor images in fixed point,
+       several times faster than gd; gd.image() takes resample=1 to
+       resize by resampling.
+    -- copyResampledTo() takes filter=box, bilinear, bicubic or
+       lanczos3; weight tables are cached for repeated geometries.
+    -- copyTo(), copyMergeTo() and copyMergeGrayTo() work on rows of
+       pixels between truecolor images, blending with SSE2.
+    -- image.toPalette() reduces an image to a palette of up to 256
+       colors, by octree or k-means, optionally dithered.
+
 version 0.56
 Revised 03/10/2005 by Chris Gonnerman
     -- added support for GIF files.
@@ -124,6 +181,7 @@ Revised 11/22/2000 by Chris Gonnerman
 ******************************************************************/
 
 #include <Python.h>
+#include <pythread.h>
 #include <gd.h>
 #include <gdfonts.h>
 #include <gdfontl.h>
@@ -131,12 +189,45 @@ Revised 11/22/2000 by Chris Gonnerman
 #include <gdfontt.h>
 #include <gdfontg.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
+#include <sys/time.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef HAVE_LIBTTF
 #define HAVE_LIBFREETYPE
 #endif
 
+#ifdef HAVE_LIBXPM
+#include <X11/xpm.h>
+/* gd 2.1 and later carry the X11 color names */
+#if defined(GD_MAJOR_VERSION) && (GD_MAJOR_VERSION > 2 || GD_MINOR_VERSION >= 1)
+#define HAVE_GD_COLOR_MAP
+#include <gd_color_map.h>
+#endif
+#endif
+
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+
+#ifdef HAVE_LIBJPEG
+#include <setjmp.h>
+#include <jpeglib.h>
+#endif
+
+/* HAVE_MMAP comes from Python's pyconfig.h */
+#ifdef HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 /* missing from gd.h */
 /* gdImagePtr gdImageCreateFromXpm(char *filename); */
 
@@ -161,6 +252,8 @@ typedef struct i_o {
     int multiplier_y,origin_y;
     struct i_o *current_brush;
     struct i_o *current_tile;
+    PyThread_type_lock lock;
+    long writer;        /* thread in a write() call for this image, or 0 */
 } imageobject;
 
 
@@ -185,29 +278,441 @@ staticforward PyTypeObject Imagetype;
 #define is_imageobject(v)        ((v)->ob_type == &Imagetype)
 
 #define MIN(x,y) ((x)<(y)?(x):(y))
+#define MAX(x,y) ((x)>(y)?(x):(y))
 #define X(x) ((x)*self->multiplier_x+self->origin_x)
 #define Y(y) ((y)*self->multiplier_y+self->origin_y)
 #define W(x) ((x)*self->multiplier_x)
 #define H(y) ((y)*self->multiplier_y)
 
 static imageobject *newimageobject(PyObject *args);
+static imageobject *allocimageobject(void);
+
+/*
+** Image locking.  gd calls which may take a while are made with the
+** global interpreter lock released, so every image has a lock of its
+** own which must be held while its gdImage is being read or changed.
+*/
+
+static void image_lock(imageobject *img)
+{
+    /* never block on the image lock while holding the GIL; the current
+     * owner may need the GIL to finish (e.g. to call a write() method) */
+    if(!PyThread_acquire_lock(img->lock, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(img->lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+#define image_unlock(img) PyThread_release_lock((img)->lock)
+
+/* an image stays locked while the write() method it is being encoded
+ * to runs, so using it from write() would deadlock; raise instead */
+
+static int image_check(imageobject *img)
+{
+    if(img->writer && img->writer == PyThread_get_thread_ident()) {
+        PyErr_SetString(ErrorObject,
+            "image can't be used from the write() method it is being written to");
+        return 0;
+    }
+    return 1;
+}
+
+/* these two must be called with the GIL released.  pairs are always
+ * locked in address order so that a.copyTo(b) and b.copyTo(a) running
+ * at the same time can't deadlock. */
+
+static void image_lock_pair(imageobject *a, imageobject *b)
+{
+    imageobject *t;
+
+    if(a == b) {
+        PyThread_acquire_lock(a->lock, WAIT_LOCK);
+        return;
+    }
+    if((Py_uintptr_t)a > (Py_uintptr_t)b) {
+        t = a; a = b; b = t;
+    }
+    PyThread_acquire_lock(a->lock, WAIT_LOCK);
+    PyThread_acquire_lock(b->lock, WAIT_LOCK);
+}
+
+static void image_unlock_pair(imageobject *a, imageobject *b)
+{
+    PyThread_release_lock(a->lock);
+    if(a != b)
+        PyThread_release_lock(b->lock);
+}
+
+/* run stmt against img with the image lock held; LOCKED() keeps the
+ * GIL, UNLOCKED() releases it for the duration of stmt */
+
+#define LOCKED(img, stmt) \
+    do { image_lock(img); stmt; image_unlock(img); } while(0)
+
+#define UNLOCKED(img, stmt) \
+    do { \
+        Py_BEGIN_ALLOW_THREADS \
+        PyThread_acquire_lock((img)->lock, WAIT_LOCK); \
+        stmt; \
+        PyThread_release_lock((img)->lock); \
+        Py_END_ALLOW_THREADS \
+    } while(0)
+
+#define UNLOCKED2(a, b, stmt) \
+    do { \
+        Py_BEGIN_ALLOW_THREADS \
+        image_lock_pair(a, b); \
+        stmt; \
+        image_unlock_pair(a, b); \
+        Py_END_ALLOW_THREADS \
+    } while(0)
+
+/*
+** Worker threads.  par_run() runs func(arg, i) for i = 0..n-1 on the
+** calling thread and up to nthreads-1 helpers from a pool of native
+** threads, and returns when every call has finished.  It must be
+** called without the GIL, and func must not touch Python objects.
+**
+** Pool threads are started on first use (at most POOL_MAX of them)
+** and then wait for work.  Locks are never freed, only recycled, since
+** PyThread_release_lock may still be using a lock for a moment after
+** the waiting thread has returned from acquiring it.  If no thread can
+** be started the caller simply does all of the work itself.
+*/
+
+#define POOL_MAX 64
+
+typedef struct par_batch {
+    void (*func)(void *, int);
+    void *arg;
+    int n, next;                /* calls to make, next to hand out */
+    int helpers, active;        /* helpers wanted, helpers working */
+    int waiting;                /* caller is blocked on done */
+    PyThread_type_lock done;
+    struct par_batch *link;
+} par_batch;
+
+typedef struct pool_worker {
+    PyThread_type_lock wake;
+    struct pool_worker *link;
+} pool_worker;
+
+static PyThread_type_lock pool_mutex;   /* guards everything below */
+static par_batch *pool_queue;           /* batches wanting helpers */
+static pool_worker *pool_idle;
+static int pool_threads;
+static PyThread_type_lock pool_spare_locks[POOL_MAX];
+static int pool_nspare;
+
+/* get a lock in the acquired state; pool_mutex must be held */
+
+static PyThread_type_lock pool_get_lock(void)
+{
+    PyThread_type_lock lock;
+
+    if(pool_nspare)
+        return pool_spare_locks[--pool_nspare];
+    if((lock = PyThread_allocate_lock()))
+        PyThread_acquire_lock(lock, NOWAIT_LOCK);
+    return lock;
+}
+
+/* give back an acquired lock; pool_mutex must be held */
+
+static void pool_put_lock(PyThread_type_lock lock)
+{
+    if(pool_nspare < POOL_MAX)
+        pool_spare_locks[pool_nspare++] = lock;
+    else
+        PyThread_free_lock(lock);
+}
+
+static void pool_unqueue(par_batch *b)
+{
+    par_batch **pp;
+
+    for(pp = &pool_queue; *pp; pp = &(*pp)->link)
+        if(*pp == b) {
+            *pp = b->link;
+            break;
+        }
+}
+
+/* hand out calls from b until there are none left.  a batch without a
+ * done lock was never queued, so no helper can be sharing it (and
+ * pool_mutex may not even exist) */
+
+static void par_work(par_batch *b)
+{
+    int i;
+
+    for(;;) {
+        if(b->done) {
+            PyThread_acquire_lock(pool_mutex, WAIT_LOCK);
+            i = b->next++;
+            PyThread_release_lock(pool_mutex);
+        } else {
+            i = b->next++;
+        }
+        if(i >= b->n)
+            break;
+        b->func(b->arg, i);
+    }
+}
+
+static void pool_thread(void *unused)
+{
+    pool_worker self;
+    PyThread_type_lock done;
+    par_batch *b;
+    int signal;
+
+    PyThread_acquire_lock(pool_mutex, WAIT_LOCK);
+    self.wake = pool_get_lock();
+    PyThread_release_lock(pool_mutex);
+    if(!self.wake)
+        return;
+
+    for(;;) {
+        PyThread_acquire_lock(pool_mutex, WAIT_LOCK);
+        if(!(b = pool_queue)) {
+            self.link = pool_idle;
+            pool_idle = &self;
+            PyThread_release_lock(pool_mutex);
+            PyThread_acquire_lock(self.wake, WAIT_LOCK);
+            continue;
+        }
+        if(++b->active == b->helpers)
+            pool_unqueue(b);
+        PyThread_release_lock(pool_mutex);
+
+        par_work(b);
+
+        PyThread_acquire_lock(pool_mutex, WAIT_LOCK);
+        signal = (--b->active == 0 && b->waiting);
+        done = b->done;
+        PyThread_release_lock(pool_mutex);
+        /* b belongs to the caller, and may be gone once done is
+         * released */
+        if(signal)
+            PyThread_release_lock(done);
+    }
+}
+
+static void par_run(int n, int nthreads, void (*func)(void *, int), void *arg)
+{
+    par_batch b;
+    pool_worker *w;
+    int i, wait;
+
+    b.func = func;
+    b.arg = arg;
+    b.n = n;
+    b.next = 0;
+    b.helpers = MIN(nthreads, n) - 1;
+    b.active = b.waiting = 0;
+    b.link = NULL;
+    b.done = NULL;
+
+    if(b.helpers > 0 && pool_mutex) {
+        PyThread_acquire_lock(pool_mutex, WAIT_LOCK);
+        if((b.done = pool_get_lock())) {
+            b.link = pool_queue;
+            pool_queue = &b;
+            for(i = 0; i < b.helpers; i++) {
+                if((w = pool_idle)) {
+                    pool_idle = w->link;
+                    PyThread_release_lock(w->wake);
+                } else if(pool_threads < POOL_MAX
+                       && PyThread_start_new_thread(pool_thread, NULL) != -1) {
+                    pool_threads++;
+                } else {
+                    break;
+                }
+            }
+        }
+        PyThread_release_lock(pool_mutex);
+    }
+
+    par_work(&b);
+
+    if(b.done) {
+        PyThread_acquire_lock(pool_mutex, WAIT_LOCK);
+        pool_unqueue(&b);
+        wait = b.waiting = (b.active > 0);
+        PyThread_release_lock(pool_mutex);
+        if(wait)
+            PyThread_acquire_lock(b.done, WAIT_LOCK);
+        PyThread_acquire_lock(pool_mutex, WAIT_LOCK);
+        pool_put_lock(b.done);
+        PyThread_release_lock(pool_mutex);
+    }
+}
+
+static int ncpus(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(n > 0)
+        return (int)MIN(n, POOL_MAX);
+#endif
+    return 4;
+}
 
 /*
 ** Support Functions
 */
 
+/*
+** gdIOCtx which writes to a python object with a write() method.  gd's
+** output is collected in a fixed size buffer and handed to write() one
+** chunk at a time, so the encoded image never exists in memory as a
+** whole.  The encoders run without the GIL, so it is taken back only
+** when a chunk is ready.  The image lock stays held while write()
+** runs, so other threads see the image as it was when encoding began;
+** write() itself gets gd.error if it tries to use the image.
+*/
+
+#define WRITE_CHUNK 65536
+
+struct PyFileWriteObj_gdIOCtx {
+    gdIOCtx ctx;
+    PyObject *fileIfaceObj;
+    PyObject *exc_type, *exc_value, *exc_tb;  /* first write() failure */
+    long total;                               /* bytes accepted so far */
+    imageobject *image;                       /* image being encoded, if any */
+    int used;
+    char buf[WRITE_CHUNK];
+};
+
+/* pass any buffered data to write(); must be called with the GIL held */
+
+static int PyFileWriteObj_IOCtx_Flush(struct PyFileWriteObj_gdIOCtx *pctx)
+{
+    PyObject *rv;
+
+    if (pctx->used && !pctx->exc_type) {
+        rv = PyObject_CallMethod(pctx->fileIfaceObj, "write", "s#",
+            pctx->buf, pctx->used);
+        if (rv) {
+            Py_DECREF(rv);
+        } else {
+            /* hang on to the exception until gd is done with us */
+            PyErr_Fetch(&pctx->exc_type, &pctx->exc_value, &pctx->exc_tb);
+        }
+    }
+    pctx->used = 0;
+    return pctx->exc_type == NULL;
+}
+
+int PyFileWriteObj_IOCtx_PutBuf(gdIOCtx *ctx, const void *data, int size)
+{
+    struct PyFileWriteObj_gdIOCtx *pctx = (struct PyFileWriteObj_gdIOCtx *)ctx;
+    const char *p = (const char *)data;
+    PyGILState_STATE gstate;
+    int n, left = size;
+
+    while (left > 0) {
+        if (pctx->used == WRITE_CHUNK) {
+            gstate = PyGILState_Ensure();
+            if (pctx->image)
+                pctx->image->writer = PyThread_get_thread_ident();
+            PyFileWriteObj_IOCtx_Flush(pctx);
+            if (pctx->image)
+                pctx->image->writer = 0;
+            PyGILState_Release(gstate);
+        }
+        if (pctx->exc_type)
+            return 0;
+        n = MIN(left, WRITE_CHUNK - pctx->used);
+        memcpy(pctx->buf + pctx->used, p, n);
+        pctx->used += n;
+        pctx->total += n;
+        p += n;
+        left -= n;
+    }
+    return size;
+}
+
+void PyFileWriteObj_IOCtx_PutC(gdIOCtx *ctx, int c)
+{
+    unsigned char b = (unsigned char)c;
+
+    PyFileWriteObj_IOCtx_PutBuf(ctx, &b, 1);
+}
+
+void PyFileWriteObj_IOCtx_Free(gdIOCtx *ctx)
+{
+    struct PyFileWriteObj_gdIOCtx *pctx = (struct PyFileWriteObj_gdIOCtx *)ctx;
+
+    Py_CLEAR(pctx->fileIfaceObj);
+    Py_CLEAR(pctx->exc_type);
+    Py_CLEAR(pctx->exc_value);
+    Py_CLEAR(pctx->exc_tb);
+}
+
+struct PyFileWriteObj_gdIOCtx *alloc_PyFileWriteObj_IOCtx(PyObject *fileIfaceObj)
+{
+    struct PyFileWriteObj_gdIOCtx *pctx;
+
+    pctx = calloc(1, sizeof(struct PyFileWriteObj_gdIOCtx));
+    if (!pctx)
+        return NULL;
+    pctx->ctx.putC = PyFileWriteObj_IOCtx_PutC;
+    pctx->ctx.putBuf = PyFileWriteObj_IOCtx_PutBuf;
+    pctx->ctx.gd_free = PyFileWriteObj_IOCtx_Free;
+    Py_INCREF(fileIfaceObj);
+    pctx->fileIfaceObj = fileIfaceObj;
+    return pctx;
+}
+
+/* if a write() call failed, raise its exception and return 0.  the GIL
+ * must be held. */
+
+static int PyFileWriteObj_IOCtx_Raise(struct PyFileWriteObj_gdIOCtx *pctx)
+{
+    if (!pctx->exc_type)
+        return 1;
+    PyErr_Restore(pctx->exc_type, pctx->exc_value, pctx->exc_tb);
+    pctx->exc_type = pctx->exc_value = pctx->exc_tb = NULL;
+    return 0;
+}
+
+/* flush and free the context.  returns 0 with the python exception set
+ * if any write() call failed.  the GIL must be held. */
+
+int free_PyFileWriteObj_IOCtx(struct PyFileWriteObj_gdIOCtx *pctx)
+{
+    int ok;
+
+    PyFileWriteObj_IOCtx_Flush(pctx);
+    ok = PyFileWriteObj_IOCtx_Raise(pctx);
+    pctx->ctx.gd_free((gdIOCtxPtr)pctx);
+    free(pctx);
+    return ok;
+}
+
+/* the encoded output cache, below */
+static int cache_enabled(char fmt);
+static void *cache_encode(gdImagePtr im, char fmt, int arg1, int arg2, int *size);
+
 static PyObject *write_file(imageobject *img, PyObject *args, char fmt)
 {
-    char *filename;
+    char *filename, *unsupported = NULL;
     PyObject *fileobj;
     FILE *fp = NULL;
-    int closeme = 0, use_fileobj_write = 0;
+    int closeme = 0, use_fileobj_write = 0, pyfile = 0;
     int arg1 = -1, arg2 = -1;
     int filesize = 0;
     void *filedata = NULL;
+    struct PyFileWriteObj_gdIOCtx *wctx = NULL;
 
     if(PyArg_ParseTuple(args, "O!|ii", &PyFile_Type, &fileobj, &arg1, &arg2)) {
         fp = PyFile_AsFile(fileobj);
+        pyfile = 1;
     } else if(PyErr_Clear(), PyArg_ParseTuple(args, "z|ii", &filename, &arg1, &arg2)) {
         if((fp = fopen(filename, "wb"))) {
             closeme = 1;
@@ -227,44 +732,99 @@ static PyObject *write_file(imageobject *img, PyObject *args, char fmt)
     else
         return NULL;
 
+    if (cache_enabled(fmt)) {
+        /* same defaults as below, so that equal requests are equal */
+        if (fmt == 'G') {
+            if(arg1 == -1) arg1 = 0;
+            if(arg2 != GD2_FMT_RAW && arg2 != GD2_FMT_COMPRESSED)
+                arg2 = GD2_FMT_COMPRESSED;
+        }
+        if (fmt == 'w' && arg1 == -1)
+            arg1 = 0;
+
+        if(pyfile)
+            PyFile_IncUseCount((PyFileObject *)fileobj);
+
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(img->lock, WAIT_LOCK);
+        filedata = cache_encode(img->imagedata, fmt, arg1, arg2, &filesize);
+        PyThread_release_lock(img->lock);
+        if (fp && filedata)
+            fwrite(filedata, 1, filesize, fp);
+        if (closeme)
+            fclose(fp);
+        Py_END_ALLOW_THREADS
+
+        if(pyfile)
+            PyFile_DecUseCount((PyFileObject *)fileobj);
+
+        /* as with the encoders below, a failed encoding writes nothing */
+        if (use_fileobj_write && filedata) {
+            PyObject *noerr;
+            noerr = PyObject_CallMethod(fileobj, "write", "s#", filedata, filesize);
+            free(filedata);
+            if (noerr == NULL)
+                return NULL;
+            Py_DECREF(noerr);
+        } else {
+            free(filedata);
+        }
+
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    /* formats gd can write to a gdIOCtx are streamed to the write()
+     * method; gd and gd2 have no public context writer and still go
+     * through a memory buffer */
+    if (use_fileobj_write && fmt != 'g' && fmt != 'G') {
+        if (!(wctx = alloc_PyFileWriteObj_IOCtx(fileobj)))
+            return PyErr_NoMemory();
+        wctx->image = img;
+    }
+
+    /* the encoders don't touch any Python objects, so they run without
+     * the GIL; a Python file object is pinned so it can't be closed
+     * underneath us in the meantime */
+
+    if(pyfile)
+        PyFile_IncUseCount((PyFileObject *)fileobj);
+
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(img->lock, WAIT_LOCK);
+
     switch(fmt) {
     case 'f' : /* gif */
 #ifdef HAVE_LIBGIF
-        if (use_fileobj_write) {
-            filedata = gdImageGifPtr(img->imagedata, &filesize);
+        if (wctx) {
+            gdImageGifCtx(img->imagedata, (gdIOCtxPtr)wctx);
         } else {
             gdImageGif(img->imagedata, fp);
         }
 #else
-        PyErr_SetString(PyExc_NotImplementedError,
-                    "GIF Support Not Available");
-        return NULL;
+        unsupported = "GIF Support Not Available";
 #endif
         break;
     case 'p' : /* png */
 #ifdef HAVE_LIBPNG
-        if (use_fileobj_write) {
-            filedata = gdImagePngPtr(img->imagedata, &filesize);
+        if (wctx) {
+            gdImagePngCtxEx(img->imagedata, (gdIOCtxPtr)wctx, arg1);
         } else {
-            gdImagePng(img->imagedata, fp);
+            gdImagePngEx(img->imagedata, fp, arg1);
         }
 #else
-        PyErr_SetString(PyExc_NotImplementedError,
-                    "PNG Support Not Available");
-        return NULL;
+        unsupported = "PNG Support Not Available";
 #endif
         break;
     case 'j' : /* jpeg */
 #ifdef HAVE_LIBJPEG
-        if (use_fileobj_write) {
-            filedata = gdImageJpegPtr(img->imagedata, &filesize, arg1);
+        if (wctx) {
+            gdImageJpegCtx(img->imagedata, (gdIOCtxPtr)wctx, arg1);
         } else {
             gdImageJpeg(img->imagedata, fp, arg1);
         }
 #else
-        PyErr_SetString(PyExc_NotImplementedError,
-                    "JPEG Support Not Available");
-        return NULL;
+        unsupported = "JPEG Support Not Available";
 #endif
         break;
     case 'g' : /* gd */
@@ -287,1827 +847,8413 @@ static PyObject *write_file(imageobject *img, PyObject *args, char fmt)
     case 'w' : /* wbmp */
         if(arg1 == -1)
             arg1 = 0;
-        if (use_fileobj_write) {
-	  //filedata = gdImageWBMPPtr(img->imagedata, &filesize, arg1);
+        if (wctx) {
+            gdImageWBMPCtx(img->imagedata, arg1, (gdIOCtxPtr)wctx);
         } else {
             gdImageWBMP(img->imagedata, arg1, fp);
         }
         break;
     }
 
-    if (use_fileobj_write || filedata) {
+    PyThread_release_lock(img->lock);
+    if (closeme)
+        fclose(fp);
+    Py_END_ALLOW_THREADS
+
+    if(pyfile)
+        PyFile_DecUseCount((PyFileObject *)fileobj);
+
+    if (wctx && !free_PyFileWriteObj_IOCtx(wctx))
+        return NULL;
+
+    if(unsupported) {
+        PyErr_SetString(PyExc_NotImplementedError, unsupported);
+        return NULL;
+    }
+
+    if (filedata) {
         PyObject *noerr;
         noerr = PyObject_CallMethod(fileobj, "write", "s#", filedata, filesize);
         gdFree(filedata);
         if (noerr == NULL)
             return NULL;
-    } else if (closeme) {
-        fclose(fp);
+        Py_DECREF(noerr);
     }
 
     Py_INCREF(Py_None);
     return Py_None;
 }
 
+#ifdef HAVE_LIBPNG
 /*
-** Methods for the image type
+** PNG compression settings.  level is a zlib level (-1 for zlib's
+** default) or the name of a preset; strategy names the row filters
+** libpng may choose from.  gd's own PNG writer only takes the level.
 */
 
-imageobject *makeGDImage(gdImagePtr imagedata)
-    {
-    gdImagePtr newimg = gdImageCreate(gdImageSX(imagedata),
-      gdImageSY(imagedata));
-    imageobject *rval = 0;
-    gdImageCopy(newimg, imagedata, 0, 0, 0, 0, gdImageSX(imagedata),
-      gdImageSY(imagedata));
+static struct {
+    char *name;
+    int level, filters;
+} png_presets[] = {
+    {"fast",     1, PNG_FILTER_UP},
+    {"balanced", 6, PNG_ALL_FILTERS},
+    {"small",    9, PNG_ALL_FILTERS},
+    {NULL}
+};
 
-    if (!(rval = PyObject_NEW(imageobject, &Imagetype)))
-        return NULL;
+static struct {
+    char *name;
+    int filters;
+} png_strategies[] = {
+    {"none",     PNG_FILTER_NONE},
+    {"sub",      PNG_FILTER_SUB},
+    {"up",       PNG_FILTER_UP},
+    {"average",  PNG_FILTER_AVG},
+    {"paeth",    PNG_FILTER_PAETH},
+    {"adaptive", PNG_ALL_FILTERS},
+    {NULL}
+};
 
-    rval->current_tile = rval->current_brush = NULL;
-    rval->origin_x = rval->origin_y = 0;
-    rval->multiplier_x = rval->multiplier_y = 1;
-    rval->imagedata = newimg;
-    return rval;
-    }
+/* parse level and strategy objects (either may be NULL or None); sets
+ * *filters to -1 to leave the filters to libpng */
 
+static int png_options(PyObject *levelObj, PyObject *strategyObj,
+    int *level, int *filters)
+{
+    char *name;
+    int i;
 
-/*** I/O Methods ***/
+    *level = -1;
+    *filters = -1;
+
+    if(levelObj && levelObj != Py_None) {
+        if(PyString_Check(levelObj)) {
+            name = PyString_AS_STRING(levelObj);
+            for(i = 0; png_presets[i].name; i++)
+                if(strcmp(name, png_presets[i].name) == 0)
+                    break;
+            if(!png_presets[i].name) {
+                PyErr_Format(PyExc_ValueError,
+                    "unknown PNG preset %s (fast, balanced or small)", name);
+                return 0;
+            }
+            *level = png_presets[i].level;
+            *filters = png_presets[i].filters;
+        } else {
+            *level = PyInt_AsLong(levelObj);
+            if(*level == -1 && PyErr_Occurred())
+                return 0;
+            if(*level < -1 || *level > 9) {
+                PyErr_SetString(PyExc_ValueError,
+                    "PNG compression level must be -1 to 9");
+                return 0;
+            }
+        }
+    }
 
-static PyObject *image_writegif(imageobject *self, PyObject *args)
-{
-    return write_file(self, args, 'f');
+    if(strategyObj && strategyObj != Py_None) {
+        name = PyString_Check(strategyObj) ? PyString_AS_STRING(strategyObj) : "";
+        for(i = 0; png_strategies[i].name; i++)
+            if(strcmp(name, png_strategies[i].name) == 0)
+                break;
+        if(!png_strategies[i].name) {
+            PyErr_SetString(PyExc_ValueError,
+                "PNG strategy must be none, sub, up, average, paeth or adaptive");
+            return 0;
+        }
+        *filters = png_strategies[i].filters;
+    }
+
+    return 1;
 }
 
+/*
+** PngWriter: a PNG encoder which is fed the image a band of rows at a
+** time, so that very large images can be produced without ever being
+** held in memory whole.  libpng is driven directly; its output goes
+** through a PyFileWriteObj_gdIOCtx, so the compressed data is passed
+** to write() in chunks as each band is compressed.
+*/
 
-static PyObject *image_writepng(imageobject *self, PyObject *args)
+typedef struct {
+    PyObject_HEAD
+    png_structp png;
+    png_infop info;
+    struct PyFileWriteObj_gdIOCtx *wctx;
+    int width, height, alpha;
+    int rows;                   /* rows written so far */
+    long bytes;                 /* bytes passed on to write() */
+    png_bytep row;              /* one row of RGB(A) output */
+    int failed;
+    int busy;                   /* libpng is running without the GIL */
+    char errmsg[128];
+} pngwriterobject;
+
+staticforward PyTypeObject PngWritertype;
+
+static void pngwriter_error(png_structp png, png_const_charp msg)
 {
-    return write_file(self, args, 'p');
-}
+    pngwriterobject *self = (pngwriterobject *)png_get_error_ptr(png);
 
+    strncpy(self->errmsg, msg, sizeof(self->errmsg) - 1);
+    longjmp(png_jmpbuf(png), 1);
+}
 
-static PyObject *image_writejpeg(imageobject *self, PyObject *args)
+static void pngwriter_warning(png_structp png, png_const_charp msg)
 {
-    return write_file(self, args, 'j');
 }
 
-
-static PyObject *image_writegd(imageobject *self, PyObject *args)
+static void pngwriter_write(png_structp png, png_bytep data, png_size_t len)
 {
-    return write_file(self, args, 'g');
-}
+    pngwriterobject *self = (pngwriterobject *)png_get_io_ptr(png);
 
+    PyFileWriteObj_IOCtx_PutBuf((gdIOCtxPtr)self->wctx, data, (int)len);
+    if (self->wctx->exc_type)
+        png_error(png, "write() failed");
+    self->bytes += len;
+}
 
-static PyObject *image_writegd2(imageobject *self, PyObject *args)
+static void pngwriter_flush(png_structp png)
 {
-    return write_file(self, args, 'G');
 }
 
+/* convert row y of im to RGB or RGBA in out, the way gd's own PNG
+ * writer maps gd's 7 bit alpha to PNG's 8 bit alpha */
 
-static PyObject *image_writewbmp(imageobject *self, PyObject *args)
+static void png_convert_row(png_bytep out, gdImagePtr im, int y, int alpha)
 {
-    return write_file(self, args, 'w');
+    int x, c, a;
+
+    for (x = 0; x < im->sx; x++) {
+        if (im->trueColor) {
+            c = im->tpixels[y][x];
+            *out++ = gdTrueColorGetRed(c);
+            *out++ = gdTrueColorGetGreen(c);
+            *out++ = gdTrueColorGetBlue(c);
+            a = gdTrueColorGetAlpha(c);
+        } else {
+            c = im->pixels[y][x];
+            *out++ = im->red[c];
+            *out++ = im->green[c];
+            *out++ = im->blue[c];
+            a = (c == im->transparent) ? gdAlphaTransparent : im->alpha[c];
+        }
+        if (alpha)
+            *out++ = (a == gdAlphaTransparent) ? 0 : 255 - ((a << 1) + (a >> 6));
+    }
 }
 
+/*
+** Whole truecolor images written by libpng rather than gd, for
+** writePng() with a row filter strategy, which gd's writer can't set.
+** The output is what gd would write: RGB, or RGBA if the image saves
+** alpha, with the transparent color in a tRNS chunk otherwise, and
+** interlaced if the image is.  Written to fp, or through wctx.
+*/
 
-/*** Drawing Methods ***/
+struct png_sink {
+    FILE *fp;
+    struct PyFileWriteObj_gdIOCtx *wctx;
+    char errmsg[128];
+};
 
-static PyObject *image_setpixel(imageobject *self, PyObject *args)
+static void png_sink_error(png_structp png, png_const_charp msg)
 {
-    int x,y,color;
+    struct png_sink *sink = (struct png_sink *)png_get_error_ptr(png);
 
-    if(!PyArg_ParseTuple(args, "(ii)i", &x, &y, &color))
-        return NULL;
+    strncpy(sink->errmsg, msg, sizeof(sink->errmsg) - 1);
+    longjmp(png_jmpbuf(png), 1);
+}
 
-    gdImageSetPixel(self->imagedata, X(x), Y(y), color);
+static void png_sink_write(png_structp png, png_bytep data, png_size_t len)
+{
+    struct png_sink *sink = (struct png_sink *)png_get_io_ptr(png);
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    PyFileWriteObj_IOCtx_PutBuf((gdIOCtxPtr)sink->wctx, data, (int)len);
+    if (sink->wctx->exc_type)
+        png_error(png, "write() failed");
 }
 
+/* returns 0 with sink->errmsg set on failure.  called without the GIL,
+ * with the image locked. */
 
-static PyObject *image_line(imageobject *self, PyObject *args)
+static int png_encode(gdImagePtr im, int level, int filters, struct png_sink *sink)
 {
-    int sx,sy,ex,ey,color;
+    png_structp png;
+    png_infop info = NULL;
+    png_bytep row;
+    png_color_16 trans;
+    volatile int ok = 1;
+    int alpha = im->saveAlphaFlag, passes, y;
+
+    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, sink,
+        png_sink_error, pngwriter_warning);
+    row = malloc(im->sx * (alpha ? 4 : 3));
+    if (!png || !(info = png_create_info_struct(png)) || !row) {
+        strcpy(sink->errmsg, "out of memory");
+        if (png)
+            png_destroy_write_struct(&png, &info);
+        free(row);
+        return 0;
+    }
 
-    if(!PyArg_ParseTuple(args, "(ii)(ii)i", &sx, &sy, &ex, &ey, &color))
-        return NULL;
-    gdImageLine(self->imagedata, X(sx), Y(sy), X(ex), Y(ey), color);
+    if (setjmp(png_jmpbuf(png))) {
+        ok = 0;
+    } else {
+        if (sink->fp)
+            png_init_io(png, sink->fp);
+        else
+            png_set_write_fn(png, sink, png_sink_write, pngwriter_flush);
+        png_set_compression_level(png, level);
+        if (filters != -1)
+            png_set_filter(png, PNG_FILTER_TYPE_BASE, filters);
+        png_set_IHDR(png, info, im->sx, im->sy, 8,
+            alpha ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB,
+            im->interlace ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE,
+            PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        if (!alpha && im->transparent >= 0) {
+            trans.red = gdTrueColorGetRed(im->transparent);
+            trans.green = gdTrueColorGetGreen(im->transparent);
+            trans.blue = gdTrueColorGetBlue(im->transparent);
+            png_set_tRNS(png, info, NULL, 0, &trans);
+        }
+        png_write_info(png, info);
+        passes = png_set_interlace_handling(png);
+        while (passes-- > 0) {
+            for (y = 0; y < im->sy; y++) {
+                png_convert_row(row, im, y, alpha);
+                png_write_row(png, row);
+            }
+        }
+        png_write_end(png, info);
+    }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    png_destroy_write_struct(&png, &info);
+    free(row);
+    return ok;
 }
 
-static PyObject *image_lines(imageobject *self, PyObject *args)
-{
-    int color,i,N;
-    long sx,sy,ex,ey;
-    PyObject *seq;
-    PyObject *lastTup, *thisTup;
+/* writePng() through png_encode(), to a file, a file name or an object
+ * with a write() method */
 
-    if(!PyArg_ParseTuple(args, "Oi", &seq, &color))
+static PyObject *write_png_filtered(imageobject *img, PyObject *fileobj,
+    int level, int filters)
+{
+    struct png_sink sink;
+    int ok, closeme = 0, pyfile = 0;
+
+    memset(&sink, 0, sizeof(sink));
+    if (PyFile_Check(fileobj)) {
+        sink.fp = PyFile_AsFile(fileobj);
+        pyfile = 1;
+    } else if (PyString_Check(fileobj)) {
+        if (!(sink.fp = fopen(PyString_AS_STRING(fileobj), "wb"))) {
+            PyErr_SetFromErrno(PyExc_IOError);
+            return NULL;
+        }
+        closeme = 1;
+    } else if (PyObject_HasAttrString(fileobj, "write")) {
+        if (!(sink.wctx = alloc_PyFileWriteObj_IOCtx(fileobj)))
+            return PyErr_NoMemory();
+        sink.wctx->image = img;
+    } else {
+        PyErr_SetString(ErrorObject, "first argument must be a file, string or object with a write method");
         return NULL;
-
-    seq = PySequence_Fast(seq, NULL);
-    N = PySequence_Length(seq);
-    if (N<2) {
-      PyErr_SetString(PyExc_ValueError,
-                    "lines() requires sequence of len(2) or greater");
-      return NULL;
     }
-    
-    lastTup = PySequence_GetItem(seq, 0);
-    sx = X(PyInt_AsLong(PySequence_GetItem(lastTup, 0)));
-    sy = Y(PyInt_AsLong(PySequence_GetItem(lastTup, 1)));
 
-    for (i=0; i<N; ++i) {
-      thisTup = PySequence_GetItem(seq, i);
-      ex = X(PyInt_AsLong(PySequence_GetItem(thisTup, 0)));
-      ey = Y(PyInt_AsLong(PySequence_GetItem(thisTup, 1)));
-      gdImageLine(self->imagedata, sx, sy, ex, ey, color);
-      sx = ex;
-      sy = ey;
-   }
+    if (pyfile)
+        PyFile_IncUseCount((PyFileObject *)fileobj);
+
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(img->lock, WAIT_LOCK);
+    ok = png_encode(img->imagedata, level, filters, &sink);
+    PyThread_release_lock(img->lock);
+    if (closeme)
+        fclose(sink.fp);
+    Py_END_ALLOW_THREADS
+
+    if (pyfile)
+        PyFile_DecUseCount((PyFileObject *)fileobj);
+
+    /* a failed write() is the more useful error */
+    if (sink.wctx && !free_PyFileWriteObj_IOCtx(sink.wctx))
+        return NULL;
+    if (!ok) {
+        PyErr_SetString(ErrorObject, sink.errmsg);
+        return NULL;
+    }
 
     Py_INCREF(Py_None);
     return Py_None;
 }
 
+/* only one thread at a time may drive a writer's png_struct; checked
+ * and set with the GIL held */
 
-static PyObject *image_polygon(imageobject *self, PyObject *args)
+static int pngwriter_claim(pngwriterobject *self)
 {
-    PyObject *point, *points;
-    gdPointPtr gdpoints;
-    int size, color, i, fillcolor = -1;
-
-    if(!PyArg_ParseTuple(args, "O!i|i", &PyTuple_Type, &points, &color, &fillcolor)) {
-        PyErr_Clear();
-        if(PyArg_ParseTuple(args, "O!i|i", &PyList_Type, &points, &color, &fillcolor))
-            points=PyList_AsTuple(points);
-        else
-            return NULL;
+    if (self->busy) {
+        PyErr_SetString(ErrorObject, "PngWriter is in use by another call");
+        return 0;
+    }
+    if (self->failed || !self->png) {
+        PyErr_SetString(ErrorObject, "PngWriter is closed");
+        return 0;
     }
+    return 1;
+}
 
-    size = PyTuple_Size(points);
+static PyObject *pngwriter_writerows(pngwriterobject *self, PyObject *args)
+{
+    imageobject *img;
+    int y0 = 0, n = -1, y;
+    volatile int ok = 1;
 
-    gdpoints = (gdPointPtr)calloc(size,sizeof(gdPoint));
+    if (!PyArg_ParseTuple(args, "O!|(ii)", &Imagetype, &img, &y0, &n))
+        return NULL;
+    if (!image_check(img))
+        return NULL;
 
-    for(i=0; i<size; i++) {
-        point = PyTuple_GET_ITEM(points,i);
-        gdpoints[i].x = X(PyInt_AS_LONG((PyIntObject *)PyTuple_GET_ITEM(point,0)));
-        gdpoints[i].y = Y(PyInt_AS_LONG((PyIntObject *)PyTuple_GET_ITEM(point,1)));
+    if (!pngwriter_claim(self))
+        return NULL;
+    if (gdImageSX(img->imagedata) != self->width) {
+        PyErr_SetString(PyExc_ValueError, "image width does not match the PNG width");
+        return NULL;
+    }
+    if (n == -1)
+        n = gdImageSY(img->imagedata) - y0;
+    if (y0 < 0 || n < 0 || y0 + n > gdImageSY(img->imagedata)) {
+        PyErr_SetString(PyExc_ValueError, "rows out of range");
+        return NULL;
+    }
+    if (self->rows + n > self->height) {
+        PyErr_SetString(PyExc_ValueError, "more rows than the PNG height");
+        return NULL;
     }
 
-    if(fillcolor != -1)
-        gdImageFilledPolygon(self->imagedata, gdpoints, size, fillcolor);
-
-    gdImagePolygon(self->imagedata, gdpoints, size, color);
-
-    free(gdpoints);
+    self->busy = 1;
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(img->lock, WAIT_LOCK);
+    self->wctx->image = img;
+    if (setjmp(png_jmpbuf(self->png))) {
+        ok = 0;
+    } else {
+        for (y = y0; y < y0 + n; y++) {
+            png_convert_row(self->row, img->imagedata, y, self->alpha);
+            png_write_row(self->png, self->row);
+            self->rows++;
+        }
+    }
+    self->wctx->image = NULL;
+    PyThread_release_lock(img->lock);
+    Py_END_ALLOW_THREADS
+    self->busy = 0;
+
+    if (!ok) {
+        self->failed = 1;
+        if (PyFileWriteObj_IOCtx_Raise(self->wctx))
+            PyErr_SetString(ErrorObject, self->errmsg);
+        return NULL;
+    }
 
     Py_INCREF(Py_None);
     return Py_None;
 }
 
-
-static PyObject *image_rectangle(imageobject *self, PyObject *args)
+static PyObject *pngwriter_close(pngwriterobject *self)
 {
-    int tx,ty,bx,by,t,color,fillcolor,fill=0;
+    volatile int ok = 1;
 
-    if(PyArg_ParseTuple(args, "(ii)(ii)ii", &tx, &ty, &bx, &by, &color, &fillcolor))
-        fill=1;
-    else if(PyErr_Clear(), !PyArg_ParseTuple(args, "(ii)(ii)i", &tx, &ty, &bx, &by, &color))
+    if (!pngwriter_claim(self))
+        return NULL;
+    if (self->rows != self->height) {
+        PyErr_Format(PyExc_ValueError, "only %d of %d rows written",
+            self->rows, self->height);
         return NULL;
-
-    tx = X(tx); ty = Y(ty);
-    bx = X(bx); by = Y(by);
-
-    if(tx > bx) {
-        t = tx;
-        tx = bx;
-        bx = t;
     }
 
-    if(ty > by) {
-        t = ty;
-        ty = by;
-        by = t;
-    }
+    self->busy = 1;
+    Py_BEGIN_ALLOW_THREADS
+    if (setjmp(png_jmpbuf(self->png)))
+        ok = 0;
+    else
+        png_write_end(self->png, self->info);
+    Py_END_ALLOW_THREADS
+    self->busy = 0;
 
-    if(fill)
-        gdImageFilledRectangle(self->imagedata, tx, ty, bx, by, fillcolor);
+    png_destroy_write_struct(&self->png, &self->info);
+    self->png = NULL;
 
-    gdImageRectangle(self->imagedata, tx, ty, bx, by, color);
+    if (!ok || !PyFileWriteObj_IOCtx_Flush(self->wctx)) {
+        self->failed = 1;
+        if (PyFileWriteObj_IOCtx_Raise(self->wctx))
+            PyErr_SetString(ErrorObject, self->errmsg);
+        return NULL;
+    }
 
     Py_INCREF(Py_None);
     return Py_None;
 }
 
+static PyObject *pngwriter_byteswritten(pngwriterobject *self)
+{
+    return Py_BuildValue("l", self->bytes);
+}
 
-static PyObject *image_filledpolygon(imageobject *self, PyObject *args)
+static PyObject *pngwriter_rowswritten(pngwriterobject *self)
 {
-    PyObject *point, *points;
-    gdPointPtr gdpoints;
-    int size, color, i;
+    return Py_BuildValue("i", self->rows);
+}
 
-    if(!PyArg_ParseTuple(args, "O!i", &PyTuple_Type, &points, &color)) {
-        PyErr_Clear();
-        if(PyArg_ParseTuple(args, "O!i", &PyList_Type, &points, &color))
-            points=PyList_AsTuple(points);
-        else
-            return NULL;
-    }
+static struct PyMethodDef pngwriter_methods[] = {
 
-    size = PyTuple_Size(points);
-    gdpoints = (gdPointPtr)calloc(size,sizeof(gdPoint));
+ {"writeRows",    (PyCFunction)pngwriter_writerows,    1,
+    "writeRows(image[, (y,n)])\n"
+    "compress the rows of image (or n rows starting at row y) and append\n"
+    "them to the PNG.  image must be as wide as the PNG."},
 
-    for(i = 0; i < size; i++) {
-        point = PyTuple_GET_ITEM(points,i);
-        gdpoints[i].x = X(PyInt_AS_LONG((PyIntObject *)PyTuple_GET_ITEM(point,0)));
-        gdpoints[i].y = Y(PyInt_AS_LONG((PyIntObject *)PyTuple_GET_ITEM(point,1)));
-    }
-    gdImageFilledPolygon(self->imagedata, gdpoints, size, color);
-    free(gdpoints);
+ {"close",    (PyCFunction)pngwriter_close,    1,
+    "close()\n"
+    "finish the PNG; all of its rows must have been written."},
 
-    Py_DECREF(points);
+ {"bytesWritten",    (PyCFunction)pngwriter_byteswritten,    1,
+    "bytesWritten()\n"
+    "returns the number of bytes of PNG data produced so far"},
 
-    Py_INCREF(Py_None);
-    return Py_None;
-}
+ {"rowsWritten",    (PyCFunction)pngwriter_rowswritten,    1,
+    "rowsWritten()\n"
+    "returns the number of rows written so far"},
 
+ {NULL,        NULL}        /* sentinel */
+};
 
-static PyObject *image_filledrectangle(imageobject *self, PyObject *args)
+static void pngwriter_dealloc(pngwriterobject *self)
 {
-    int tx,ty,bx,by,t,color;
+    if (self->png)
+        png_destroy_write_struct(&self->png, &self->info);
+    if (self->wctx) {
+        if (!free_PyFileWriteObj_IOCtx(self->wctx))
+            PyErr_Clear();
+    }
+    free(self->row);
+    PyObject_DEL(self);
+}
 
-    if(!PyArg_ParseTuple(args, "(ii)(ii)i", &tx, &ty, &bx, &by, &color))
-        return NULL;
-    tx = X(tx); ty = Y(ty);
-    bx = X(bx); by = Y(by);
-    if(tx > bx) {t=tx;tx=bx;bx=t;}
-    if(ty > by) {t=ty;ty=by;by=t;}
-    gdImageFilledRectangle(self->imagedata, tx, ty, bx, by, color);
-    Py_INCREF(Py_None);
-    return Py_None;
+static PyObject *pngwriter_getattr(PyObject *self, char *name)
+{
+    return Py_FindMethod(pngwriter_methods, self, name);
 }
 
+static PyTypeObject PngWritertype = {
+    PyObject_HEAD_INIT(NULL)
+    0,                                  /*ob_size*/
+    "PngWriter",                        /*tp_name*/
+    sizeof(pngwriterobject),            /*tp_basicsize*/
+    0,                                  /*tp_itemsize*/
+    /* methods */
+    (destructor)pngwriter_dealloc,      /*tp_dealloc*/
+    0,                                  /*tp_print*/
+    (getattrfunc)pngwriter_getattr,     /*tp_getattr*/
+};
 
-static PyObject *image_arc(imageobject *self, PyObject *args)
+static PyObject *gd_pngwriter(PyObject *module, PyObject *args, PyObject *kwds)
 {
-    int cx, cy, w, h, s, e, color, i;
+    static char *kwlist[] = {"f", "size", "alpha", "level", "window",
+        "strategy", NULL};
+    pngwriterobject *self;
+    PyObject *fileobj, *levelObj = NULL, *strategyObj = NULL;
+    int w, h, alpha = 0, level, filters, window = 15;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O(ii)|iOiO", kwlist,
+            &fileobj, &w, &h, &alpha, &levelObj, &window, &strategyObj))
+        return NULL;
+    if (!png_options(levelObj, strategyObj, &level, &filters))
+        return NULL;
 
-    if(!PyArg_ParseTuple(args, "(ii)(ii)iii", &cx, &cy, &w, &h, &s, &e, &color))
+    if (!PyObject_HasAttrString(fileobj, "write")) {
+        PyErr_SetString(ErrorObject, "first argument must be an object with a write method");
         return NULL;
-    if(e<s) {i=e;e=s;s=i;}
-    gdImageArc(self->imagedata, X(cx), Y(cy), W(w), H(h), s, e, color);
-    Py_INCREF(Py_None);
-    return Py_None;
-}
+    }
+    if (w <= 0 || h <= 0) {
+        PyErr_SetString(PyExc_ValueError, "dimensions must be positive");
+        return NULL;
+    }
+    if (window < 8 || window > 15) {
+        PyErr_SetString(PyExc_ValueError, "window must be 8 to 15");
+        return NULL;
+    }
 
-static PyObject *image_filledarc(imageobject *self, PyObject *args)
-{
-#if GD2_VERS <= 1
-    PyErr_SetString(PyExc_NotImplementedError,
-                    "filledArc() requires gd 2.0 or later");
-    return NULL;
-#else
-    int cx, cy, w, h, s, e, color, i, style;
+    if (!(self = PyObject_NEW(pngwriterobject, &PngWritertype)))
+        return NULL;
 
-    if(!PyArg_ParseTuple(args, "(ii)(ii)iiii", &cx, &cy, &w, &h, &s,
-                         &e, &color, &style))
+    self->png = NULL;
+    self->info = NULL;
+    self->width = w;
+    self->height = h;
+    self->alpha = alpha != 0;
+    self->rows = 0;
+    self->bytes = 0;
+    self->failed = 0;
+    self->busy = 0;
+    self->errmsg[0] = '\0';
+    self->row = malloc(w * (self->alpha ? 4 : 3));
+    self->wctx = alloc_PyFileWriteObj_IOCtx(fileobj);
+
+    if (!self->row || !self->wctx) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+
+    self->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, self,
+        pngwriter_error, pngwriter_warning);
+    if (!self->png || !(self->info = png_create_info_struct(self->png))) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+
+    if (setjmp(png_jmpbuf(self->png))) {
+        if (PyFileWriteObj_IOCtx_Raise(self->wctx))
+            PyErr_SetString(ErrorObject, self->errmsg);
+        Py_DECREF(self);
         return NULL;
-    if(e<s) {i=e;e=s;s=i;}
-    gdImageFilledArc(self->imagedata, X(cx), Y(cy), W(w), H(h), s, e,
-                     color, style);
-    Py_INCREF(Py_None);
-    return Py_None;
+    }
+
+    png_set_write_fn(self->png, self, pngwriter_write, pngwriter_flush);
+    png_set_compression_level(self->png, level);
+    png_set_compression_window_bits(self->png, window);
+    if (filters != -1)
+        png_set_filter(self->png, PNG_FILTER_TYPE_BASE, filters);
+    png_set_IHDR(self->png, self->info, w, h, 8,
+        self->alpha ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB,
+        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+        PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(self->png, self->info);
+
+    return (PyObject *)self;
+}
 #endif
+
+static void copy_palette(gdImagePtr dst, gdImagePtr src)
+{
+    dst->colorsTotal = src->colorsTotal;
+    dst->transparent = src->transparent;
+    memcpy(dst->red, src->red, sizeof(src->red));
+    memcpy(dst->green, src->green, sizeof(src->green));
+    memcpy(dst->blue, src->blue, sizeof(src->blue));
+    memcpy(dst->alpha, src->alpha, sizeof(src->alpha));
+    memcpy(dst->open, src->open, sizeof(src->open));
 }
 
-static PyObject *image_filledellipse(imageobject *self, PyObject *args)
+/* copy the w x h rectangle at (x,y) of src to (dx,dy) in dst, which
+ * must be of the same kind; palettes are not touched */
+
+static void copy_rows(gdImagePtr dst, int dx, int dy, gdImagePtr src,
+    int x, int y, int w, int h)
 {
-#if GD2_VERS <= 1
-    PyErr_SetString(PyExc_NotImplementedError,
-                    "filledEllipse() requires gd 2.0 or later");
-    return NULL;
-#else
-    int cx, cy, w, h, color;
+    int i;
 
-    if(!PyArg_ParseTuple(args, "(ii)(ii)i", &cx, &cy, &w, &h, &color))
-        return NULL;
-    gdImageFilledEllipse(self->imagedata, X(cx), Y(cy), W(w), H(h), color);
-    Py_INCREF(Py_None);
-    return Py_None;
-#endif
+    for(i = 0; i < h; i++) {
+        if(src->trueColor)
+            memcpy(dst->tpixels[dy + i] + dx, src->tpixels[y + i] + x, w * sizeof(int));
+        else
+            memcpy(dst->pixels[dy + i] + dx, src->pixels[y + i] + x, w);
+    }
 }
 
-static PyObject *image_filltoborder(imageobject *self, PyObject *args)
+/* a new image holding the w x h rectangle at (x,y) of im */
+
+static gdImagePtr crop_image(gdImagePtr im, int x, int y, int w, int h)
 {
-    int x,y,border,color;
+    gdImagePtr c;
 
-    if(!PyArg_ParseTuple(args, "(ii)ii", &x,&y,&border,&color))
+    c = im->trueColor ? gdImageCreateTrueColor(w, h) : gdImageCreate(w, h);
+    if(!c)
         return NULL;
-    gdImageFillToBorder(self->imagedata, X(x),Y(y),border,color);
-    Py_INCREF(Py_None);
-    return Py_None;
+    if(!im->trueColor)
+        copy_palette(c, im);
+    else
+        c->transparent = im->transparent;
+    copy_rows(c, 0, 0, im, x, y, w, h);
+    return c;
 }
 
+/*
+** Resampling.  resample_copy() takes the place of gdImageCopyResampled
+** for truecolor images.  gd works out each destination pixel from
+** scratch in floating point; here the same area weights are found once
+** per destination row and column, as 14 bit fixed point numbers, and
+** the image is resampled in two passes, along the rows and then down
+** the columns.  Colors are weighted by opacity, as gd does, and the
+** results agree with gd's to within one step.
+**
+** The same two passes run the other filters copyResampledTo offers,
+** given their weights.  Weight tables depend only on the sizes and the
+** filter, so the most recently used ones are kept for reuse.
+*/
+
+#define RS_BITS 14
+#define RS_ONE (1 << RS_BITS)
 
-static PyObject *image_fill(imageobject *self, PyObject *args)
+enum { RS_BOX, RS_BILINEAR, RS_BICUBIC, RS_LANCZOS3 };
+
+static const char *rs_filters[] = {"box", "bilinear", "bicubic", "lanczos3", NULL};
+
+#define RS_CACHE 16             /* weight tables kept */
+
+typedef struct rs_axis {
+    int n;                      /* destination pixels */
+    int *start, *count;         /* source pixels for each one */
+    int *first;                 /* where each one's weights begin */
+    short *w;                   /* weights, summing to RS_ONE */
+    int S, filter, refs;        /* the rest for the cache */
+    struct rs_axis *prev, *next;
+} rs_axis;
+
+static rs_axis *rs_axis_new(int n, int nweights)
 {
-    int x,y,color;
+    rs_axis *a;
 
-    if(!PyArg_ParseTuple(args, "(ii)i", &x,&y,&color))
+    if(!(a = malloc(sizeof(rs_axis) + 3 * n * sizeof(int) + nweights * sizeof(short))))
         return NULL;
-    gdImageFill(self->imagedata, X(x),Y(y),color);
-    Py_INCREF(Py_None);
-    return Py_None;
+    a->n = n;
+    a->refs = 1;
+    a->prev = a->next = NULL;
+    a->start = (int *)(a + 1);
+    a->count = a->start + n;
+    a->first = a->count + n;
+    a->w = (short *)(a->first + n);
+    return a;
 }
 
+#define rs_axis_free(a) free(a)
 
-static PyObject *image_setbrush(imageobject *self, PyObject *args)
-{
-    imageobject *brush;
-    char *filename, *type; /* dummies */
+/* scale weight k of n so that they sum to exactly RS_ONE */
 
-    if(PyArg_ParseTuple(args, "z|z", &filename, &type))
-        brush = (imageobject *)newimageobject(args);
-    else if(PyErr_Clear(), PyArg_ParseTuple(args, "O!", &Imagetype, &brush))
-        Py_INCREF(brush);
-    else
-        return NULL;
-    if(self->current_brush){
-        Py_DECREF(self->current_brush);
+static void rs_normalize(short *w, const double *f, int n)
+{
+    double total = 0;
+    int k, sum = 0, big = 0;
+
+    for(k = 0; k < n; k++)
+        total += f[k];
+    for(k = 0; k < n; k++) {
+        w[k] = (short)floor(f[k] / total * RS_ONE + 0.5);
+        sum += w[k];
+        if(w[k] > w[big])
+            big = k;
     }
-    self->current_brush = brush;
-    gdImageSetBrush(self->imagedata, brush->imagedata);
-
-    Py_INCREF(Py_None);
-    return Py_None;
+    w[big] += RS_ONE - sum;
 }
 
+/* gd's weights for resampling S pixels to D: each destination pixel
+ * covers S/D source pixels, which count by how much of each it covers */
 
-static PyObject *image_setantialiased(imageobject *self, PyObject *args)
+static rs_axis *rs_box_weights(int S, int D)
 {
-    int c;
+    rs_axis *a;
+    double s, s1, s2, *f, portion;
+    int j, k, i0, max = S / D + 3, nw = 0;
 
-    if(!PyArg_ParseTuple(args, "i", &c))
+    if(!(a = rs_axis_new(D, max * D)))
+        return NULL;
+    if(!(f = malloc(max * sizeof(double)))) {
+        rs_axis_free(a);
         return NULL;
+    }
+
+    for(j = 0; j < D; j++) {
+        /* as gdImageCopyResampled */
+        s1 = (double)j * (double)S / (double)D;
+        s2 = (double)(j + 1) * (double)S / (double)D;
+        i0 = (int)floor(s1);
+        k = 0;
+        s = s1;
+        do {
+            if(floor(s) == floor(s1)) {
+                portion = 1.0 - (s - floor(s));
+                if(portion > s2 - s1)
+                    portion = s2 - s1;
+                s = floor(s);
+            } else if(s == floor(s2)) {
+                portion = s2 - floor(s2);
+            } else {
+                portion = 1.0;
+            }
+            if(portion > 0 && (int)s < S && k < max)
+                f[k++] = portion;
+            s += 1.0;
+        } while(s < s2);
+
+        a->start[j] = i0;
+        a->count[j] = k;
+        a->first[j] = nw;
+        rs_normalize(a->w + nw, f, k);
+        nw += k;
+    }
+    free(f);
+    return a;
+}
 
-    gdImageSetAntiAliased(self->imagedata, c);
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
 
-    Py_INCREF(Py_None);
-    return Py_None;
+static double rs_kernel(int filter, double x)
+{
+    x = fabs(x);
+    switch(filter) {
+    case RS_BILINEAR:
+        return x < 1 ? 1 - x : 0;
+    case RS_BICUBIC:            /* Catmull-Rom */
+        if(x < 1)
+            return (1.5 * x - 2.5) * x * x + 1;
+        if(x < 2)
+            return ((-0.5 * x + 2.5) * x - 4) * x + 2;
+        return 0;
+    case RS_LANCZOS3:
+        if(x < 1e-8)
+            return 1;
+        if(x < 3)
+            return 3 * sin(M_PI * x) * sin(M_PI * x / 3) / (M_PI * M_PI * x * x);
+        return 0;
+    }
+    return 0;
 }
 
+static const double rs_support[] = {0.5, 1, 2, 3};
 
+/* weights for resampling S pixels to D through a filter, which is
+ * widened when shrinking so that it covers every source pixel.  pixels
+ * beyond the edges repeat the edge pixels */
 
-static PyObject *image_setclip(imageobject *self, PyObject *args)
+static rs_axis *rs_filter_weights(int S, int D, int filter)
 {
-    int tx,ty,bx,by,t;
+    rs_axis *a;
+    double scale = (double)S / D, fscale = MAX(scale, 1.0);
+    double support = rs_support[filter] * fscale, center, *f;
+    int i, j, lo, hi, k0, k1, max = (int)ceil(support) * 2 + 2, nw = 0;
 
-    if(!PyArg_ParseTuple(args, "(ii)(ii)", &tx, &ty, &bx, &by))
+    if(!(a = rs_axis_new(D, max * D)))
+        return NULL;
+    if(!(f = malloc(max * sizeof(double)))) {
+        rs_axis_free(a);
         return NULL;
-
-    tx = X(tx); ty = Y(ty);
-    bx = X(bx); by = Y(by);
-
-    if(tx > bx) {
-        t = tx;
-        tx = bx;
-        bx = t;
     }
 
-    if(ty > by) {
-        t = ty;
-        ty = by;
-        by = t;
+    for(j = 0; j < D; j++) {
+        center = (j + 0.5) * scale - 0.5;
+        lo = (int)ceil(center - support);
+        hi = (int)floor(center + support);
+        k0 = MAX(lo, 0);
+        k1 = MIN(hi, S - 1);
+        if(k0 > k1)
+            k0 = k1 = MIN(MAX((int)floor(center + 0.5), 0), S - 1);
+        memset(f, 0, (k1 - k0 + 1) * sizeof(double));
+        for(i = lo; i <= hi; i++)
+            f[MIN(MAX(i, k0), k1) - k0] += rs_kernel(filter, (i - center) / fscale);
+
+        /* drop zero weights at the ends */
+        while(k1 > k0 && f[k1 - k0] == 0)
+            k1--;
+        for(i = 0; k0 + i < k1 && f[i] == 0; i++)
+            ;
+        if(i) {
+            memmove(f, f + i, (k1 - k0 - i + 1) * sizeof(double));
+            k0 += i;
+        }
+        if(f[0] == 0 && k0 == k1)
+            f[0] = 1;
+
+        a->start[j] = k0;
+        a->count[j] = k1 - k0 + 1;
+        a->first[j] = nw;
+        rs_normalize(a->w + nw, f, k1 - k0 + 1);
+        nw += k1 - k0 + 1;
     }
+    free(f);
+    return a;
+}
 
-    gdImageSetClip(self->imagedata, tx, ty, bx, by);
+static PyThread_type_lock rs_mutex;     /* guards the cache below */
+static rs_axis *rs_head, *rs_tail;      /* most recently used first */
+static int rs_entries;
 
-    Py_INCREF(Py_None);
-    return Py_None;
+static void rs_release(rs_axis *a)
+{
+    int refs;
+
+    if(!a)
+        return;
+    if(rs_mutex)
+        PyThread_acquire_lock(rs_mutex, WAIT_LOCK);
+    refs = --a->refs;
+    if(rs_mutex)
+        PyThread_release_lock(rs_mutex);
+    if(!refs)
+        rs_axis_free(a);
 }
 
+/* the following want rs_mutex held */
 
-static PyObject *image_settile(imageobject *self, PyObject *args)
+static void rs_unlink(rs_axis *a)
 {
-    imageobject *tile;
-    char *filename, *type; /* dummies */
+    if(a->prev)
+        a->prev->next = a->next;
+    else
+        rs_head = a->next;
+    if(a->next)
+        a->next->prev = a->prev;
+    else
+        rs_tail = a->prev;
+}
 
-    if(PyArg_ParseTuple(args, "z|z", &filename, &type))
-        tile = (imageobject *)newimageobject(args);
+static void rs_push(rs_axis *a)
+{
+    a->prev = NULL;
+    a->next = rs_head;
+    if(rs_head)
+        rs_head->prev = a;
     else
-        if(PyErr_Clear(), PyArg_ParseTuple(args, "O!", &Imagetype, &tile))
-            Py_INCREF(tile);
-        else
-            return NULL;
+        rs_tail = a;
+    rs_head = a;
+}
 
-    if(self->current_tile) {
-        Py_DECREF(self->current_tile);
+/* the weights for S pixels to D through filter, from the cache or made
+ * and added to it.  the caller has a reference, to give back with
+ * rs_release().  may be called without the GIL */
+
+static rs_axis *rs_weights(int S, int D, int filter)
+{
+    rs_axis *a, *old;
+
+    if(rs_mutex) {
+        PyThread_acquire_lock(rs_mutex, WAIT_LOCK);
+        for(a = rs_head; a; a = a->next)
+            if(a->S == S && a->n == D && a->filter == filter)
+                break;
+        if(a) {
+            a->refs++;
+            rs_unlink(a);
+            rs_push(a);
+        }
+        PyThread_release_lock(rs_mutex);
+        if(a)
+            return a;
     }
 
-    self->current_tile = tile;
-    gdImageSetTile(self->imagedata, tile->imagedata);
-
-    Py_INCREF(Py_None);
-    return Py_None;
+    a = filter == RS_BOX ? rs_box_weights(S, D) : rs_filter_weights(S, D, filter);
+    if(!a || !rs_mutex)
+        return a;
+    a->S = S;
+    a->filter = filter;
+
+    /* another thread may have made the same table meanwhile; the
+     * duplicate soon ages out */
+    PyThread_acquire_lock(rs_mutex, WAIT_LOCK);
+    a->refs++;
+    rs_push(a);
+    if(++rs_entries > RS_CACHE) {
+        old = rs_tail;
+        rs_unlink(old);
+        rs_entries--;
+        if(!--old->refs)
+            rs_axis_free(old);
+    }
+    PyThread_release_lock(rs_mutex);
+    return a;
 }
 
+/* one row through ax, for destination columns j0..j1: the opacity
+ * weighted sums of blue, green and red, and the sum of the opacities
+ * (127 - alpha), four ints per column */
 
-static PyObject *image_setstyle(imageobject *self, PyObject *args)
+static void rs_row(const int *src, const rs_axis *ax, int j0, int j1, int *out)
 {
-    PyObject *style;
-    int size, i, *stylearray;
-
-    if(!PyArg_ParseTuple(args, "O!", &PyTuple_Type, &style)) {
-        PyErr_Clear();
-        if(PyArg_ParseTuple(args, "O!", &PyList_Type, &style))
-            style=PyList_AsTuple(style);
-        else
-            return NULL;
+    const int *p;
+    const short *w;
+    int j, k, n;
+
+    for(j = j0; j <= j1; j++) {
+        p = src + ax->start[j];
+        w = ax->w + ax->first[j];
+        n = ax->count[j];
+#ifdef __SSE2__
+        {
+            __m128i zero = _mm_setzero_si128(), acc = zero, px, m;
+            __m128i low = _mm_set1_epi16(0x7f), one = _mm_set_epi16(1, 0, 0, 0, 1, 0, 0, 0);
+            __m128i rgb = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+
+            /* two pixels at a time: b, g, r and 1 as shorts, times
+             * the opacity, then paired up (b0 b1 g0 g1 ...) for madd
+             * to weight and sum */
+            for(k = 0; k < n; k += 2) {
+                if(k + 1 < n)
+                    px = _mm_loadl_epi64((const __m128i *)(p + k));
+                else
+                    px = _mm_cvtsi32_si128(p[k]);
+                px = _mm_unpacklo_epi8(px, zero);
+                m = _mm_and_si128(_mm_shufflehi_epi16(_mm_shufflelo_epi16(px, 0xff), 0xff), low);
+                m = _mm_sub_epi16(low, m);
+                if(k + 1 >= n)
+                    m = _mm_unpacklo_epi64(m, zero);
+                px = _mm_or_si128(_mm_and_si128(px, rgb), one);
+                px = _mm_mullo_epi16(px, m);
+                px = _mm_unpacklo_epi16(px, _mm_srli_si128(px, 8));
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(px,
+                    _mm_set1_epi32((w[k] & 0xffff) | (k + 1 < n ? w[k + 1] << 16 : 0))));
+            }
+            _mm_storeu_si128((__m128i *)(out + 4 * j), acc);
+        }
+#else
+        {
+            int b = 0, g = 0, r = 0, m = 0, wm;
+
+            for(k = 0; k < n; k++) {
+                wm = w[k] * (127 - ((p[k] >> 24) & 0x7f));
+                b += wm * (p[k] & 0xff);
+                g += wm * ((p[k] >> 8) & 0xff);
+                r += wm * ((p[k] >> 16) & 0xff);
+                m += wm;
+            }
+            out[4 * j] = b;
+            out[4 * j + 1] = g;
+            out[4 * j + 2] = r;
+            out[4 * j + 3] = m;
+        }
+#endif
     }
+}
 
-    size = PyTuple_Size(style);
+static int rs_clamp(PY_LONG_LONG v, int max)
+{
+    return v < 0 ? 0 : v > max ? max : (int)v;
+}
 
-    stylearray = (int *)calloc(size,sizeof(int));
+/* resample the part of src at (srcX,srcY) through xa and ya onto dst at
+ * (dstX,dstY), as gdImageSetPixel would.  both must be truecolor, and
+ * the source pixels must all lie inside src.  returns 0 if out of
+ * memory, having drawn nothing */
 
-    for(i=0; i<size; i++)
-        stylearray[i] = PyInt_AS_LONG((PyIntObject *)PyTuple_GET_ITEM(style,i));
+static int rs_resample(gdImagePtr dst, gdImagePtr src, int dstX, int dstY,
+    int srcX, int srcY, const rs_axis *xa, const rs_axis *ya)
+{
+    int *rows, *tag, *h, nrows = 1, i, j, k, c, x, y, sy, wy, r, g, b, a;
+    int j0 = MAX(0, dst->cx1 - dstX), j1 = MIN(xa->n - 1, dst->cx2 - dstX);
+    PY_LONG_LONG *acc, *s, m;
+    double inv;
+
+    if(j0 > j1)
+        return 1;
+
+    /* each source row is run through xa once, and kept while the rows
+     * of destination pixels that it's under are done */
+    for(i = 0; i < ya->n; i++)
+        nrows = MAX(nrows, ya->count[i]);
+    rows = malloc((size_t)nrows * 4 * xa->n * sizeof(int));
+    tag = malloc(nrows * sizeof(int));
+    acc = malloc(4 * xa->n * sizeof(PY_LONG_LONG));
+    if(!rows || !tag || !acc) {
+        free(rows);
+        free(tag);
+        free(acc);
+        return 0;
+    }
+    for(k = 0; k < nrows; k++)
+        tag[k] = -1;
+
+    for(i = 0; i < ya->n; i++) {
+        y = dstY + i;
+        if(y < dst->cy1 || y > dst->cy2)
+            continue;
+
+        memset(acc + 4 * j0, 0, 4 * (j1 - j0 + 1) * sizeof(PY_LONG_LONG));
+        for(k = 0; k < ya->count[i]; k++) {
+            sy = srcY + ya->start[i] + k;
+            wy = ya->w[ya->first[i] + k];
+            h = rows + (size_t)(sy % nrows) * 4 * xa->n;
+            if(tag[sy % nrows] != sy) {
+                tag[sy % nrows] = sy;
+                rs_row(src->tpixels[sy] + srcX, xa, j0, j1, h);
+            }
+            for(c = 4 * j0; c < 4 * (j1 + 1); c++)
+                acc[c] += (PY_LONG_LONG)wy * h[c];
+        }
 
-    gdImageSetStyle(self->imagedata, stylearray, size);
-    free(stylearray);
+        for(j = j0; j <= j1; j++) {
+            s = acc + 4 * j;
+            m = s[3];
+            if(m > 0) {
+                inv = 1.0 / m;
+                b = rs_clamp((PY_LONG_LONG)(s[0] * inv + 0.5), 255);
+                g = rs_clamp((PY_LONG_LONG)(s[1] * inv + 0.5), 255);
+                r = rs_clamp((PY_LONG_LONG)(s[2] * inv + 0.5), 255);
+            } else {
+                r = g = b = 0;
+            }
+            /* the average alpha, rounded */
+            m = ((PY_LONG_LONG)gdAlphaMax << (2 * RS_BITS)) - m + ((PY_LONG_LONG)1 << (2 * RS_BITS - 1));
+            a = m < 0 ? 0 : rs_clamp(m >> (2 * RS_BITS), gdAlphaMax);
+            x = dstX + j;
+            /* blending an opaque pixel just replaces the old one */
+            if(!dst->alphaBlendingFlag || (a == 0 && dst->alphaBlendingFlag <= 2))
+                dst->tpixels[y][x] = gdTrueColorAlpha(r, g, b, a);
+            else
+                gdImageSetPixel(dst, x, y, gdTrueColorAlpha(r, g, b, a));
+        }
+    }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    free(rows);
+    free(tag);
+    free(acc);
+    return 1;
 }
 
-static PyObject *image_setthickness(imageobject *self, PyObject *args)
-{
-#if GD2_VERS <= 1
-    PyErr_SetString(PyExc_NotImplementedError,
-                    "setThickness() requires gd 2.0 or later");
-    return NULL;
-#else
-    int t;
+/* resample through filter, from a part of src lying wholly inside it.
+ * both images must be truecolor.  returns 0 if out of memory, having
+ * drawn nothing */
 
-    if(!PyArg_ParseTuple(args, "i", &t))
-        return NULL;
-    gdImageSetThickness(self->imagedata, t);
-    Py_INCREF(Py_None);
-    return Py_None;
-#endif
+static int resample_filtered(gdImagePtr dst, gdImagePtr src, int dstX, int dstY,
+    int srcX, int srcY, int dstW, int dstH, int srcW, int srcH, int filter)
+{
+    rs_axis *xa, *ya = NULL;
+    int ok;
+
+    ok = (xa = rs_weights(srcW, dstW, filter)) && (ya = rs_weights(srcH, dstH, filter))
+        && rs_resample(dst, src, dstX, dstY, srcX, srcY, xa, ya);
+    rs_release(xa);
+    rs_release(ya);
+    return ok;
 }
 
-static PyObject *image_alphablending(imageobject *self, PyObject *args)
+/* gdImageCopyResampled, done by resample_filtered where it can be */
+
+static void resample_copy(gdImagePtr dst, gdImagePtr src, int dstX, int dstY,
+    int srcX, int srcY, int dstW, int dstH, int srcW, int srcH)
 {
-#if GD2_VERS <= 1
-    PyErr_SetString(PyExc_NotImplementedError,
-                    "alphaBlending() requires gd 2.0 or later");
-    return NULL;
-#else
-    int blending;
+    /* gd reads pixels outside src as black, and src can't be dst */
+    if(dst->trueColor && src->trueColor && dst != src
+    && dstW > 0 && dstH > 0 && srcW > 0 && srcH > 0
+    && srcX >= 0 && srcY >= 0 && srcX + srcW <= src->sx && srcY + srcH <= src->sy
+    && resample_filtered(dst, src, dstX, dstY, srcX, srcY, dstW, dstH, srcW, srcH, RS_BOX))
+        return;
+    gdImageCopyResampled(dst, src, dstX, dstY, srcX, srcY, dstW, dstH, srcW, srcH);
+}
 
-    if(!PyArg_ParseTuple(args, "i", &blending))
-        return NULL;
-    gdImageAlphaBlending(self->imagedata, blending);
-    Py_INCREF(Py_None);
-    return Py_None;
-#endif
+/*
+** Copying between truecolor images.  gdImageCopy, gdImageCopyMerge and
+** gdImageCopyMergeGray go through gdImageGetPixel and gdImageSetPixel
+** for every pixel; between truecolor images the same arithmetic is
+** done here a row at a time on the pixel arrays, with SSE2 where it
+** pays, and the results are the same.  Anything else -- palette
+** images, copies within one image, a source rectangle reaching outside
+** the source's clip, the overlay and multiply effects -- is left to gd.
+*/
+
+/* as gdAlphaBlend */
+
+static int blend_pixel(int dst, int src)
+{
+    int sa = gdTrueColorGetAlpha(src), da, sw, dw, tw;
+
+    if(sa == gdAlphaOpaque)
+        return src;
+    da = gdTrueColorGetAlpha(dst);
+    if(sa == gdAlphaTransparent)
+        return dst;
+    if(da == gdAlphaTransparent)
+        return src;
+
+    sw = gdAlphaTransparent - sa;
+    dw = (gdAlphaTransparent - da) * sa / gdAlphaMax;
+    tw = sw + dw;
+    return gdTrueColorAlpha(
+        (gdTrueColorGetRed(src) * sw + gdTrueColorGetRed(dst) * dw) / tw,
+        (gdTrueColorGetGreen(src) * sw + gdTrueColorGetGreen(dst) * dw) / tw,
+        (gdTrueColorGetBlue(src) * sw + gdTrueColorGetBlue(dst) * dw) / tw,
+        sa * da / gdAlphaMax);
 }
 
-static PyObject *image_alpha(imageobject *self, PyObject *args)
+/* n pixels of s onto d, skipping the transparent color, and blending
+ * if asked */
+
+static void blit_row(int *d, const int *s, int n, int transparent, int blend)
 {
-#if GD2_VERS <= 1
-    PyErr_SetString(PyExc_NotImplementedError,
-                    "alpha() requires gd 2.0 or later");
-    return NULL;
-#else
-    int color;
+    int i = 0;
 
-    if(!PyArg_ParseTuple(args, "i", &color))
-        return NULL;
-    return Py_BuildValue("i", gdImageAlpha(self->imagedata, color));
+    if(!blend && transparent == -1) {
+        memcpy(d, s, n * sizeof(int));
+        return;
+    }
+#ifdef __SSE2__
+    {
+        __m128i tr = _mm_set1_epi32(transparent), a7 = _mm_set1_epi32(0x7f);
+        __m128i by = _mm_set1_epi32(0xff), zero = _mm_setzero_si128();
+        __m128i S, D, sa, da, sw, dw, r, c, keep, from_s, from_d;
+        __m128 tw;
+        int k;
+
+        for(; i + 4 <= n; i += 4) {
+            S = _mm_loadu_si128((const __m128i *)(s + i));
+            D = _mm_loadu_si128((const __m128i *)(d + i));
+            keep = _mm_cmpeq_epi32(S, tr);
+            if(blend) {
+                /* blend_pixel() four at a time; the products fit in
+                 * the low 16 bits of each lane, x / 127 is
+                 * (x * 8257) >> 20 for them, and float division is
+                 * exact enough to truncate */
+                sa = _mm_and_si128(_mm_srli_epi32(S, 24), a7);
+                da = _mm_and_si128(_mm_srli_epi32(D, 24), a7);
+                sw = _mm_sub_epi32(a7, sa);
+                dw = _mm_mullo_epi16(_mm_sub_epi32(a7, da), sa);
+                dw = _mm_srli_epi32(_mm_mulhi_epu16(dw, _mm_set1_epi32(8257)), 4);
+                tw = _mm_cvtepi32_ps(_mm_add_epi32(sw, dw));
+                r = _mm_mullo_epi16(sa, da);
+                r = _mm_slli_epi32(_mm_srli_epi32(_mm_mulhi_epu16(r, _mm_set1_epi32(8257)), 4), 24);
+                for(k = 0; k < 24; k += 8) {
+                    c = _mm_add_epi32(
+                        _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(S, k), by), sw),
+                        _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(D, k), by), dw));
+                    c = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(c), tw));
+                    r = _mm_or_si128(r, _mm_slli_epi32(c, k));
+                }
+                from_d = _mm_cmpeq_epi32(sa, a7);
+                from_s = _mm_or_si128(_mm_cmpeq_epi32(sa, zero),
+                                      _mm_andnot_si128(from_d, _mm_cmpeq_epi32(da, a7)));
+                r = _mm_or_si128(_mm_and_si128(from_s, S), _mm_andnot_si128(from_s, r));
+                S = _mm_or_si128(_mm_and_si128(from_d, D), _mm_andnot_si128(from_d, r));
+            }
+            _mm_storeu_si128((__m128i *)(d + i),
+                _mm_or_si128(_mm_and_si128(keep, D), _mm_andnot_si128(keep, S)));
+        }
+    }
 #endif
+    for(; i < n; i++)
+        if(s[i] != transparent)
+            d[i] = blend ? blend_pixel(d[i], s[i]) : s[i];
 }
 
+/* fit a copy of w x h pixels to dst's clip.  returns 0 if it has to be
+ * left to gd */
 
-static PyObject *image_getpixel(imageobject *self, PyObject *args)
+static int blit_area(gdImagePtr dst, gdImagePtr src, int *dstX, int *dstY,
+    int *srcX, int *srcY, int *w, int *h)
 {
-    int x,y;
+    int d;
 
-    if(!PyArg_ParseTuple(args, "(ii)", &x,&y))
-        return NULL;
-    return Py_BuildValue("i",gdImageGetPixel(self->imagedata, X(x),Y(y)));
+    if(!dst->trueColor || !src->trueColor || dst == src || dst->alphaBlendingFlag > 2
+    || *w <= 0 || *h <= 0)
+        return 0;
+    /* gd reads pixels outside the source's clip as black */
+    if(*srcX < src->cx1 || *srcY < src->cy1
+    || *srcX + *w - 1 > src->cx2 || *srcY + *h - 1 > src->cy2)
+        return 0;
+
+    if((d = dst->cx1 - *dstX) > 0) {
+        *dstX += d;
+        *srcX += d;
+        *w -= d;
+    }
+    if((d = dst->cy1 - *dstY) > 0) {
+        *dstY += d;
+        *srcY += d;
+        *h -= d;
+    }
+    *w = MIN(*w, dst->cx2 - *dstX + 1);
+    *h = MIN(*h, dst->cy2 - *dstY + 1);
+    return 1;
 }
 
+/* gdImageCopy */
 
-static PyObject *image_boundssafe(imageobject *self, PyObject *args)
+static void blit_copy(gdImagePtr dst, gdImagePtr src, int dstX, int dstY,
+    int srcX, int srcY, int w, int h)
 {
-    int x,y;
+    int y;
 
-    if(!PyArg_ParseTuple(args, "(ii)", &x,&y))
-        return NULL;
-    return Py_BuildValue("i",gdImageBoundsSafe(self->imagedata, X(x),Y(y)));
+    if(!blit_area(dst, src, &dstX, &dstY, &srcX, &srcY, &w, &h)) {
+        gdImageCopy(dst, src, dstX, dstY, srcX, srcY, w, h);
+        return;
+    }
+    for(y = 0; y < h && w > 0; y++)
+        blit_row(dst->tpixels[dstY + y] + dstX, src->tpixels[srcY + y] + srcX,
+                 w, src->transparent, dst->alphaBlendingFlag);
 }
 
+/* gdImageCopyMerge and gdImageCopyMergeGray, pct percent of src over
+ * dst.  gd works in doubles, truncating each channel of the result, and
+ * the tables hold the same products so that the sums come out alike */
 
-static PyObject *image_blue(imageobject *self, PyObject *args)
+static void blit_merge(gdImagePtr dst, gdImagePtr src, int dstX, int dstY,
+    int srcX, int srcY, int w, int h, int pct, int gray)
 {
-    int c;
+    double ts[256], td[256], tr[256], tg[256], tb[256], p1, p2;
+    int x, y, c, dc, *d;
+    const int *s;
+    float g;
+
+    if(pct < 0 || pct > 100
+    || !blit_area(dst, src, &dstX, &dstY, &srcX, &srcY, &w, &h)) {
+        if(gray)
+            gdImageCopyMergeGray(dst, src, dstX, dstY, srcX, srcY, w, h, pct);
+        else
+            gdImageCopyMerge(dst, src, dstX, dstY, srcX, srcY, w, h, pct);
+        return;
+    }
 
-    if(!PyArg_ParseTuple(args, "i", &c))
-        return NULL;
-    return Py_BuildValue("i",gdImageBlue(self->imagedata,c));
+    p1 = pct / 100.0;
+    p2 = (100 - pct) / 100.0;
+    for(c = 0; c < 256; c++) {
+        ts[c] = c * p1;
+        td[c] = c * p2;
+        tr[c] = 0.29900 * c;
+        tg[c] = 0.58700 * c;
+        tb[c] = 0.11400 * c;
+    }
+
+    for(y = 0; y < h && w > 0; y++) {
+        d = dst->tpixels[dstY + y] + dstX;
+        s = src->tpixels[srcY + y] + srcX;
+        for(x = 0; x < w; x++) {
+            if((c = s[x]) == src->transparent)
+                continue;
+            dc = d[x];
+            /* the merged color is opaque, so blending just stores it */
+            if(gray) {
+                g = tr[gdTrueColorGetRed(dc)] + tg[gdTrueColorGetGreen(dc)] + tb[gdTrueColorGetBlue(dc)];
+                d[x] = gdTrueColorAlpha((int)(ts[gdTrueColorGetRed(c)] + g * p2),
+                                        (int)(ts[gdTrueColorGetGreen(c)] + g * p2),
+                                        (int)(ts[gdTrueColorGetBlue(c)] + g * p2), 0);
+            } else {
+                d[x] = gdTrueColorAlpha((int)(ts[gdTrueColorGetRed(c)] + td[gdTrueColorGetRed(dc)]),
+                                        (int)(ts[gdTrueColorGetGreen(c)] + td[gdTrueColorGetGreen(dc)]),
+                                        (int)(ts[gdTrueColorGetBlue(c)] + td[gdTrueColorGetBlue(dc)]), 0);
+            }
+        }
+    }
 }
 
+/*
+** Color quantization, for toPalette().  The palette comes from an
+** octree: pixels are added down to the leaves, and whenever there are
+** more leaves than colors the deepest node with the fewest pixels is
+** folded into a single leaf.  Images with no more colors than that
+** keep their exact colors.  "kmeans" goes on to refine the octree's
+** colors with a few rounds of Lloyd's algorithm over a histogram of the
+** image.  Each pixel then gets its nearest palette entry, optionally
+** with Floyd-Steinberg dithering.  Nearest entries come from an
+** inverse colormap: color space is cut into cells, and each cell, when
+** first needed, gets the list of entries which could be nearest to any
+** color in it, after an SSE2 search for the entry nearest its center
+** bounds the distance.  A cache keyed by the exact color sits in front,
+** so images of few colors map at the cost of a lookup.  Fully
+** transparent pixels share one entry, which is made the transparent
+** color.
+*/
 
-static PyObject *image_green(imageobject *self, PyObject *args)
-{
-    int c;
+typedef struct qnode {
+    struct qnode *child[8];
+    struct qnode *next;         /* in its level's list of reducible nodes */
+    PY_LONG_LONG n, r, g, b, a;
+    int leaf, nchildren;
+} qnode;
 
-    if(!PyArg_ParseTuple(args, "i", &c))
-        return NULL;
-    return Py_BuildValue("i",gdImageGreen(self->imagedata,c));
-}
+#define QBLOCK 256
 
+typedef struct qblock {
+    struct qblock *next;
+    qnode nodes[QBLOCK];
+} qblock;
 
-static PyObject *image_red(imageobject *self, PyObject *args)
+typedef struct {
+    qnode *root, *levels[8], *free;
+    qblock *blocks;
+    int used;                   /* nodes used in the newest block */
+    int leaves, reduced;
+} octree;
+
+static qnode *octree_node(octree *t)
 {
-    int c;
+    qnode *q;
+    qblock *b;
+
+    if((q = t->free))
+        t->free = q->next;
+    else {
+        if(!t->blocks || t->used == QBLOCK) {
+            if(!(b = malloc(sizeof(qblock))))
+                return NULL;
+            b->next = t->blocks;
+            t->blocks = b;
+            t->used = 0;
+        }
+        q = &t->blocks->nodes[t->used++];
+    }
+    memset(q, 0, sizeof(*q));
+    return q;
+}
 
-    if(!PyArg_ParseTuple(args, "i", &c))
-        return NULL;
-    return Py_BuildValue("i",gdImageRed(self->imagedata,c));
+static void octree_free(octree *t)
+{
+    qblock *b;
+
+    while((b = t->blocks)) {
+        t->blocks = b->next;
+        free(b);
+    }
 }
 
+/* fold the reducible node with the fewest pixels at the deepest level
+ * into one leaf; its children are all leaves */
 
-static PyObject *image_size(imageobject *self)
+static void octree_reduce(octree *t)
 {
-    return Py_BuildValue("(ii)",gdImageSX(self->imagedata),gdImageSY(self->imagedata));
+    qnode **pp, **best = NULL, *q, *c;
+    int level, i;
+
+    for(level = 7; level >= 0 && !t->levels[level]; level--)
+        ;
+    if(level < 0)
+        return;
+    for(pp = &t->levels[level]; *pp; pp = &(*pp)->next)
+        if(!best || (*pp)->n < (*best)->n)
+            best = pp;
+    q = *best;
+    *best = q->next;
+
+    for(i = 0; i < 8; i++) {
+        if(!(c = q->child[i]))
+            continue;
+        q->r += c->r;
+        q->g += c->g;
+        q->b += c->b;
+        q->a += c->a;
+        c->next = t->free;
+        t->free = c;
+        q->child[i] = NULL;
+    }
+    q->leaf = 1;
+    t->leaves -= q->nchildren - 1;
+    t->reduced = 1;
 }
 
+/* count n pixels of color c; returns 0 if out of memory */
 
-static PyObject *image_char(imageobject *self, PyObject *args)
+static int octree_add(octree *t, int c, int n, int maxleaves)
 {
-    int x,y,font,color;
-    char c;
+    qnode *q = t->root, *child;
+    int level, i, r = gdTrueColorGetRed(c), g = gdTrueColorGetGreen(c), b = gdTrueColorGetBlue(c);
+
+    /* internal nodes count their pixels too, for octree_reduce() */
+    for(level = 0; ; level++) {
+        q->n += n;
+        if(q->leaf)
+            break;
+        i = (((r >> (7 - level)) & 1) << 2) | (((g >> (7 - level)) & 1) << 1) | ((b >> (7 - level)) & 1);
+        if(!(child = q->child[i])) {
+            if(!(child = octree_node(t)))
+                return 0;
+            q->child[i] = child;
+            q->nchildren++;
+            if(level == 7) {
+                child->leaf = 1;
+                t->leaves++;
+            } else {
+                child->next = t->levels[level + 1];
+                t->levels[level + 1] = child;
+            }
+        }
+        q = child;
+    }
+    q->r += (PY_LONG_LONG)r * n;
+    q->g += (PY_LONG_LONG)g * n;
+    q->b += (PY_LONG_LONG)b * n;
+    q->a += (PY_LONG_LONG)gdTrueColorGetAlpha(c) * n;
+
+    while(t->leaves > maxleaves)
+        octree_reduce(t);
+    return 1;
+}
 
-    if(!PyArg_ParseTuple(args, "i(ii)ii", &font,&x,&y,&c,&color))
-        return NULL;
-    gdImageChar(self->imagedata, fonts[font].func(), X(x), Y(y), c, color);
+typedef struct {
+    int n;                      /* colors, the rest padding */
+    int r[256], g[256], b[256], a[256];
+    int rg[260], ba[260];       /* r | g << 16, b | 2a << 16 */
+    int *keys, *index;          /* exact color cache */
+    int *cells;                 /* each cell's list in pool, or -1 */
+    unsigned char *pool;        /* lists: count - 1, then entries */
+    int npool, maxpool;
+} qpalette;
+
+#define QCACHE_BITS 15
+#define QCELLS (1 << 16)        /* 4 bits of each of r, g, b and a */
+
+static void octree_palette(qnode *q, qpalette *p)
+{
+    int i;
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    if(q->leaf) {
+        if(q->n && p->n < 256) {
+            p->r[p->n] = (int)((q->r + q->n / 2) / q->n);
+            p->g[p->n] = (int)((q->g + q->n / 2) / q->n);
+            p->b[p->n] = (int)((q->b + q->n / 2) / q->n);
+            p->a[p->n] = (int)((q->a + q->n / 2) / q->n);
+            p->n++;
+        }
+        return;
+    }
+    for(i = 0; i < 8; i++)
+        if(q->child[i])
+            octree_palette(q->child[i], p);
 }
 
+/* ready p for searching, after its colors change */
 
-static PyObject *image_charup(imageobject *self, PyObject *args)
+static void qpalette_pack(qpalette *p)
 {
-    int x,y,font,color;
-    char c;
-
-    if(!PyArg_ParseTuple(args, "i(ii)si", &font,&x,&y,&c,&color))
-        return NULL;
-    gdImageCharUp(self->imagedata, fonts[font].func(), X(x), Y(y), c, color);
+    int i;
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    for(i = 0; i < 260; i++) {
+        if(i < p->n) {
+            p->rg[i] = p->r[i] | (p->g[i] << 16);
+            p->ba[i] = p->b[i] | (2 * p->a[i] << 16);
+        } else {
+            /* far from everything, but no overflow in the squares */
+            p->rg[i] = 1000 | (1000 << 16);
+            p->ba[i] = 1000 | (1000 << 16);
+        }
+    }
+    for(i = 0; i < 1 << QCACHE_BITS; i++)
+        p->keys[i] = -1;
+    for(i = 0; i < QCELLS; i++)
+        p->cells[i] = -1;
+    p->npool = 0;
 }
 
+/* the entry of p nearest to color c, alpha counting double to weigh
+ * its 7 bits like the others' 8 */
 
-static PyObject *image_get_bounding_rect(imageobject *self, PyObject *args)
+static int qpalette_search(const qpalette *p, int c)
 {
-#ifndef HAVE_LIBFREETYPE
-    PyErr_SetString(PyExc_NotImplementedError,
-                    "Freetype Support Not Available");
-    return NULL;
+    int r = gdTrueColorGetRed(c), g = gdTrueColorGetGreen(c);
+    int b = gdTrueColorGetBlue(c), a = 2 * gdTrueColorGetAlpha(c);
+    int i, best = 0;
+#ifdef __SSE2__
+    __m128i vrg = _mm_set1_epi32(r | (g << 16)), vba = _mm_set1_epi32(b | (a << 16));
+    __m128i bestd = _mm_set1_epi32(INT_MAX), besti = _mm_setzero_si128();
+    __m128i idx = _mm_set_epi32(3, 2, 1, 0), four = _mm_set1_epi32(4), d, e, lt;
+    int dist[4], ind[4];
+
+    for(i = 0; i < p->n; i += 4) {
+        d = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(p->rg + i)), vrg);
+        e = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(p->ba + i)), vba);
+        d = _mm_add_epi32(_mm_madd_epi16(d, d), _mm_madd_epi16(e, e));
+        lt = _mm_cmplt_epi32(d, bestd);
+        bestd = _mm_or_si128(_mm_and_si128(lt, d), _mm_andnot_si128(lt, bestd));
+        besti = _mm_or_si128(_mm_and_si128(lt, idx), _mm_andnot_si128(lt, besti));
+        idx = _mm_add_epi32(idx, four);
+    }
+    _mm_storeu_si128((__m128i *)dist, bestd);
+    _mm_storeu_si128((__m128i *)ind, besti);
+    for(i = 1; i < 4; i++)
+        if(dist[i] < dist[best] || (dist[i] == dist[best] && ind[i] < ind[best]))
+            best = i;
+    return ind[best];
 #else
-    double ptsize, angle;
-    char *fontname, *str, *rc;
-    int x, y, brect[8];
+    int d, bestd = INT_MAX;
+
+    for(i = 0; i < p->n; i++) {
+        d = (p->r[i] - r) * (p->r[i] - r) + (p->g[i] - g) * (p->g[i] - g)
+          + (p->b[i] - b) * (p->b[i] - b) + (2 * p->a[i] - a) * (2 * p->a[i] - a);
+        if(d < bestd) {
+            bestd = d;
+            best = i;
+        }
+    }
+    return best;
+#endif
+}
 
-    if(!PyArg_ParseTuple(args, "sdd(ii)s",
-        &fontname, &ptsize, &angle, &x, &y, &str))
-            return NULL;
+#define QDIST(p, k, r, g, b, a2) (((p)->r[k] - (r)) * ((p)->r[k] - (r)) \
+    + ((p)->g[k] - (g)) * ((p)->g[k] - (g)) + ((p)->b[k] - (b)) * ((p)->b[k] - (b)) \
+    + (2 * (p)->a[k] - (a2)) * (2 * (p)->a[k] - (a2)))
 
-    rc = gdImageStringTTF(NULL, brect, 0,
-        fontname, ptsize, angle, x, y, str);
+/* how far v is from [lo,hi], least and most */
 
-    if(rc != NULL){
-        PyErr_SetString(PyExc_ValueError, rc);
-        return NULL;
-    }
+static int q_near(int v, int lo, int hi)
+{
+    return v < lo ? (lo - v) * (lo - v) : v > hi ? (v - hi) * (v - hi) : 0;
+}
 
-    return Py_BuildValue("(iiiiiiii)",brect[0],brect[1],brect[2],brect[3],
-                 brect[4],brect[5],brect[6],brect[7]);
-#endif
+static int q_far(int v, int lo, int hi)
+{
+    return v - lo > hi - v ? (v - lo) * (v - lo) : (hi - v) * (hi - v);
 }
 
+/* make the list for cell, returning where it is in the pool, or -1 if
+ * out of memory.  any color in the cell is no further from its nearest
+ * entry than the farthest corner is from the center's; entries nearer
+ * than that to the cell are the candidates */
 
-static PyObject *image_string_ft(imageobject *self, PyObject *args)
+static int qpalette_cell(qpalette *p, int cell)
 {
-#ifndef HAVE_LIBFREETYPE
-    PyErr_SetString(PyExc_NotImplementedError,
-                    "Freetype Support Not Available");
-    return NULL;
-#else
-#if GD2_VERS <= 1
-    PyErr_SetString(PyExc_NotImplementedError,
-                    "string_ft() requires gd 2.0 or later");
-    return NULL;
-#else
-    int x,y,fg;
-    double ptsize,angle;
-    char *fontname,*str,*rc;
-    int brect[8];
+    int lo[4], hi[4], i, k, d, bound, n = 0, at;
+    unsigned char *pool;
 
-    if(!PyArg_ParseTuple(args, "sdd(ii)si",
-        &fontname, &ptsize, &angle, &x,&y,&str,&fg))
-            return NULL;
-    rc = gdImageStringFT(NULL, brect, 0, fontname, ptsize, angle,
-                  0, 0, str); /* calculate the bounding rect */
-    if(rc != NULL){
-      PyErr_SetString(PyExc_ValueError, rc);
-      return NULL;
+    for(i = 0; i < 4; i++) {
+        lo[i] = ((cell >> (12 - 4 * i)) & 15) << 4;
+        hi[i] = lo[i] + 15;
     }
-    rc = gdImageStringTTF(self->imagedata, brect, fg, fontname,
-            ptsize, angle, x, y, str);
-    if(rc != NULL){
-        PyErr_SetString(PyExc_ValueError, rc);
-        return NULL;
+    /* alpha is 7 bits, counting double */
+    lo[3] = lo[3] / 8 * 8;
+    hi[3] = lo[3] + 14;
+
+    k = qpalette_search(p, gdTrueColorAlpha((lo[0] + hi[0]) / 2, (lo[1] + hi[1]) / 2,
+                                            (lo[2] + hi[2]) / 2, (lo[3] + hi[3]) / 4));
+    bound = q_far(p->r[k], lo[0], hi[0]) + q_far(p->g[k], lo[1], hi[1])
+          + q_far(p->b[k], lo[2], hi[2]) + q_far(2 * p->a[k], lo[3], hi[3]);
+
+    if(p->npool + 257 > p->maxpool) {
+        if(!(pool = realloc(p->pool, p->maxpool * 2 + 4096)))
+            return -1;
+        p->pool = pool;
+        p->maxpool = p->maxpool * 2 + 4096;
     }
+    at = p->npool;
+    for(k = 0; k < p->n; k++) {
+        d = q_near(p->r[k], lo[0], hi[0]) + q_near(p->g[k], lo[1], hi[1])
+          + q_near(p->b[k], lo[2], hi[2]) + q_near(2 * p->a[k], lo[3], hi[3]);
+        if(d <= bound)
+            p->pool[at + 1 + n++] = k;
+    }
+    p->pool[at] = n - 1;
+    p->npool += n + 1;
+    return p->cells[cell] = at;
+}
 
-    return Py_BuildValue("(iiiiiiii)",
-        brect[0], brect[1], brect[2], brect[3],
-        brect[4], brect[5], brect[6], brect[7]);
-#endif
-#endif
+static int qpalette_nearest(qpalette *p, int c)
+{
+    unsigned int h = ((unsigned int)c * 2654435761U) >> (32 - QCACHE_BITS);
+    int r, g, b, a2, cell, at, n, k, d, best, bestd = INT_MAX;
+    const unsigned char *list;
+
+    if(p->keys[h] == c)
+        return p->index[h];
+
+    r = gdTrueColorGetRed(c);
+    g = gdTrueColorGetGreen(c);
+    b = gdTrueColorGetBlue(c);
+    a2 = 2 * gdTrueColorGetAlpha(c);
+    cell = ((r >> 4) << 12) | ((g >> 4) << 8) | ((b >> 4) << 4) | (a2 >> 4);
+    if((at = p->cells[cell]) < 0 && (at = qpalette_cell(p, cell)) < 0) {
+        best = qpalette_search(p, c);
+    } else {
+        list = p->pool + at;
+        best = list[1];
+        for(n = 0; n <= list[0]; n++) {
+            k = list[n + 1];
+            if((d = QDIST(p, k, r, g, b, a2)) < bestd) {
+                bestd = d;
+                best = k;
+            }
+        }
+    }
+    p->keys[h] = c;
+    p->index[h] = best;
+    return best;
 }
 
+#define QHIST_BITS 5            /* per channel, for kmeans */
+#define QHIST (1 << (3 * QHIST_BITS))
 
-static PyObject *image_string_ttf(imageobject *self, PyObject *args)
+/* rounds of Lloyd's algorithm on p over the histogram h (five sums to a
+ * bin: count, red, green, blue and alpha) */
+
+static void qpalette_kmeans(qpalette *p, const PY_LONG_LONG *h)
 {
-#ifndef HAVE_LIBFREETYPE
-    PyErr_SetString(PyExc_NotImplementedError,
-                    "Freetype Support Not Available");
-    return NULL;
-#else
-    int x,y,fg;
-    double ptsize,angle;
-    char *fontname,*str,*rc;
-    int brect[8];
+    PY_LONG_LONG *sums;
+    int round, i, k, c, changed;
 
-    if(!PyArg_ParseTuple(args, "sdd(ii)si",
-        &fontname, &ptsize, &angle, &x,&y,&str,&fg))
-            return NULL;
-    rc = gdImageStringTTF(NULL, brect, 0, fontname, ptsize, angle,
-                  0, 0, str); /* calculate the bounding rect */
-    if(rc != NULL){
-      PyErr_SetString(PyExc_ValueError, rc);
-      return NULL;
-    }
-    rc = gdImageStringTTF(self->imagedata, brect, fg, fontname,
-            ptsize, angle, x, y, str);
-    if(rc != NULL){
-        PyErr_SetString(PyExc_ValueError, rc);
-        return NULL;
+    if(!(sums = malloc(256 * 5 * sizeof(PY_LONG_LONG))))
+        return;
+    for(round = 0; round < 8; round++) {
+        memset(sums, 0, 256 * 5 * sizeof(PY_LONG_LONG));
+        for(i = 0; i < QHIST; i++) {
+            if(!h[5 * i])
+                continue;
+            c = gdTrueColorAlpha((int)(h[5 * i + 1] / h[5 * i]), (int)(h[5 * i + 2] / h[5 * i]),
+                                 (int)(h[5 * i + 3] / h[5 * i]), (int)(h[5 * i + 4] / h[5 * i]));
+            k = qpalette_nearest(p, c);
+            sums[5 * k] += h[5 * i];
+            sums[5 * k + 1] += h[5 * i + 1];
+            sums[5 * k + 2] += h[5 * i + 2];
+            sums[5 * k + 3] += h[5 * i + 3];
+            sums[5 * k + 4] += h[5 * i + 4];
+        }
+        changed = 0;
+        for(k = 0; k < p->n; k++) {
+            PY_LONG_LONG n = sums[5 * k];
+            int r, g, b, a;
+
+            if(!n)
+                continue;
+            r = (int)((sums[5 * k + 1] + n / 2) / n);
+            g = (int)((sums[5 * k + 2] + n / 2) / n);
+            b = (int)((sums[5 * k + 3] + n / 2) / n);
+            a = (int)((sums[5 * k + 4] + n / 2) / n);
+            changed |= r != p->r[k] || g != p->g[k] || b != p->b[k] || a != p->a[k];
+            p->r[k] = r;
+            p->g[k] = g;
+            p->b[k] = b;
+            p->a[k] = a;
+        }
+        qpalette_pack(p);
+        if(!changed)
+            break;
     }
+    free(sums);
+}
 
-    return Py_BuildValue("(iiiiiiii)",
-        brect[0], brect[1], brect[2], brect[3],
-        brect[4], brect[5], brect[6], brect[7]);
-#endif
+static int q_clamp(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
 }
 
+/* pixel (x,y) of im as a truecolor value */
 
-static PyObject *image_string(imageobject *self, PyObject *args)
+static int q_pixel(gdImagePtr im, int x, int y)
 {
-    int x, y, font, color;
-    unsigned char *str;
-
-    if(!PyArg_ParseTuple(args, "i(ii)si", &font,&x,&y,&str,&color))
-        return NULL;
-    gdImageString(self->imagedata, fonts[font].func(), X(x), Y(y), str, color);
+    int i;
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    if(im->trueColor)
+        return im->tpixels[y][x];
+    i = im->pixels[y][x];
+    return gdTrueColorAlpha(im->red[i], im->green[i], im->blue[i],
+        i == im->transparent ? gdAlphaTransparent : im->alpha[i]);
 }
 
-#ifdef Py_UNICODEOBJECT_H
-static PyObject *image_string16(imageobject *self, PyObject *args)
-{
-    int x,y,font,color;
-    Py_UNICODE *ustr;
+/* is c left out of the palette and drawn transparent? */
+#define QCLEAR(im, c) (gdTrueColorGetAlpha(c) == gdAlphaTransparent || \
+    ((im)->trueColor && (c) == (im)->transparent))
 
-    if(!PyArg_ParseTuple(args, "i(ii)ui", &font,&x,&y,&ustr,&color))
-        return NULL;
-    gdImageString16(self->imagedata, fonts[font].func(), X(x), Y(y), 
-                    (short unsigned int *)ustr, color);
+/* a palette image of im in at most colors colors, or NULL if out of
+ * memory.  called without the GIL */
 
-    Py_INCREF(Py_None);
-    return Py_None;
+static gdImagePtr quantize(gdImagePtr im, int colors, int dither, int kmeans)
+{
+    gdImagePtr out = NULL;
+    octree t;
+    qpalette *p = NULL;
+    PY_LONG_LONG *hist = NULL, *bin;
+    int *err = NULL, *cur = NULL, *next = NULL, x, y, i, c, run, clear = 0, tindex = -1;
+    int sx = gdImageSX(im), sy = gdImageSY(im), r, g, b, e[3], ok = 0;
+
+    memset(&t, 0, sizeof(t));
+    if(!(p = calloc(1, sizeof(qpalette)))
+    || !(p->keys = malloc((1 << QCACHE_BITS) * sizeof(int)))
+    || !(p->index = malloc((1 << QCACHE_BITS) * sizeof(int)))
+    || !(p->cells = malloc(QCELLS * sizeof(int)))
+    || !(t.root = octree_node(&t))
+    || (kmeans && !(hist = calloc(QHIST * 5, sizeof(PY_LONG_LONG))))
+    || (dither && !(err = calloc(6 * (sx + 2), sizeof(int)))))
+        goto done;
+    t.levels[0] = t.root;
+
+    /* runs of one color, as in charts, go in at once */
+    for(y = 0; y < sy; y++) {
+        for(x = 0; x < sx; x += run) {
+            c = q_pixel(im, x, y);
+            for(run = 1; x + run < sx && q_pixel(im, x + run, y) == c; run++)
+                ;
+            if(QCLEAR(im, c)) {
+                clear = 1;
+                continue;
+            }
+            if(!octree_add(&t, c, run, colors))
+                goto done;
+            if(hist) {
+                bin = hist + 5 * (((gdTrueColorGetRed(c) >> (8 - QHIST_BITS)) << (2 * QHIST_BITS))
+                    | ((gdTrueColorGetGreen(c) >> (8 - QHIST_BITS)) << QHIST_BITS)
+                    | (gdTrueColorGetBlue(c) >> (8 - QHIST_BITS)));
+                bin[0] += run;
+                bin[1] += (PY_LONG_LONG)gdTrueColorGetRed(c) * run;
+                bin[2] += (PY_LONG_LONG)gdTrueColorGetGreen(c) * run;
+                bin[3] += (PY_LONG_LONG)gdTrueColorGetBlue(c) * run;
+                bin[4] += (PY_LONG_LONG)gdTrueColorGetAlpha(c) * run;
+            }
+        }
+    }
+    /* one entry goes to transparent pixels, if there are any */
+    if(clear)
+        while(t.leaves > colors - 1)
+            octree_reduce(&t);
+    octree_palette(t.root, p);
+    if(p->n == 0) {
+        p->r[0] = p->g[0] = p->b[0] = p->a[0] = 0;
+        p->n = 1;
+    }
+    qpalette_pack(p);
+    /* an exact palette can't be bettered */
+    if(hist && t.reduced)
+        qpalette_kmeans(p, hist);
+
+    if(!(out = gdImageCreate(sx, sy)))
+        goto done;
+    for(i = 0; i < p->n; i++) {
+        out->red[i] = p->r[i];
+        out->green[i] = p->g[i];
+        out->blue[i] = p->b[i];
+        out->alpha[i] = p->a[i];
+        out->open[i] = 0;
+    }
+    out->colorsTotal = p->n;
+    if(clear) {
+        tindex = out->colorsTotal++;
+        out->red[tindex] = out->green[tindex] = out->blue[tindex] = 0;
+        out->alpha[tindex] = gdAlphaTransparent;
+        out->open[tindex] = 0;
+        out->transparent = tindex;
+    }
+    out->interlace = im->interlace;
+    out->saveAlphaFlag = im->saveAlphaFlag;
+
+    for(y = 0; y < sy; y++) {
+        if(dither) {
+            /* errors for this row and the next, times 16 */
+            cur = err + 3 * (y & 1) * (sx + 2) + 3;
+            next = err + 3 * (~y & 1) * (sx + 2) + 3;
+            memset(next - 3, 0, 3 * (sx + 2) * sizeof(int));
+        }
+        for(x = 0; x < sx; x++) {
+            c = q_pixel(im, x, y);
+            if(QCLEAR(im, c)) {
+                out->pixels[y][x] = tindex;
+                continue;
+            }
+            if(!dither) {
+                out->pixels[y][x] = qpalette_nearest(p, c);
+                continue;
+            }
+            r = q_clamp(gdTrueColorGetRed(c) + cur[3 * x] / 16);
+            g = q_clamp(gdTrueColorGetGreen(c) + cur[3 * x + 1] / 16);
+            b = q_clamp(gdTrueColorGetBlue(c) + cur[3 * x + 2] / 16);
+            i = qpalette_nearest(p, gdTrueColorAlpha(r, g, b, gdTrueColorGetAlpha(c)));
+            out->pixels[y][x] = i;
+            e[0] = r - p->r[i];
+            e[1] = g - p->g[i];
+            e[2] = b - p->b[i];
+            for(c = 0; c < 3; c++) {
+                cur[3 * (x + 1) + c] += 7 * e[c];
+                next[3 * (x - 1) + c] += 3 * e[c];
+                next[3 * x + c] += 5 * e[c];
+                next[3 * (x + 1) + c] += e[c];
+            }
+        }
+    }
+    ok = 1;
+
+done:
+    octree_free(&t);
+    if(p) {
+        free(p->keys);
+        free(p->index);
+        free(p->cells);
+        free(p->pool);
+        free(p);
+    }
+    free(hist);
+    free(err);
+    if(!ok && out) {
+        gdImageDestroy(out);
+        out = NULL;
+    }
+    return out;
 }
-#endif
 
-static PyObject *image_stringup(imageobject *self, PyObject *args)
-{
-    int x, y, font, color;
-    unsigned char *str;
+#ifdef HAVE_LIBGIF
+/*
+** GifAnimWriter: an animated GIF written to a file-like object a frame
+** at a time.  Each frame is compared with a copy of the one before, and
+** only the rectangle which changed is encoded, placed at its offset
+** with the previous frame left in place underneath (gdDisposalNone).
+*/
 
-    if(!PyArg_ParseTuple(args, "i(ii)si", &font,&x,&y,&str,&color))
-        return NULL;
-    gdImageStringUp(self->imagedata, fonts[font].func(), X(x), Y(y), str, color);
+typedef struct {
+    PyObject_HEAD
+    struct PyFileWriteObj_gdIOCtx *wctx;
+    gdImagePtr prev;            /* copy of the last frame */
+    gdImagePtr gct;             /* 1x1 image holding the global palette */
+    int loops, global;
+    int frames, closed;
+    int busy;                   /* a frame is being added without the GIL */
+} gifanimobject;
 
-    Py_INCREF(Py_None);
-    return Py_None;
-}
+staticforward PyTypeObject GifAnimtype;
 
-#ifdef Py_UNICODEOBJECT_H
-static PyObject *image_stringup16(imageobject *self, PyObject *args)
+static int same_palette(gdImagePtr a, gdImagePtr b)
 {
-    int x,y,font,color;
-    Py_UNICODE *ustr;
-
-    if(!PyArg_ParseTuple(args, "i(ii)ui", &font,&x,&y,&ustr,&color))
-        return NULL;
-    gdImageStringUp16(self->imagedata, fonts[font].func(), X(x), Y(y),
-                      (short unsigned int *)ustr, color);
+    int n = a->colorsTotal;
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    return n == b->colorsTotal && a->transparent == b->transparent
+        && memcmp(a->red, b->red, n * sizeof(int)) == 0
+        && memcmp(a->green, b->green, n * sizeof(int)) == 0
+        && memcmp(a->blue, b->blue, n * sizeof(int)) == 0
+        && memcmp(a->alpha, b->alpha, n * sizeof(int)) == 0;
 }
-#endif
 
-static PyObject *image_colorallocate(imageobject *self, PyObject *args)
+/* find the bounding box of the pixels which differ between two images
+ * of the same size and kind.  returns 0 if there are none. */
+
+static int changed_box(gdImagePtr a, gdImagePtr b, int *x0, int *y0, int *x1, int *y1)
 {
-    int r,g,b;
+    int sx = a->sx, sy = a->sy, rowsize, x, y, top, bottom, left, right;
 
-    if(!PyArg_ParseTuple(args, "(iii)", &r, &g, &b))
-        return NULL;
-    return(Py_BuildValue("i",gdImageColorAllocate(self->imagedata, r, g, b)));
-}
+    rowsize = a->trueColor ? sx * sizeof(int) : sx;
 
-static PyObject *image_colorallocatealpha(imageobject *self, PyObject *args)
-{
-#if GD2_VERS <= 1
- PyErr_SetString(PyExc_NotImplementedError,
-   "colorAllocateAlpha() requires gd 2.0 or later");
-    return NULL;
-#else
-    int r,g,b,a;
+#define ROW(im, y) ((im)->trueColor ? (void *)(im)->tpixels[y] : (void *)(im)->pixels[y])
+#define DIFF(x, y) (a->trueColor ? a->tpixels[y][x] != b->tpixels[y][x] \
+                                 : a->pixels[y][x] != b->pixels[y][x])
 
-    if(!PyArg_ParseTuple(args, "(iiii)", &r, &g, &b, &a))
-        return NULL;
-    return(Py_BuildValue("i",gdImageColorAllocateAlpha(self->imagedata,
-      r, g, b, a)));
-#endif
+    for(top = 0; top < sy; top++)
+        if(memcmp(ROW(a, top), ROW(b, top), rowsize) != 0)
+            break;
+    if(top == sy)
+        return 0;
+    for(bottom = sy - 1; bottom > top; bottom--)
+        if(memcmp(ROW(a, bottom), ROW(b, bottom), rowsize) != 0)
+            break;
+
+    left = sx - 1;
+    right = 0;
+    for(y = top; y <= bottom; y++) {
+        for(x = 0; x < left; x++)
+            if(DIFF(x, y)) {
+                left = x;
+                break;
+            }
+        for(x = sx - 1; x > right; x--)
+            if(DIFF(x, y)) {
+                right = x;
+                break;
+            }
+    }
+    if(left > right)        /* the only change is in column left */
+        right = left;
+
+#undef ROW
+#undef DIFF
+
+    *x0 = left;
+    *y0 = top;
+    *x1 = right;
+    *y1 = bottom;
+    return 1;
 }
 
-static PyObject *image_colorclosest(imageobject *self, PyObject *args)
+/* write one frame; called without the GIL, with the frame's image
+ * locked.  returns 0 if out of memory. */
+
+static int gifanim_add(gifanimobject *self, gdImagePtr im, int delay)
 {
-    int r,g,b;
+    gdIOCtxPtr ctx = (gdIOCtxPtr)self->wctx;
+    gdImagePtr sub, prev;
+    int x0, y0, x1, y1, localcm, whole;
+
+    if(!self->prev) {
+        /* the first frame also supplies the screen size and, if asked
+         * for, the global palette */
+        if(!(self->prev = crop_image(im, 0, 0, im->sx, im->sy)))
+            return 0;
+        if(!(self->gct = gdImageCreate(1, 1)))
+            return 0;
+        copy_palette(self->gct, im);
+        gdImageGifAnimBeginCtx(im, ctx, self->global, self->loops);
+        gdImageGifAnimAddCtx(im, ctx, im->trueColor || !self->global,
+            0, 0, delay, gdDisposalNone, NULL);
+        return 1;
+    }
 
-    if(!PyArg_ParseTuple(args, "(iii)", &r, &g, &b))
-        return NULL;
-    return(Py_BuildValue("i",gdImageColorClosest(self->imagedata, r, g, b)));
+    prev = self->prev;
+    whole = prev->trueColor != im->trueColor
+        || (!im->trueColor && !same_palette(prev, im));
+
+    if(whole) {
+        x0 = y0 = 0;
+        x1 = im->sx - 1;
+        y1 = im->sy - 1;
+    } else if(!changed_box(prev, im, &x0, &y0, &x1, &y1)) {
+        /* nothing changed; a single pixel keeps the frame's delay */
+        x0 = x1 = y0 = y1 = 0;
+    }
+
+    if(x0 == 0 && y0 == 0 && x1 == im->sx - 1 && y1 == im->sy - 1)
+        sub = im;
+    else if(!(sub = crop_image(im, x0, y0, x1 - x0 + 1, y1 - y0 + 1)))
+        return 0;
+
+    localcm = im->trueColor || !self->global || !same_palette(self->gct, im);
+    gdImageGifAnimAddCtx(sub, ctx, localcm, x0, y0, delay, gdDisposalNone, NULL);
+
+    if(sub != im)
+        gdImageDestroy(sub);
+
+    /* bring our copy of the frame up to date */
+    if(whole) {
+        if(!(sub = crop_image(im, 0, 0, im->sx, im->sy)))
+            return 0;
+        gdImageDestroy(prev);
+        self->prev = sub;
+    } else {
+        copy_rows(prev, x0, y0, im, x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+    }
+    return 1;
 }
 
-static PyObject *image_colorclosestalpha(imageobject *self, PyObject *args)
-{
-#if GD2_VERS <= 1
- PyErr_SetString(PyExc_NotImplementedError,
-   "colorClosestAlpha() requires gd 2.0 or later");
-    return NULL;
-#else
-    int r,g,b,a;
+/* only one thread at a time may add to a writer; checked and set with
+ * the GIL held */
 
-    if(!PyArg_ParseTuple(args, "(iiii)", &r, &g, &b, &a))
-        return NULL;
-    return(Py_BuildValue("i",gdImageColorClosestAlpha(self->imagedata, r, g, b,
-      a)));
-#endif
+static int gifanim_claim(gifanimobject *self)
+{
+    if(self->busy) {
+        PyErr_SetString(ErrorObject, "GifAnimWriter is in use by another call");
+        return 0;
+    }
+    if(self->closed) {
+        PyErr_SetString(ErrorObject, "GifAnimWriter is closed");
+        return 0;
+    }
+    return 1;
 }
 
-static PyObject *image_colorclosestHWB(imageobject *self, PyObject *args)
+static PyObject *gifanim_addframe(gifanimobject *self, PyObject *args)
 {
-#if GD2_VERS <= 1
- PyErr_SetString(PyExc_NotImplementedError,
-   "colorClosestHWB() requires gd 2.0 or later");
-    return NULL;
-#else
-    int r,g,b;
+    imageobject *img;
+    int delay = 10, ok;
 
-    if(!PyArg_ParseTuple(args, "(iii)", &r, &g, &b))
+    if(!PyArg_ParseTuple(args, "O!|i", &Imagetype, &img, &delay))
+        return NULL;
+    if(!image_check(img))
         return NULL;
-    return(Py_BuildValue("i",gdImageColorClosestHWB(self->imagedata, r,
-      g, b)));
-#endif
-}
 
-static PyObject *image_colorexact(imageobject *self, PyObject *args)
-{
-    int r,g,b;
+    if(!gifanim_claim(self))
+        return NULL;
+    if(self->prev && (gdImageSX(img->imagedata) != gdImageSX(self->prev)
+                   || gdImageSY(img->imagedata) != gdImageSY(self->prev))) {
+        PyErr_SetString(PyExc_ValueError, "all frames must be the same size");
+        return NULL;
+    }
 
-    if(!PyArg_ParseTuple(args, "(iii)", &r, &g, &b))
+    self->busy = 1;
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(img->lock, WAIT_LOCK);
+    self->wctx->image = img;
+    ok = gifanim_add(self, img->imagedata, delay);
+    self->wctx->image = NULL;
+    PyThread_release_lock(img->lock);
+    Py_END_ALLOW_THREADS
+    self->busy = 0;
+
+    if(!ok) {
+        self->closed = 1;
+        return PyErr_NoMemory();
+    }
+    self->frames++;
+
+    if(!PyFileWriteObj_IOCtx_Raise(self->wctx)) {
+        self->closed = 1;
         return NULL;
-    return(Py_BuildValue("i",gdImageColorExact(self->imagedata, r, g, b)));
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
 }
 
-static PyObject *image_colorresolve(imageobject *self, PyObject *args)
+static PyObject *gifanim_close(gifanimobject *self)
 {
-#if GD2_VERS <= 1
- PyErr_SetString(PyExc_NotImplementedError,
-   "colorResolve() requires gd 2.0 or later");
-    return NULL;
-#else
-    int r,g,b;
+    if(!gifanim_claim(self))
+        return NULL;
+    if(!self->prev) {
+        PyErr_SetString(PyExc_ValueError, "no frames have been added");
+        return NULL;
+    }
 
-    if(!PyArg_ParseTuple(args, "(iii)", &r, &g, &b))
+    self->closed = 1;
+    gdImageGifAnimEndCtx((gdIOCtxPtr)self->wctx);
+    PyFileWriteObj_IOCtx_Flush(self->wctx);
+    if(!PyFileWriteObj_IOCtx_Raise(self->wctx))
         return NULL;
-    return(Py_BuildValue("i",gdImageColorResolve(self->imagedata, r,
-      g, b)));
-#endif
+
+    Py_INCREF(Py_None);
+    return Py_None;
 }
 
-static PyObject *image_colorresolvealpha(imageobject *self, PyObject *args)
+static PyObject *gifanim_byteswritten(gifanimobject *self)
 {
-#if GD2_VERS <= 1
- PyErr_SetString(PyExc_NotImplementedError,
-   "colorResolveAlpha() requires gd 2.0 or later");
-    return NULL;
-#else
-    int r,g,b,a;
-
-    if(!PyArg_ParseTuple(args, "(iiii)", &r, &g, &b, &a))
-        return NULL;
-    return(Py_BuildValue("i",gdImageColorResolveAlpha(self->imagedata, r,
-      g, b, a)));
-#endif
+    return Py_BuildValue("l", self->wctx->total);
 }
 
-static PyObject *image_colorstotal(imageobject *self)
+static PyObject *gifanim_frameswritten(gifanimobject *self)
 {
-    return Py_BuildValue("i",gdImageColorsTotal(self->imagedata));
+    return Py_BuildValue("i", self->frames);
 }
 
+static struct PyMethodDef gifanim_methods[] = {
 
-static PyObject *image_colorcomponents(imageobject *self, PyObject *args)
-{
-    int c,r,g,b;
+ {"addFrame",    (PyCFunction)gifanim_addframe,    1,
+    "addFrame(image[, delay])\n"
+    "append image to the animation, to be shown for delay hundredths of a\n"
+    "second (default 10).  only the part which differs from the previous\n"
+    "frame is encoded, and it is written out straight away."},
 
-    if(!PyArg_ParseTuple(args, "i", &c))
-        return NULL;
-    r=gdImageRed(self->imagedata,c);
-    g=gdImageGreen(self->imagedata,c);
-    b=gdImageBlue(self->imagedata,c);
-    return Py_BuildValue("(iii)",r,g,b);
-}
+ {"close",    (PyCFunction)gifanim_close,    1,
+    "close()\n"
+    "finish the animation."},
 
+ {"bytesWritten",    (PyCFunction)gifanim_byteswritten,    1,
+    "bytesWritten()\n"
+    "returns the number of bytes of GIF data produced so far"},
 
-static PyObject *image_getclip(imageobject *self)
+ {"framesWritten",    (PyCFunction)gifanim_frameswritten,    1,
+    "framesWritten()\n"
+    "returns the number of frames written so far"},
+
+ {NULL,        NULL}        /* sentinel */
+};
+
+static void gifanim_dealloc(gifanimobject *self)
 {
-    int x1, y1, x2, y2;
-    gdImageGetClip(self->imagedata, &x1, &y1, &x2, &y2);
-    return Py_BuildValue("(ii)(ii)", x1, y1, x2, y2);
+    if(self->wctx) {
+        if(!free_PyFileWriteObj_IOCtx(self->wctx))
+            PyErr_Clear();
+    }
+    if(self->prev)
+        gdImageDestroy(self->prev);
+    if(self->gct)
+        gdImageDestroy(self->gct);
+    PyObject_DEL(self);
 }
 
-static PyObject *image_getinterlaced(imageobject *self)
+static PyObject *gifanim_getattr(PyObject *self, char *name)
 {
-    return Py_BuildValue("i",gdImageGetInterlaced(self->imagedata));
+    return Py_FindMethod(gifanim_methods, self, name);
 }
 
+static PyTypeObject GifAnimtype = {
+    PyObject_HEAD_INIT(NULL)
+    0,                                  /*ob_size*/
+    "GifAnimWriter",                    /*tp_name*/
+    sizeof(gifanimobject),              /*tp_basicsize*/
+    0,                                  /*tp_itemsize*/
+    /* methods */
+    (destructor)gifanim_dealloc,        /*tp_dealloc*/
+    0,                                  /*tp_print*/
+    (getattrfunc)gifanim_getattr,       /*tp_getattr*/
+};
 
-static PyObject *image_gettransparent(imageobject *self)
+static PyObject *gd_gifanimwriter(PyObject *module, PyObject *args, PyObject *kwds)
 {
-    return Py_BuildValue("i",gdImageGetTransparent(self->imagedata));
-}
+    static char *kwlist[] = {"f", "loops", "global_palette", NULL};
+    gifanimobject *self;
+    PyObject *fileobj;
+    int loops = 0, global = 1;
 
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|ii", kwlist,
+            &fileobj, &loops, &global))
+        return NULL;
 
-static PyObject *image_colordeallocate(imageobject *self, PyObject *args)
-{
-    int c;
+    if(!PyObject_HasAttrString(fileobj, "write")) {
+        PyErr_SetString(ErrorObject, "first argument must be an object with a write method");
+        return NULL;
+    }
 
-    if(!PyArg_ParseTuple(args, "i", &c))
+    if(!(self = PyObject_NEW(gifanimobject, &GifAnimtype)))
         return NULL;
-    gdImageColorDeallocate(self->imagedata, c);
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    self->prev = self->gct = NULL;
+    self->loops = loops;
+    self->global = global != 0;
+    self->frames = self->closed = self->busy = 0;
+    if(!(self->wctx = alloc_PyFileWriteObj_IOCtx(fileobj))) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+
+    return (PyObject *)self;
 }
+#endif
 
+/*
+** Methods for the image type
+*/
 
-static PyObject *image_colortransparent(imageobject *self, PyObject *args)
-{
-    int c;
+imageobject *makeGDImage(gdImagePtr imagedata)
+    {
+    gdImagePtr newimg = gdImageCreate(gdImageSX(imagedata),
+      gdImageSY(imagedata));
+    imageobject *rval = 0;
+    gdImageCopy(newimg, imagedata, 0, 0, 0, 0, gdImageSX(imagedata),
+      gdImageSY(imagedata));
 
-    if(!PyArg_ParseTuple(args, "i", &c))
+    if (!(rval = PyObject_NEW(imageobject, &Imagetype)))
         return NULL;
-    gdImageColorTransparent(self->imagedata, c);
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    rval->current_tile = rval->current_brush = NULL;
+    rval->writer = 0;
+    rval->origin_x = rval->origin_y = 0;
+    rval->multiplier_x = rval->multiplier_y = 1;
+    rval->imagedata = newimg;
+    if (!(rval->lock = PyThread_allocate_lock())) {
+        Py_DECREF(rval);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    return rval;
+    }
+
+
+/*** I/O Methods ***/
+
+static PyObject *image_writegif(imageobject *self, PyObject *args)
+{
+    return write_file(self, args, 'f');
 }
 
 
-static PyObject *image_copyto(imageobject *self, PyObject *args)
+static PyObject *image_writepng(imageobject *self, PyObject *args, PyObject *kwds)
 {
-    imageobject *dest;
-    int dx,dy,sx,sy,w,h,dw,dh;
+#ifdef HAVE_LIBPNG
+    static char *kwlist[] = {"f", "level", "strategy", NULL};
+    PyObject *fileobj, *levelObj = NULL, *strategyObj = NULL, *rv;
+    int level, filters;
 
-    dx=dy=sx=sy=0;
-    w = gdImageSX(self->imagedata);
-    h = gdImageSY(self->imagedata);
-    if(!PyArg_ParseTuple(args, "O!|(ii)(ii)(ii)", &Imagetype, &dest, &dx, &dy, &sx, &sy, &w, &h))
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|OO", kwlist, &fileobj,
+            &levelObj, &strategyObj))
         return NULL;
-    dw = gdImageSX(dest->imagedata);
-    dh = gdImageSY(dest->imagedata);
-    gdImageCopy(dest->imagedata, self->imagedata, X(dx), Y(dy), X(sx), Y(sy), W(w), H(h));
+    if(!png_options(levelObj, strategyObj, &level, &filters))
+        return NULL;
+    /* gd's writer can't choose the row filters; the presets and
+     * strategies need libpng driven directly, which is only done for
+     * truecolor.  a preset's filter can just be left out, but an
+     * explicit strategy can't be honoured. */
+    if(strategyObj && strategyObj != Py_None && !gdImageTrueColor(self->imagedata)) {
+        PyErr_SetString(PyExc_ValueError,
+            "a PNG strategy can only be given for truecolor images");
+        return NULL;
+    }
+    if(filters != -1 && gdImageTrueColor(self->imagedata))
+        return write_png_filtered(self, fileobj, level, filters);
+    if(!(args = Py_BuildValue("(Oi)", fileobj, level)))
+        return NULL;
+    rv = write_file(self, args, 'p');
+    Py_DECREF(args);
+    return rv;
+#else
+    return write_file(self, args, 'p');
+#endif
+}
 
-    Py_INCREF(Py_None);
-    return Py_None;
+
+static PyObject *image_writejpeg(imageobject *self, PyObject *args)
+{
+    return write_file(self, args, 'j');
 }
 
 
-static PyObject *image_copyresizedto(imageobject *self, PyObject *args)
+static PyObject *image_writegd(imageobject *self, PyObject *args)
 {
-    imageobject *dest;
-    int dx,dy,sx,sy,dw,dh,sw,sh;
+    return write_file(self, args, 'g');
+}
 
-    dx=dy=sx=sy=0;
-    sw = gdImageSX(self->imagedata);
-    sh = gdImageSY(self->imagedata);
-    if(PyArg_ParseTuple(args, "O!|(ii)(ii)", &Imagetype, &dest, &dx, &dy, &sx, &sy))
-    {
-        dw = gdImageSX(dest->imagedata);
-        dh = gdImageSY(dest->imagedata);
-    }
-    else if(PyErr_Clear(), !PyArg_ParseTuple(args, "O!|(ii)(ii)(ii)(ii)", &Imagetype, &dest, &dx, &dy, &sx, &sy, &dw, &dh, &sw, &sh))
-        return NULL;
-    gdImageCopyResized(dest->imagedata, self->imagedata, X(dx), Y(dy), X(sx), Y(sy), W(dw), H(dh), W(sw), H(sh));
 
-    Py_INCREF(Py_None);
-    return Py_None;
+static PyObject *image_writegd2(imageobject *self, PyObject *args)
+{
+    return write_file(self, args, 'G');
 }
 
 
-static PyObject *image_copyresampledto(imageobject *self, PyObject *args)
+static PyObject *image_writewbmp(imageobject *self, PyObject *args)
 {
-#if GD2_VERS <= 1
- PyErr_SetString(PyExc_NotImplementedError,
-   "copyResampledTo() requires gd 2.0 or later");
-    return NULL;
-#else
-    imageobject *dest;
-    int dx,dy,sx,sy,dw,dh,sw,sh;
+    return write_file(self, args, 'w');
+}
 
-    dx=dy=sx=sy=0;
-    sw = gdImageSX(self->imagedata);
-    sh = gdImageSY(self->imagedata);
-    if(PyArg_ParseTuple(args, "O!|(ii)(ii)", &Imagetype, &dest, &dx, &dy,
-      &sx, &sy))
-    {
-        dw = gdImageSX(dest->imagedata);
-        dh = gdImageSY(dest->imagedata);
-    }
-    else if(PyErr_Clear(), !PyArg_ParseTuple(args, "O!|(ii)(ii)(ii)(ii)",
-      &Imagetype, &dest, &dx, &dy, &sx, &sy, &dw, &dh, &sw, &sh))
-        return NULL;
-    gdImageCopyResampled(dest->imagedata, self->imagedata, X(dx), Y(dy),
-      X(sx), Y(sy), W(dw), H(dh), W(sw), H(sh));
 
-    Py_INCREF(Py_None);
-    return Py_None;
+/*
+** encode_many: several encodings of one image at once.  The image is
+** locked for the duration, and each encoding runs on its own thread
+** against the same (unchanging) pixels.
+*/
+
+typedef struct {
+    char fmt;
+    int arg1, arg2;
+    void *data;
+    int size;
+} encode_job;
+
+typedef struct {
+    gdImagePtr im;
+    encode_job *jobs;
+} encode_batch;
+
+static void encode_one(void *arg, int i)
+{
+    encode_batch *eb = (encode_batch *)arg;
+    encode_job *job = &eb->jobs[i];
+
+    switch(job->fmt) {
+#ifdef HAVE_LIBGIF
+    case 'f':
+        job->data = gdImageGifPtr(eb->im, &job->size);
+        break;
 #endif
+#ifdef HAVE_LIBPNG
+    case 'p':
+        job->data = gdImagePngPtrEx(eb->im, &job->size, job->arg1);
+        break;
+#endif
+#ifdef HAVE_LIBJPEG
+    case 'j':
+        job->data = gdImageJpegPtr(eb->im, &job->size, job->arg1);
+        break;
+#endif
+    case 'g':
+        job->data = gdImageGdPtr(eb->im, &job->size);
+        break;
+    case 'G':
+        job->data = gdImageGd2Ptr(eb->im, job->arg1, job->arg2, &job->size);
+        break;
+    case 'w':
+        job->data = gdImageWBMPPtr(eb->im, &job->size, job->arg1);
+        break;
+    }
 }
 
-static PyObject *image_copymergeto(imageobject *self, PyObject *args)
+static struct {
+    char *name;
+    char fmt;
+    char *opt1, *opt2;          /* option names for arg1, arg2 */
+    int def1, def2;
+} encode_formats[] = {
+#ifdef HAVE_LIBGIF
+    {"gif",  'f', NULL, NULL, 0, 0},
+#endif
+#ifdef HAVE_LIBPNG
+    {"png",  'p', "level", NULL, -1, 0},
+#endif
+#ifdef HAVE_LIBJPEG
+    {"jpeg", 'j', "quality", NULL, -1, 0},
+    {"jpg",  'j', "quality", NULL, -1, 0},
+#endif
+    {"gd",   'g', NULL, NULL, 0, 0},
+    {"gd2",  'G', "chunksize", "fmt", 0, GD2_FMT_COMPRESSED},
+    {"wbmp", 'w', "fg", NULL, 0, 0},
+    {NULL}
+};
+
+/* fill in job from one ("format", {options}) entry, or just "format" */
+
+static int encode_parse(PyObject *item, encode_job *job)
 {
-#if GD2_VERS <= 1
- PyErr_SetString(PyExc_NotImplementedError,
-   "copyMergeTo() requires gd 2.0 or later");
-    return NULL;
-#else
-    imageobject *dest;
-    int dx,dy,sx,sy,w,h,dw,dh,pct;
+    PyObject *opts = NULL, *key, *value;
+    Py_ssize_t pos = 0;
+    char *name, *k;
+    int i, v;
+
+    if(PyString_Check(item))
+        name = PyString_AS_STRING(item);
+    else if(!PyTuple_Check(item)) {
+        PyErr_SetString(PyExc_TypeError,
+            "encode_many() formats must be names or (name, options) tuples");
+        return 0;
+    } else if(!PyArg_ParseTuple(item, "s|O!", &name, &PyDict_Type, &opts))
+        return 0;
 
-    dx=dy=sx=sy=0;
-    w = gdImageSX(self->imagedata);
-    h = gdImageSY(self->imagedata);
-    pct = 100;
-    if(!PyArg_ParseTuple(args, "O!|(ii)(ii)(ii)i", &Imagetype, &dest, &dx, &dy, &sx, &sy, &w, &h, &pct))
-        return NULL;
-    dw = gdImageSX(dest->imagedata);
-    dh = gdImageSY(dest->imagedata);
-    gdImageCopyMerge(dest->imagedata, self->imagedata, X(dx), Y(dy), X(sx), Y(sy), W(w), H(h), pct);
+    for(i = 0; encode_formats[i].name; i++)
+        if(strcmp(name, encode_formats[i].name) == 0)
+            break;
+    if(!encode_formats[i].name) {
+        PyErr_Format(PyExc_ValueError, "can't encode %s", name);
+        return 0;
+    }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    job->fmt = encode_formats[i].fmt;
+    job->arg1 = encode_formats[i].def1;
+    job->arg2 = encode_formats[i].def2;
+    job->data = NULL;
+    job->size = 0;
+
+    while(opts && PyDict_Next(opts, &pos, &key, &value)) {
+        k = PyString_Check(key) ? PyString_AS_STRING(key) : "";
+#ifdef HAVE_LIBPNG
+        if(job->fmt == 'p' && strcmp(k, "level") == 0) {
+            if(!png_options(value, NULL, &job->arg1, &v))
+                return 0;
+            continue;
+        }
 #endif
+        v = PyInt_AsLong(value);
+        if(v == -1 && PyErr_Occurred())
+            return 0;
+        if(encode_formats[i].opt1 && strcmp(k, encode_formats[i].opt1) == 0)
+            job->arg1 = v;
+        else if(encode_formats[i].opt2 && strcmp(k, encode_formats[i].opt2) == 0)
+            job->arg2 = v;
+        else {
+            PyErr_Format(PyExc_ValueError, "unknown %s option", name);
+            return 0;
+        }
+    }
+
+    if(job->fmt == 'G' && job->arg2 != GD2_FMT_RAW && job->arg2 != GD2_FMT_COMPRESSED)
+        job->arg2 = GD2_FMT_COMPRESSED;
+    return 1;
 }
 
-static PyObject *image_copymergegrayto(imageobject *self, PyObject *args)
+static PyObject *image_encode_many(imageobject *self, PyObject *args)
 {
-#if GD2_VERS <= 1
- PyErr_SetString(PyExc_NotImplementedError,
-   "copyMergeGrayTo() requires gd 2.0 or later");
-    return NULL;
-#else
-    imageobject *dest;
-    int dx,dy,sx,sy,w,h,dw,dh,pct;
+    PyObject *seq, *item, *result = NULL;
+    encode_batch eb;
+    int i, n, threads = 0;
 
-    dx=dy=sx=sy=0;
-    w = gdImageSX(self->imagedata);
-    h = gdImageSY(self->imagedata);
-    pct = 100;
-    if(!PyArg_ParseTuple(args, "O!|(ii)(ii)(ii)i", &Imagetype, &dest, &dx, &dy, &sx, &sy, &w, &h, &pct))
+    if(!PyArg_ParseTuple(args, "O|i", &seq, &threads))
+        return NULL;
+    if(!(seq = PySequence_Fast(seq, "encode_many() requires a sequence")))
         return NULL;
-    dw = gdImageSX(dest->imagedata);
-    dh = gdImageSY(dest->imagedata);
-    gdImageCopyMergeGray(dest->imagedata, self->imagedata, X(dx), Y(dy), X(sx), Y(sy), W(w), H(h), pct);
 
-    Py_INCREF(Py_None);
-    return Py_None;
-#endif
+    n = PySequence_Fast_GET_SIZE(seq);
+    if(!(eb.jobs = calloc(n ? n : 1, sizeof(encode_job)))) {
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+    for(i = 0; i < n; i++)
+        if(!encode_parse(PySequence_Fast_GET_ITEM(seq, i), &eb.jobs[i]))
+            goto done;
+
+    if(threads <= 0)
+        threads = n;
+
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    eb.im = self->imagedata;
+    par_run(n, threads, encode_one, &eb);
+    PyThread_release_lock(self->lock);
+    Py_END_ALLOW_THREADS
+
+    if(!(result = PyList_New(n)))
+        goto done;
+    for(i = 0; i < n; i++) {
+        if(!eb.jobs[i].data) {
+            PyErr_SetString(ErrorObject, "encoding failed");
+            Py_CLEAR(result);
+            goto done;
+        }
+        if(!(item = PyString_FromStringAndSize(eb.jobs[i].data, eb.jobs[i].size))) {
+            Py_CLEAR(result);
+            goto done;
+        }
+        PyList_SET_ITEM(result, i, item);
+    }
+
+done:
+    for(i = 0; i < n; i++)
+        if(eb.jobs[i].data)
+            gdFree(eb.jobs[i].data);
+    free(eb.jobs);
+    Py_DECREF(seq);
+    return result;
 }
 
-static PyObject *image_copypaletteto(imageobject *self, PyObject *args)
+
+/*
+** Encoded output cache.  When enabled (with setEncodeCache) write_file
+** looks for an earlier encoding of the same pixels with the same
+** settings before running the encoder.  Entries are keyed by a 128 bit
+** hash of everything that reaches the output: size, pixel rows, the
+** whole palette (open slots included, gd's PNG writer leaves those out),
+** transparency, interlace, alpha saving, and with gd 2.1 and later the
+** resolution and truecolor-to-GIF quantization settings, along with the
+** format and its parameters.  Entries are found through a hash table
+** on the first half of the key; the least recently used are dropped to
+** keep the total size of the cached data under the limit.
+*/
+
+typedef unsigned PY_LONG_LONG cache_hash_t;
+
+typedef struct cache_entry {
+    cache_hash_t h1, h2;
+    char fmt;
+    int arg1, arg2, size;
+    struct cache_entry *prev, *next;    /* most recently used first */
+    struct cache_entry *chain;          /* next in the same bucket */
+    char data[1];
+} cache_entry;
+
+#define CACHE_BUCKETS 64                /* initial table size */
+
+static PyThread_type_lock cache_mutex;  /* guards everything below */
+static cache_entry *cache_head, *cache_tail;
+static cache_entry **cache_table;       /* buckets by h1 */
+static size_t cache_nbuckets;           /* a power of two, or 0 */
+static size_t cache_max, cache_bytes;
+static long cache_entries, cache_hits, cache_misses;
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/* mix n bytes into the two hash lanes, a word at a time */
+
+static void cache_hash(cache_hash_t *h1, cache_hash_t *h2, const void *p, size_t n)
 {
-#if GD2_VERS <= 1
- PyErr_SetString(PyExc_NotImplementedError,
-   "copyPaletteTo() requires gd 2.0 or later");
-    return NULL;
-#else
-    imageobject *dest;
-    if(!PyArg_ParseTuple(args, "O!", &Imagetype, &dest))
-        return NULL;
+    const unsigned char *b = (const unsigned char *)p;
+    cache_hash_t a = *h1, c = *h2, w;
 
-    gdImagePaletteCopy(dest->imagedata,  self->imagedata);
-    Py_INCREF(Py_None);
-    return Py_None;
-#endif
+    for(; n >= 8; n -= 8, b += 8) {
+        memcpy(&w, b, 8);
+        a = ROTL64(a ^ (w * 0x87c37b91114253d5ULL), 31) * 0x9e3779b97f4a7c15ULL;
+        c = ROTL64(c ^ (w * 0x4cf5ad432745937fULL), 29) * 0xc2b2ae3d27d4eb4fULL;
+    }
+    for(; n; n--, b++) {
+        a = (a ^ *b) * 0x100000001b3ULL;
+        c = ROTL64(c ^ *b, 7) * 0x9e3779b97f4a7c15ULL;
+    }
+    *h1 = a;
+    *h2 = c;
 }
 
-static PyObject *image_compare(imageobject *self, PyObject *args)
+static void cache_key(gdImagePtr im, char fmt, int arg1, int arg2,
+    cache_hash_t *h1, cache_hash_t *h2)
 {
-#if GD2_VERS <= 1
- PyErr_SetString(PyExc_NotImplementedError,
-   "compare() requires gd 2.0 or later");
-    return NULL;
+    int y, head[16];
+
+    *h1 = 0x243f6a8885a308d3ULL;
+    *h2 = 0x13198a2e03707344ULL;
+
+    head[0] = fmt;
+    head[1] = arg1;
+    head[2] = arg2;
+    head[3] = im->sx;
+    head[4] = im->sy;
+    head[5] = im->trueColor;
+    head[6] = im->transparent;
+    head[7] = im->interlace;
+    head[8] = im->saveAlphaFlag;
+    head[9] = im->trueColor ? 0 : im->colorsTotal;
+#ifdef GD_RESOLUTION
+    head[10] = (int)im->res_x;
+    head[11] = (int)im->res_y;
+    head[12] = im->paletteQuantizationMethod;
+    head[13] = im->paletteQuantizationSpeed;
+    head[14] = im->paletteQuantizationMinQuality;
+    head[15] = im->paletteQuantizationMaxQuality;
 #else
-    imageobject *dest;
-    if(!PyArg_ParseTuple(args, "O!", &Imagetype, &dest))
-        return NULL;
-
-    return Py_BuildValue("i", gdImageCompare(dest->imagedata,
-      self->imagedata));
+    head[10] = head[11] = head[12] = head[13] = head[14] = head[15] = 0;
 #endif
+    cache_hash(h1, h2, head, sizeof(head));
+
+    if(im->trueColor) {
+        for(y = 0; y < im->sy; y++)
+            cache_hash(h1, h2, im->tpixels[y], im->sx * sizeof(int));
+    } else {
+        /* all of it: gif pads the palette out to a power of two and gd
+         * writes every slot, so even colors past colorsTotal matter */
+        cache_hash(h1, h2, im->red, sizeof(im->red));
+        cache_hash(h1, h2, im->green, sizeof(im->green));
+        cache_hash(h1, h2, im->blue, sizeof(im->blue));
+        cache_hash(h1, h2, im->alpha, sizeof(im->alpha));
+        cache_hash(h1, h2, im->open, sizeof(im->open));
+        for(y = 0; y < im->sy; y++)
+            cache_hash(h1, h2, im->pixels[y], im->sx);
+    }
 }
 
-static PyObject *image_interlace(imageobject *self, PyObject *args)
-{
-    int i;
+/* the following want cache_mutex held */
 
-    if(!PyArg_ParseTuple(args, "i", &i))
-        return NULL;
-    gdImageInterlace(self->imagedata, i);
+static void cache_unlink(cache_entry *e)
+{
+    if(e->prev)
+        e->prev->next = e->next;
+    else
+        cache_head = e->next;
+    if(e->next)
+        e->next->prev = e->prev;
+    else
+        cache_tail = e->prev;
+}
 
-    Py_INCREF(Py_None);
-    return Py_None;
+static void cache_push(cache_entry *e)
+{
+    e->prev = NULL;
+    e->next = cache_head;
+    if(cache_head)
+        cache_head->prev = e;
+    else
+        cache_tail = e;
+    cache_head = e;
 }
 
+#define cache_bucket(h1) (&cache_table[(size_t)(h1) & (cache_nbuckets - 1)])
 
-static PyObject *image_savealpha(imageobject *self, PyObject *args)
+static cache_entry *cache_find(cache_hash_t h1, cache_hash_t h2, char fmt,
+    int arg1, int arg2)
 {
-    int i;
+    cache_entry *e;
 
-    if(!PyArg_ParseTuple(args, "i", &i))
+    if(!cache_nbuckets)
         return NULL;
-    gdImageSaveAlpha(self->imagedata, i);
+    for(e = *cache_bucket(h1); e; e = e->chain)
+        if(e->h1 == h1 && e->h2 == h2 && e->fmt == fmt
+        && e->arg1 == arg1 && e->arg2 == arg2)
+            return e;
+    return NULL;
+}
 
-    Py_INCREF(Py_None);
-    return Py_None;
+/* keep the table at least as big as the number of entries; if it can't
+ * grow, the chains just get longer */
+
+static int cache_grow(void)
+{
+    size_t n = cache_nbuckets ? cache_nbuckets * 2 : CACHE_BUCKETS, i;
+    cache_entry **t, **old = cache_table, *e, *next;
+
+    if(!(t = calloc(n, sizeof(cache_entry *))))
+        return cache_nbuckets != 0;
+    cache_table = t;
+    for(i = 0; i < cache_nbuckets; i++)
+        for(e = old[i]; e; e = next) {
+            next = e->chain;
+            e->chain = t[(size_t)e->h1 & (n - 1)];
+            t[(size_t)e->h1 & (n - 1)] = e;
+        }
+    cache_nbuckets = n;
+    free(old);
+    return 1;
 }
 
+/* add e to the table and the front of the list; 0 if there's no table */
 
-static PyObject *image_origin(imageobject *self, PyObject *args)
+static int cache_insert(cache_entry *e)
 {
-    if(!PyArg_ParseTuple(args, "(ii)|ii",&self->origin_x,&self->origin_y,
-        &self->multiplier_x,&self->multiplier_y))
-        return NULL;
+    cache_entry **b;
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    if((size_t)cache_entries >= cache_nbuckets && !cache_grow())
+        return 0;
+    b = cache_bucket(e->h1);
+    e->chain = *b;
+    *b = e;
+    cache_push(e);
+    cache_bytes += e->size;
+    cache_entries++;
+    return 1;
 }
 
-
-static PyObject *image_getorigin(imageobject *self)
+static void cache_remove(cache_entry *e)
 {
-    return Py_BuildValue("((ii)ii)",self->origin_x,self->origin_y,self->multiplier_x,self->multiplier_y);
+    cache_entry **p;
+
+    for(p = cache_bucket(e->h1); *p != e; p = &(*p)->chain)
+        ;
+    *p = e->chain;
+    cache_unlink(e);
+    cache_bytes -= e->size;
+    cache_entries--;
 }
 
+static void cache_trim(size_t limit)
+{
+    cache_entry *e;
 
-static struct PyMethodDef image_methods[] = {
+    while(cache_bytes > limit && (e = cache_tail)) {
+        cache_remove(e);
+        free(e);
+    }
+}
 
- {"writeGif",    (PyCFunction)image_writegif,    1,
-    "writeGif(f)\n"
-    "write the image to f as a GIF, where f is either an open file object or a\n"
-    "file name."},
+static int cache_enabled(char fmt)
+{
+    int i;
 
- {"writePng",    (PyCFunction)image_writepng,    1,
-    "writePng(f)\n"
-    "write the image to f as a PNG, where f is either an open file object or a\n"
-    "file name."},
+    if(!cache_max)              /* racy, but only a hint */
+        return 0;
+    for(i = 0; encode_formats[i].name; i++)
+        if(encode_formats[i].fmt == fmt)
+            return 1;
+    return 0;
+}
 
- {"writeJpeg",    (PyCFunction)image_writejpeg,    1,
-    "writeJpeg(f,quality)\n"
-    "write the image to f as a JPEG, where f is either an open file object or a\n"
-    "file name.  quality is an optional integer value giving the JPEG quality from\n"
-    "0 to 95%; leave out for default quality."},
+/* returns the image encoded, in memory from malloc(), or NULL.  called
+ * without the GIL, with the image locked. */
 
- {"writeWbmp",    (PyCFunction)image_writewbmp,    1,
-    "writeWbmp(f,fg)\n"
-    "write the image to f as a WBMP, where f is either an open file object or a\n"
-    "file name.  fg is a foreground color index which will be set in the output\n"
-    "file; see the gd documentation for a further explanation of this value."},
+static void *cache_encode(gdImagePtr im, char fmt, int arg1, int arg2, int *size)
+{
+    cache_hash_t h1, h2;
+    cache_entry *e;
+    encode_batch eb;
+    encode_job job;
+    void *data = NULL;
+
+    cache_key(im, fmt, arg1, arg2, &h1, &h2);
+
+    PyThread_acquire_lock(cache_mutex, WAIT_LOCK);
+    if((e = cache_find(h1, h2, fmt, arg1, arg2))) {
+        cache_hits++;
+        cache_unlink(e);
+        cache_push(e);
+        if((data = malloc(e->size ? e->size : 1))) {
+            memcpy(data, e->data, e->size);
+            *size = e->size;
+        }
+    } else {
+        cache_misses++;
+    }
+    PyThread_release_lock(cache_mutex);
+    if(e)
+        return data;
+
+    job.fmt = fmt;
+    job.arg1 = arg1;
+    job.arg2 = arg2;
+    job.data = NULL;
+    job.size = 0;
+    eb.im = im;
+    eb.jobs = &job;
+    encode_one(&eb, 0);
+    if(!job.data)
+        return NULL;
 
- {"writeGd",    (PyCFunction)image_writegd,     1,
-    "writeGd(f)\n"
-    "write the image to f as a GD file, where f is either an open file object\n"
-    "or a file name."},
+    if((data = malloc(job.size ? job.size : 1)))
+        memcpy(data, job.data, job.size);
+    *size = job.size;
+
+    /* the same image may have been encoded meanwhile by another thread,
+     * in which case the entry already there is kept */
+    if((size_t)job.size <= cache_max
+    && (e = malloc(sizeof(cache_entry) + job.size))) {
+        e->h1 = h1;
+        e->h2 = h2;
+        e->fmt = fmt;
+        e->arg1 = arg1;
+        e->arg2 = arg2;
+        e->size = job.size;
+        memcpy(e->data, job.data, job.size);
+        PyThread_acquire_lock(cache_mutex, WAIT_LOCK);
+        if(cache_find(h1, h2, fmt, arg1, arg2) || !cache_insert(e)) {
+            free(e);
+        } else {
+            cache_trim(cache_max);
+        }
+        PyThread_release_lock(cache_mutex);
+    }
 
- {"writeGd2",    (PyCFunction)image_writegd2,    1,
-    "writeGd(f,chunksize,fmt)\n"
-    "write the image to f as a GD2 file, where f is either an open file object\n"
-    "or a file name.  see the gd documentation for an explanation of the chunksize\n"
-    "and fmt arguments.  defaults will be used if not given."},
+    gdFree(job.data);
+    return data;
+}
 
- {"setPixel",    (PyCFunction)image_setpixel,    1,
-    "setPixel((x,y), color)\n"
-    "set the pixel at (x,y) to color"},
+static PyObject *gd_setencodecache(PyObject *self, PyObject *args)
+{
+    long maxbytes;
 
- {"line",    (PyCFunction)image_line,    1,
-    "line((x1,y1), (x2,y2), color)\n"
-    "draw a line from (x1,y1) to (x2,y2) in color"},
+    if(!PyArg_ParseTuple(args, "l", &maxbytes))
+        return NULL;
+    if(maxbytes < 0) {
+        PyErr_SetString(PyExc_ValueError, "cache size cannot be negative");
+        return NULL;
+    }
+    if(!cache_mutex) {
+        PyErr_SetString(ErrorObject, "encode cache not available");
+        return NULL;
+    }
 
- {"lines",    (PyCFunction)image_lines,    1,
-    "line(seq, color)\n"
-    "seq is a list of x,y tuples.  Draw a connected line in color"},
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(cache_mutex, WAIT_LOCK);
+    cache_max = (size_t)maxbytes;
+    cache_trim(cache_max);
+    PyThread_release_lock(cache_mutex);
+    Py_END_ALLOW_THREADS
 
+    Py_INCREF(Py_None);
+    return Py_None;
+}
 
- {"polygon",    (PyCFunction)image_polygon,    1,
-    "polygon(((x1,y1), (x2,y2), ..., (xn, yn)), color[, fillcolor])\n"
-    "draw a polygon using the list or tuple of points (minimum 3) in color,\n"
-    "optionally filled with fillcolor"},
+static PyObject *gd_encodecacheinfo(PyObject *self, PyObject *args)
+{
+    long hits, misses, entries, bytes, maxbytes;
 
- {"rectangle",    (PyCFunction)image_rectangle, 1,  "rectangle((x1,y1), (x2,y2), color[, fillcolor])\n"
-    "draw a rectangle with upper corner (x1,y1), lower corner (x2,y2) in color,\n"
-    "optionally filled with fillcolor"},
+    if(!PyArg_ParseTuple(args, ""))
+        return NULL;
 
- {"filledPolygon",    (PyCFunction)image_filledpolygon, 1,
-    "filledPolygon(((x1,y1), (x2,y2), ..., (xn, yn)), color)\n"
-    "draw a filled polygon using the list or tuple of points (minimum 3) in color"},
+    if(cache_mutex) {
+        PyThread_acquire_lock(cache_mutex, WAIT_LOCK);
+        hits = cache_hits;
+        misses = cache_misses;
+        entries = cache_entries;
+        bytes = (long)cache_bytes;
+        maxbytes = (long)cache_max;
+        PyThread_release_lock(cache_mutex);
+    } else
+        hits = misses = entries = bytes = maxbytes = 0;
+
+    return Py_BuildValue("{s:l,s:l,s:l,s:l,s:l}", "hits", hits,
+        "misses", misses, "entries", entries, "bytes", bytes,
+        "maxbytes", maxbytes);
+}
 
- {"filledRectangle",    (PyCFunction)image_filledrectangle, 1,
-    "filledRectangle((x1,y1), (x2,y2), color)\n"
-    "draw a rectangle with upper corner (x1,y1), lower corner (x2,y2) in color"},
+/*** Drawing Methods ***/
 
- {"arc",    (PyCFunction)image_arc,    1,
-    "arc((x,y), (w,h), start, end, color)\n"
-    "draw an ellipse centered at (x,y) with width w, height h from start\n"
-    "degrees to end degrees in color."},
+static PyObject *image_setpixel(imageobject *self, PyObject *args)
+{
+    int x,y,color;
 
- {"filledArc", (PyCFunction)image_filledarc, 1,
-  "filledArc((x,y), (w,h), start, end, color, style)\n"
-  "draw an ellipse centered at (x,y) with width w, height h from start\n"
-  "degrees to end degrees in color.  The style argument is a bitwise OR\n"
-  "of the following (gdArc, gdChord, gdPie, gdNoFill, gdEdged)."},
+    if(!PyArg_ParseTuple(args, "(ii)i", &x, &y, &color))
+        return NULL;
 
- {"filledEllipse",    (PyCFunction)image_filledellipse,    1,
-    "filledEllipse((x,y), (w,h), color)\n"
-    "draw a filled ellipse centered at (x,y) with width w,\n"
-    "height h in color."},
+    LOCKED(self, gdImageSetPixel(self->imagedata, X(x), Y(y), color));
 
- {"fillToBorder",    (PyCFunction)image_filltoborder,    1,
-    "fillToBorder((x,y), border, color)\n"
-    "flood from point (x,y) to border color in color"},
+    Py_INCREF(Py_None);
+    return Py_None;
+}
 
- {"fill",    (PyCFunction)image_fill,    1,
-    "fill((x,y), color)\n"
-    "flood from point (x,y) in color for those pixels with the same color\n"
-    "as the starting point"},
 
- {"setBrush",    (PyCFunction)image_setbrush,    1,
-    "setBrush(image)\n"
-    "set the drawing brush to <image> (use gdBrushed when drawing)"},
+/*
+** Bulk pixel access.  Coordinates and colors may come from anything
+** supporting the buffer interface (NumPy arrays), array.array objects
+** (which only have the old buffer interface in python 2), or any
+** sequence of ints.  Native int data is used in place; anything else
+** is converted to a temporary int array first.
+*/
 
- {"setAntiAliased",    (PyCFunction)image_setantialiased, 1,  "setAntiAliased(color)\n"
-    "Set the foreground color to be used when drawing antialiased lines.  Use the gdAntiAliased in place of the color when drawing"},
+#define PIXELS_NOGIL 4096       /* batches this big release the GIL */
 
- {"setClip",    (PyCFunction)image_setclip, 1,  "setClip((x1,y1), (x2,y2))\n"
-    "Set the image clipping rectangle"},
+typedef struct {
+    int *vals;
+    Py_ssize_t n;
+    int owned;                  /* vals was allocated here */
+    Py_buffer view;
+    int have_view;
+} intarray;
+
+static void intarray_release(intarray *a)
+{
+    if(a->owned)
+        free(a->vals);
+    if(a->have_view)
+        PyBuffer_Release(&a->view);
+    a->vals = NULL;
+    a->owned = a->have_view = 0;
+}
 
+/* convert n items of struct format fmt at p to ints.  the items must
+ * be the size of the native C type; standard sizes ('<l') are not. */
 
- {"setTile",    (PyCFunction)image_settile,    1,
-    "setTile(image)\n"
-    "set the fill tile to <image> (use gdTiled when filling)"},
+static int intarray_convert(intarray *a, const char *fmt, const char *p,
+    Py_ssize_t n, Py_ssize_t itemsize)
+{
+    Py_ssize_t i, size;
+    double d;
 
- {"setStyle",    (PyCFunction)image_setstyle,    1,
-    "setStyle(tuple)\n"
-    "set the line bit-style to tuple of colors (use gdStyled when drawing)"},
+    if(*fmt == '@' || *fmt == '=')
+        fmt++;
+#ifdef WORDS_BIGENDIAN
+    else if(*fmt == '>' || *fmt == '!')
+#else
+    else if(*fmt == '<')
+#endif
+        fmt++;
+    if(!strchr("bBhHiIlLqQfd", *fmt) || fmt[1]) {
+        PyErr_Format(PyExc_TypeError, "can't use array of type '%s' for pixels", fmt);
+        return 0;
+    }
+    switch(*fmt) {
+    case 'b': case 'B': size = sizeof(char); break;
+    case 'h': case 'H': size = sizeof(short); break;
+    case 'i': case 'I': size = sizeof(int); break;
+    case 'l': case 'L': size = sizeof(long); break;
+    case 'q': case 'Q': size = sizeof(PY_LONG_LONG); break;
+    case 'f': size = sizeof(float); break;
+    default: size = sizeof(double); break;
+    }
+    if(itemsize != size) {
+        PyErr_Format(PyExc_TypeError, "can't use array of type '%s' with %d byte items for pixels",
+            fmt, (int)itemsize);
+        return 0;
+    }
+    if(*fmt == 'i' || *fmt == 'I') {
+        a->vals = (int *)p;     /* in place */
+        a->n = n;
+        return 1;
+    }
 
- {"setThickness",    (PyCFunction)image_setthickness,    1,
-    "setThickness(thickness)\n"
-    "set the width of lines, polyons, and arcs."},
+    if(!(a->vals = malloc((n ? n : 1) * sizeof(int)))) {
+        PyErr_NoMemory();
+        return 0;
+    }
+    a->owned = 1;
+    a->n = n;
+
+#define CONVERT(type) \
+    for(i = 0; i < n; i++) a->vals[i] = (int)((const type *)p)[i]
+
+    switch(*fmt) {
+    case 'b': CONVERT(signed char); break;
+    case 'B': CONVERT(unsigned char); break;
+    case 'h': CONVERT(short); break;
+    case 'H': CONVERT(unsigned short); break;
+    case 'l': CONVERT(long); break;
+    case 'L': CONVERT(unsigned long); break;
+    case 'q': CONVERT(PY_LONG_LONG); break;
+    case 'Q': CONVERT(unsigned PY_LONG_LONG); break;
+    case 'f':
+    case 'd':
+        for(i = 0; i < n; i++) {
+            d = *fmt == 'f' ? ((const float *)p)[i] : ((const double *)p)[i];
+            /* out of range (and NaN) goes well outside any image */
+            a->vals[i] = d >= -1e9 && d <= 1e9 ? (int)d : INT_MIN / 2;
+        }
+        break;
+    }
+#undef CONVERT
+    return 1;
+}
 
- {"alphaBlending", (PyCFunction)image_alphablending, 1,
-    "alphaBlending(blending)\n"
-    "toggles alpha channel blending for trucolor images."},
+static int intarray_get(PyObject *obj, intarray *a, int maxdim)
+{
+    PyObject *seq, *tc, *size;
+    const void *p;
+    Py_ssize_t i, len;
+    char fmt[2];
+    int ok;
+
+    memset(a, 0, sizeof(*a));
+
+    if(PyObject_CheckBuffer(obj)) {
+        if(PyObject_GetBuffer(obj, &a->view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0)
+            return 0;
+        a->have_view = 1;
+        if(a->view.ndim > maxdim) {
+            PyErr_SetString(PyExc_ValueError, maxdim == 1 ?
+                "pixel arrays must be one dimensional" : "too many dimensions");
+            intarray_release(a);
+            return 0;
+        }
+        if(!intarray_convert(a, a->view.format ? a->view.format : "B",
+                a->view.buf, a->view.len / a->view.itemsize, a->view.itemsize)) {
+            intarray_release(a);
+            return 0;
+        }
+        return 1;
+    }
 
- {"alpha", (PyCFunction)image_alpha, 1,
-    "alpha(color)\n"
-    "returns the alpha component of the specified color."},
+    /* array.array; its typecodes are struct format characters for
+     * the same C types */
+    if(PyObject_HasAttrString(obj, "typecode")
+    && (tc = PyObject_GetAttrString(obj, "typecode")) != NULL) {
+        size = PyObject_GetAttrString(obj, "itemsize");
+        ok = PyString_Check(tc) && size && PyInt_Check(size)
+            && PyInt_AS_LONG(size) > 0
+            && PyObject_AsReadBuffer(obj, &p, &len) == 0;
+        if(ok) {
+            fmt[0] = PyString_AS_STRING(tc)[0];
+            fmt[1] = '\0';
+            if(fmt[0] == 'c' || fmt[0] == 'u')
+                fmt[0] = '?';   /* not numbers */
+            /* used in place, which is only safe until the GIL is next
+             * let go of; see intarray_pin() */
+            ok = intarray_convert(a, fmt, p, len / PyInt_AS_LONG(size),
+                PyInt_AS_LONG(size));
+        }
+        Py_DECREF(tc);
+        Py_XDECREF(size);
+        if(ok)
+            return 1;
+        if(!PyErr_Occurred())
+            PyErr_SetString(PyExc_TypeError, "can't read array");
+        return 0;
+    }
 
- {"blue", (PyCFunction)image_blue, 1,
-    "blue(color)\n"
-    "returns the blue component of the specified color."},
+    if(!(seq = PySequence_Fast(obj, "pixel coordinates and colors must be arrays or sequences of ints")))
+        return 0;
+    a->n = PySequence_Fast_GET_SIZE(seq);
+    if(!(a->vals = malloc((a->n ? a->n : 1) * sizeof(int)))) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return 0;
+    }
+    a->owned = 1;
+    for(i = 0; i < a->n; i++) {
+        a->vals[i] = PyInt_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+        if(a->vals[i] == -1 && PyErr_Occurred()) {
+            Py_DECREF(seq);
+            intarray_release(a);
+            return 0;
+        }
+    }
+    Py_DECREF(seq);
+    return 1;
+}
 
- {"green", (PyCFunction)image_green, 1,
-    "green(color)\n"
-    "returns the green component of the specified color."},
 
- {"red", (PyCFunction)image_red, 1,
-    "red(color)\n"
-    "returns the red component of the specified color."},
+/* make sure a is safe to use once the GIL is let go of: data borrowed
+ * from an array.array could be moved by a resize.  LOCKED() may let go
+ * of the GIL while it waits, so this is needed before any locking. */
 
- {"getPixel",    (PyCFunction)image_getpixel,    1,
-    "getPixel((x,y))\n"
-    "color index of image at (x,y)"},
+static int intarray_pin(intarray *a)
+{
+    int *v;
 
- {"boundsSafe",    (PyCFunction)image_boundssafe,    1,
-    "boundsSafe((x,y))\n"
-    "returns true if(x,y) is within image"},
+    if(a->owned || a->have_view || !a->vals)
+        return 1;
+    if(!(v = malloc((a->n ? a->n : 1) * sizeof(int)))) {
+        PyErr_NoMemory();
+        return 0;
+    }
+    memcpy(v, a->vals, a->n * sizeof(int));
+    a->vals = v;
+    a->owned = 1;
+    return 1;
+}
 
- {"size",    (PyCFunction)image_size,    1,
-    "size()\n"
-    "return the 2-tuple size of image"},
+static int set_pixels(imageobject *self, const int *xs, const int *ys,
+    const int *colors, int color, Py_ssize_t n)
+{
+    gdImagePtr im = self->imagedata;
+    int x, y, x1, y1, x2, y2, c, inside, count = 0;
+    Py_ssize_t i;
+
+    gdImageGetClip(im, &x1, &y1, &x2, &y2);
+    for(i = 0; i < n; i++) {
+        x = X(xs[i]);
+        y = Y(ys[i]);
+        c = colors ? colors[i] : color;
+        inside = x >= x1 && x <= x2 && y >= y1 && y <= y2;
+        count += inside;
+        /* brushes and the like can reach in from outside */
+        if(inside || c < 0)
+            gdImageSetPixel(im, x, y, c);
+    }
+    return count;
+}
 
- {"char",    (PyCFunction)image_char,1,
-    "char(font, (x,y), c, color)\n"
-    "draw string c at (x,y) using one of the pre-defined gdmodule fonts (gdFont*)"},
+static PyObject *image_setpixels(imageobject *self, PyObject *args)
+{
+    PyObject *xsObj, *ysObj, *colorsObj;
+    intarray xs, ys, colors;
+    int color = 0, count, ok;
 
- {"charUp",    (PyCFunction)image_charup,1,
-    "charUp(font, (x,y), c, color)\n"
-    "vertically draw string c at (x,y) using one of the pre-defined gdmodule\n"
-    "fonts (gdFont*)"},
+    if(!PyArg_ParseTuple(args, "OOO", &xsObj, &ysObj, &colorsObj))
+        return NULL;
 
- {"get_bounding_rect",    (PyCFunction)image_get_bounding_rect,1,
-    "get_bounding_rect(font, ptsize, angle,(x,y), s)\n"
-    "get bounding rect of string s using the truetype font"},
+    memset(&colors, 0, sizeof(colors));
+    if(PyInt_Check(colorsObj) || PyLong_Check(colorsObj)) {
+        color = PyInt_AsLong(colorsObj);
+        if(color == -1 && PyErr_Occurred())
+            return NULL;
+    }
+    if(!intarray_get(xsObj, &xs, 1))
+        return NULL;
+    if(!intarray_get(ysObj, &ys, 1)) {
+        intarray_release(&xs);
+        return NULL;
+    }
+    ok = (PyInt_Check(colorsObj) || PyLong_Check(colorsObj)
+        || intarray_get(colorsObj, &colors, 1));
 
- {"string_ttf",    (PyCFunction)image_string_ttf,1,
-    "string_ttf(font, ptsize, angle, (x,y), s, color)\n"
-    "draw string s at (x,y) using the truetype font"},
+    if(ok && (ys.n != xs.n || (colors.vals && colors.n != xs.n))) {
+        PyErr_SetString(PyExc_ValueError, "xs, ys and colors must be the same length");
+        ok = 0;
+    }
 
- {"string_ft",    (PyCFunction)image_string_ft,1,
-    "string_ft(font, ptsize, angle, (x,y), s, color)\n"
-    "draw string s at (x,y) using the truetype font"},
+    if(ok)
+        ok = intarray_pin(&xs) && intarray_pin(&ys) && intarray_pin(&colors);
+    if(ok && xs.n >= PIXELS_NOGIL)
+        UNLOCKED(self, count = set_pixels(self, xs.vals, ys.vals, colors.vals, color, xs.n));
+    else if(ok)
+        LOCKED(self, count = set_pixels(self, xs.vals, ys.vals, colors.vals, color, xs.n));
+
+    intarray_release(&xs);
+    intarray_release(&ys);
+    intarray_release(&colors);
+    if(!ok)
+        return NULL;
+    return Py_BuildValue("i", count);
+}
 
- {"string",    (PyCFunction)image_string,1,
-    "string(font, (x,y), s, color)\n"
-    "draw string s at (x,y) using one of the pre-defined gdmodule fonts (gdFont*)"},
+static void get_pixels(imageobject *self, const int *xs, const int *ys,
+    int *out, Py_ssize_t n)
+{
+    gdImagePtr im = self->imagedata;
+    Py_ssize_t i;
 
-#ifdef Py_UNICODEOBJECT_H
- {"string16",    (PyCFunction)image_string16,1,
-    "string(font, (x,y), s, color)\n"
-    "draw unicode string s at (x,y) using one of the pre-defined gdmodule fonts (gdFont*)"},
-#endif
+    for(i = 0; i < n; i++)
+        out[i] = gdImageGetPixel(im, X(xs[i]), Y(ys[i]));
+}
 
- {"stringUp",    (PyCFunction)image_stringup,1,
-    "stringUp(font, (x,y), s, color)\n"
-    "vertically draw string s at (x,y) using one of the pre-defined gdmodule\n"
-    "fonts (gdFont*)"},
+static PyObject *image_getpixels(imageobject *self, PyObject *args)
+{
+    static PyObject *arraymod;
+    PyObject *xsObj, *ysObj, *outObj = NULL, *proto;
+    intarray xs, ys;
+    Py_buffer view;
+    void *p;
+    int *out, *tmp = NULL;
+    Py_ssize_t len;
+    int have_view = 0;
+    char *fmt;
+
+    if(!PyArg_ParseTuple(args, "OO|O", &xsObj, &ysObj, &outObj))
+        return NULL;
 
-#ifdef Py_UNICODEOBJECT_H
- {"stringUp16",    (PyCFunction)image_stringup16,1,
-    "stringUp16(font, (x,y), s, color)\n"
-    "vertically draw unicode string s at (x,y) using one of the pre-defined gdmodule\n"
-    "fonts (gdFont*)"},
-#endif
+    if(!intarray_get(xsObj, &xs, 1))
+        return NULL;
+    if(!intarray_get(ysObj, &ys, 1)) {
+        intarray_release(&xs);
+        return NULL;
+    }
+    if(ys.n != xs.n) {
+        PyErr_SetString(PyExc_ValueError, "xs and ys must be the same length");
+        goto fail;
+    }
 
- {"colorAllocate",    (PyCFunction)image_colorallocate,1,
-    "colorAllocate((r,g,b))\n"
-    "allocate a color index to (r,g,b) (returns -1 if unable to)"},
+    if(outObj) {
+        Py_INCREF(outObj);
+    } else {
+        /* array('i', [0]) * n */
+        if(!arraymod && !(arraymod = PyImport_ImportModule("array")))
+            goto fail;
+        if(!(proto = PyObject_CallMethod(arraymod, "array", "s[i]", "i", 0)))
+            goto fail;
+        outObj = PySequence_Repeat(proto, xs.n);
+        Py_DECREF(proto);
+        if(!outObj)
+            goto fail;
+    }
 
- {"colorAllocateAlpha",    (PyCFunction)image_colorallocatealpha,1,
-    "colorAllocateAlpha((r,g,b,a))\n"
-    "allocate a color index to (r,g,b,a) (returns -1 if unable to)"},
+    /* the results go straight into out, which must hold xs.n native ints */
+    if(PyObject_CheckBuffer(outObj)) {
+        if(PyObject_GetBuffer(outObj, &view, PyBUF_WRITABLE | PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0)
+            goto fail_out;
+        have_view = 1;
+        fmt = view.format ? view.format : "B";
+        if(*fmt == '@' || *fmt == '=')
+            fmt++;
+        p = view.buf;
+        len = view.len;
+        if(view.itemsize != sizeof(int) || (strcmp(fmt, "i") != 0 && strcmp(fmt, "I") != 0))
+            len = -1;
+    } else {
+        PyObject *tc = PyObject_GetAttrString(outObj, "typecode");
 
- {"colorClosest",    (PyCFunction)image_colorclosest,    1,
-    "colorClosest((r,g,b))\n"
-    "return the color index closest to (r,g,b) (returns -1 if unable to)"},
+        if(!tc || !PyString_Check(tc) || strcmp(PyString_AS_STRING(tc), "i") != 0
+        || PyObject_AsWriteBuffer(outObj, &p, &len) < 0)
+            len = -1;
+        Py_XDECREF(tc);
+        PyErr_Clear();
+    }
+    if(len != (Py_ssize_t)(xs.n * sizeof(int))) {
+        PyErr_SetString(PyExc_ValueError, "out must be a writable array of len(xs) ints");
+        goto fail_out;
+    }
 
- {"colorClosestAlpha",    (PyCFunction)image_colorclosestalpha,    1,
-    "colorClosestAlpha((r,g,b,a))\n"
-    "return the color index closest to (r,g,b,a) (returns -1 if unable to)"},
+    /* a caller's array.array could be resized while the GIL is let
+     * go of, so its results are copied in afterwards; our own new
+     * array can't be resized by anyone else */
+    out = (int *)p;
+    if(!have_view && PyTuple_GET_SIZE(args) == 3
+    && !(out = tmp = malloc((xs.n ? xs.n : 1) * sizeof(int)))) {
+        PyErr_NoMemory();
+        goto fail_out;
+    }
 
- {"colorClosestHWB",    (PyCFunction)image_colorclosestHWB,    1,
-    "colorClosestHWB((r,g,b))\n"
-    "return the color index closest in hue whiteness and blackness to (r,g,b) (returns -1 if unable to)"},
+    if(intarray_pin(&xs) && intarray_pin(&ys)) {
+        if(xs.n >= PIXELS_NOGIL)
+            UNLOCKED(self, get_pixels(self, xs.vals, ys.vals, out, xs.n));
+        else
+            LOCKED(self, get_pixels(self, xs.vals, ys.vals, out, xs.n));
+    }
 
- {"colorExact",    (PyCFunction)image_colorexact,    1,
-    "colorExact((r,g,b))\n"
-    "return an exact color index match for (r,g,b) (returns -1 if unable to)"},
+    if(tmp && !PyErr_Occurred() && PyObject_AsWriteBuffer(outObj, &p, &len) == 0) {
+        if(len != (Py_ssize_t)(xs.n * sizeof(int)))
+            PyErr_SetString(PyExc_ValueError, "out was resized");
+        else
+            memcpy(p, tmp, len);
+    }
+    free(tmp);
+
+    if(have_view)
+        PyBuffer_Release(&view);
+    intarray_release(&xs);
+    intarray_release(&ys);
+    if(PyErr_Occurred()) {
+        Py_DECREF(outObj);
+        return NULL;
+    }
+    return outObj;
+
+fail_out:
+    if(have_view)
+        PyBuffer_Release(&view);
+    Py_DECREF(outObj);
+fail:
+    intarray_release(&xs);
+    intarray_release(&ys);
+    return NULL;
+}
 
- {"colorResolve", (PyCFunction)image_colorresolve, 1,
-  "colorResolve((r,g,b))\n"
-  "returns the exact color (after possibly allocating) or the closes match."},
 
- {"colorResolveAlpha", (PyCFunction)image_colorresolvealpha, 1,
-  "colorResolve((r,g,b,a))\n"
-  "returns the exact color (after possibly allocating) or the closes match."},
+static PyObject *image_line(imageobject *self, PyObject *args)
+{
+    int sx,sy,ex,ey,color;
 
- {"colorsTotal",    (PyCFunction)image_colorstotal,    1,
-    "colorsTotal()\n"
-    "returns the number of colors currently allocated"},
+    if(!PyArg_ParseTuple(args, "(ii)(ii)i", &sx, &sy, &ex, &ey, &color))
+        return NULL;
+    LOCKED(self, gdImageLine(self->imagedata, X(sx), Y(sy), X(ex), Y(ey), color));
 
- {"colorComponents",    (PyCFunction)image_colorcomponents,    1,
-    "colorComponents(color)\n"
-    "returns a 3-tulple of the (r,g,b) components of color"},
+    Py_INCREF(Py_None);
+    return Py_None;
+}
 
- {"getClip",    (PyCFunction)image_getclip,    1,
-    "getClip()\n"
-    "returns (x1,y1), (x2,y2) of the image clip rectange"},
+/*
+** Point lists for lines() and the polygons: a sequence of (x,y) pairs,
+** or a flat array of x,y ints (an array.array, an N x 2 NumPy array or
+** any other buffer).  Native ints are already laid out as gdPoints, so
+** with no origin or multiplier set they are drawn from in place.
+*/
 
- {"getInterlaced",    (PyCFunction)image_getinterlaced,    1,
-    "getInterlaced()\n"
-    "returns true if the image is interlaced"},
+typedef struct {
+    gdPointPtr pts;
+    int n;
+    intarray flat;
+    gdPoint local[32];          /* saves a malloc for short lists */
+} pointarray;
 
- {"getTransparent",    (PyCFunction)image_gettransparent,    1,
+static void points_release(pointarray *pa)
+{
+    if(pa->pts != pa->local && pa->pts != (gdPointPtr)pa->flat.vals)
+        free(pa->pts);
+    intarray_release(&pa->flat);
+    pa->pts = NULL;
+}
+
+/* make pa safe to draw from without the GIL; see intarray_pin() */
+
+static int points_pin(pointarray *pa)
+{
+    if(pa->pts != (gdPointPtr)pa->flat.vals)
+        return 1;
+    if(!intarray_pin(&pa->flat))
+        return 0;
+    pa->pts = (gdPointPtr)pa->flat.vals;
+    return 1;
+}
+
+static gdPointPtr points_alloc(pointarray *pa, int n)
+{
+    pa->n = n;
+    if(n <= sizeof(pa->local) / sizeof(pa->local[0]))
+        return pa->pts = pa->local;
+    if(!(pa->pts = malloc(n * sizeof(gdPoint))))
+        PyErr_NoMemory();
+    return pa->pts;
+}
+
+/* the points are mapped through self's origin and multiplier; with no
+ * image they are read as they are */
+
+static int points_get(imageobject *self, PyObject *obj, pointarray *pa)
+{
+    PyObject *seq, *pair;
+    long x, y;
+    int i, n;
+
+    memset(pa, 0, sizeof(*pa));
+
+    if(PyObject_CheckBuffer(obj) || PyObject_HasAttrString(obj, "typecode")) {
+        if(!intarray_get(obj, &pa->flat, 2))
+            return 0;
+        if(pa->flat.n % 2 || (pa->flat.have_view && pa->flat.view.ndim == 2
+                              && pa->flat.view.shape[1] != 2)) {
+            PyErr_SetString(PyExc_ValueError, "point arrays must hold x,y pairs");
+            points_release(pa);
+            return 0;
+        }
+        n = pa->flat.n / 2;
+        if(!self || (self->origin_x == 0 && self->origin_y == 0
+        && self->multiplier_x == 1 && self->multiplier_y == 1)) {
+            pa->pts = (gdPointPtr)pa->flat.vals;
+            pa->n = n;
+            return 1;
+        }
+        /* a converted copy is ours to scale; borrowed data isn't */
+        if(pa->flat.owned) {
+            pa->pts = (gdPointPtr)pa->flat.vals;
+            pa->n = n;
+        } else if(!points_alloc(pa, n)) {
+            points_release(pa);
+            return 0;
+        }
+        for(i = 0; i < n; i++) {
+            pa->pts[i].x = X(pa->flat.vals[2 * i]);
+            pa->pts[i].y = Y(pa->flat.vals[2 * i + 1]);
+        }
+        return 1;
+    }
+
+    if(!(seq = PySequence_Fast(obj, "points must be a sequence of (x,y) pairs or an array of ints")))
+        return 0;
+    n = PySequence_Fast_GET_SIZE(seq);
+    if(!points_alloc(pa, n)) {
+        Py_DECREF(seq);
+        return 0;
+    }
+    for(i = 0; i < n; i++) {
+        if(!(pair = PySequence_Fast(PySequence_Fast_GET_ITEM(seq, i), "points must be (x,y) pairs")))
+            goto fail;
+        if(PySequence_Fast_GET_SIZE(pair) != 2) {
+            Py_DECREF(pair);
+            PyErr_SetString(PyExc_TypeError, "points must be (x,y) pairs");
+            goto fail;
+        }
+        x = PyInt_AsLong(PySequence_Fast_GET_ITEM(pair, 0));
+        y = PyInt_AsLong(PySequence_Fast_GET_ITEM(pair, 1));
+        Py_DECREF(pair);
+        if((x == -1 || y == -1) && PyErr_Occurred())
+            goto fail;
+        pa->pts[i].x = self ? X(x) : x;
+        pa->pts[i].y = self ? Y(y) : y;
+    }
+    Py_DECREF(seq);
+    return 1;
+
+fail:
+    Py_DECREF(seq);
+    points_release(pa);
+    return 0;
+}
+
+static void draw_lines(gdImagePtr im, gdPointPtr pts, int n, int color)
+{
+    int i, sx = pts[0].x, sy = pts[0].y;
+
+    for(i = 1; i < n; i++) {
+        gdImageLine(im, sx, sy, pts[i].x, pts[i].y, color);
+        sx = pts[i].x;
+        sy = pts[i].y;
+    }
+}
+
+static void draw_polygon(gdImagePtr im, gdPointPtr pts, int n, int color, int fillcolor)
+{
+    if(fillcolor != -1)
+        gdImageFilledPolygon(im, pts, n, fillcolor);
+    gdImagePolygon(im, pts, n, color);
+}
+
+static PyObject *image_lines(imageobject *self, PyObject *args)
+{
+    int color;
+    PyObject *seq;
+    pointarray pa;
+
+    if(!PyArg_ParseTuple(args, "Oi", &seq, &color))
+        return NULL;
+    if(!points_get(self, seq, &pa))
+        return NULL;
+    if (pa.n<2) {
+      points_release(&pa);
+      PyErr_SetString(PyExc_ValueError,
+                    "lines() requires sequence of len(2) or greater");
+      return NULL;
+    }
+
+    if(!points_pin(&pa)) {
+        points_release(&pa);
+        return NULL;
+    }
+    UNLOCKED(self, draw_lines(self->imagedata, pa.pts, pa.n, color));
+    points_release(&pa);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *image_polygon(imageobject *self, PyObject *args)
+{
+    PyObject *points;
+    pointarray pa;
+    int color, fillcolor = -1;
+
+    if(!PyArg_ParseTuple(args, "Oi|i", &points, &color, &fillcolor))
+        return NULL;
+    if(!points_get(self, points, &pa))
+        return NULL;
+
+    if(!points_pin(&pa)) {
+        points_release(&pa);
+        return NULL;
+    }
+    UNLOCKED(self, draw_polygon(self->imagedata, pa.pts, pa.n, color, fillcolor));
+    points_release(&pa);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *image_rectangle(imageobject *self, PyObject *args)
+{
+    int tx,ty,bx,by,t,color,fillcolor,fill=0;
+
+    if(PyArg_ParseTuple(args, "(ii)(ii)ii", &tx, &ty, &bx, &by, &color, &fillcolor))
+        fill=1;
+    else if(PyErr_Clear(), !PyArg_ParseTuple(args, "(ii)(ii)i", &tx, &ty, &bx, &by, &color))
+        return NULL;
+
+    tx = X(tx); ty = Y(ty);
+    bx = X(bx); by = Y(by);
+
+    if(tx > bx) {
+        t = tx;
+        tx = bx;
+        bx = t;
+    }
+
+    if(ty > by) {
+        t = ty;
+        ty = by;
+        by = t;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    if(fill)
+        gdImageFilledRectangle(self->imagedata, tx, ty, bx, by, fillcolor);
+
+    gdImageRectangle(self->imagedata, tx, ty, bx, by, color);
+    PyThread_release_lock(self->lock);
+    Py_END_ALLOW_THREADS
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *image_filledpolygon(imageobject *self, PyObject *args)
+{
+    PyObject *points;
+    pointarray pa;
+    int color;
+
+    if(!PyArg_ParseTuple(args, "Oi", &points, &color))
+        return NULL;
+    if(!points_get(self, points, &pa))
+        return NULL;
+
+    if(!points_pin(&pa)) {
+        points_release(&pa);
+        return NULL;
+    }
+    UNLOCKED(self, gdImageFilledPolygon(self->imagedata, pa.pts, pa.n, color));
+    points_release(&pa);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *image_filledrectangle(imageobject *self, PyObject *args)
+{
+    int tx,ty,bx,by,t,color;
+
+    if(!PyArg_ParseTuple(args, "(ii)(ii)i", &tx, &ty, &bx, &by, &color))
+        return NULL;
+    tx = X(tx); ty = Y(ty);
+    bx = X(bx); by = Y(by);
+    if(tx > bx) {t=tx;tx=bx;bx=t;}
+    if(ty > by) {t=ty;ty=by;by=t;}
+    UNLOCKED(self, gdImageFilledRectangle(self->imagedata, tx, ty, bx, by, color));
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *image_arc(imageobject *self, PyObject *args)
+{
+    int cx, cy, w, h, s, e, color, i;
+
+    if(!PyArg_ParseTuple(args, "(ii)(ii)iii", &cx, &cy, &w, &h, &s, &e, &color))
+        return NULL;
+    if(e<s) {i=e;e=s;s=i;}
+    LOCKED(self, gdImageArc(self->imagedata, X(cx), Y(cy), W(w), H(h), s, e, color));
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *image_filledarc(imageobject *self, PyObject *args)
+{
+#if GD2_VERS <= 1
+    PyErr_SetString(PyExc_NotImplementedError,
+                    "filledArc() requires gd 2.0 or later");
+    return NULL;
+#else
+    int cx, cy, w, h, s, e, color, i, style;
+
+    if(!PyArg_ParseTuple(args, "(ii)(ii)iiii", &cx, &cy, &w, &h, &s,
+                         &e, &color, &style))
+        return NULL;
+    if(e<s) {i=e;e=s;s=i;}
+    UNLOCKED(self, gdImageFilledArc(self->imagedata, X(cx), Y(cy), W(w), H(h),
+                                    s, e, color, style));
+    Py_INCREF(Py_None);
+    return Py_None;
+#endif
+}
+
+static PyObject *image_filledellipse(imageobject *self, PyObject *args)
+{
+#if GD2_VERS <= 1
+    PyErr_SetString(PyExc_NotImplementedError,
+                    "filledEllipse() requires gd 2.0 or later");
+    return NULL;
+#else
+    int cx, cy, w, h, color;
+
+    if(!PyArg_ParseTuple(args, "(ii)(ii)i", &cx, &cy, &w, &h, &color))
+        return NULL;
+    UNLOCKED(self, gdImageFilledEllipse(self->imagedata, X(cx), Y(cy), W(w), H(h), color));
+    Py_INCREF(Py_None);
+    return Py_None;
+#endif
+}
+
+static PyObject *image_filltoborder(imageobject *self, PyObject *args)
+{
+    int x,y,border,color;
+
+    if(!PyArg_ParseTuple(args, "(ii)ii", &x,&y,&border,&color))
+        return NULL;
+    UNLOCKED(self, gdImageFillToBorder(self->imagedata, X(x),Y(y),border,color));
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *image_fill(imageobject *self, PyObject *args)
+{
+    int x,y,color;
+
+    if(!PyArg_ParseTuple(args, "(ii)i", &x,&y,&color))
+        return NULL;
+    UNLOCKED(self, gdImageFill(self->imagedata, X(x),Y(y),color));
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *image_setbrush(imageobject *self, PyObject *args)
+{
+    imageobject *brush;
+    char *filename, *type; /* dummies */
+
+    if(PyArg_ParseTuple(args, "z|z", &filename, &type))
+        brush = (imageobject *)newimageobject(args);
+    else if(PyErr_Clear(), PyArg_ParseTuple(args, "O!", &Imagetype, &brush))
+        Py_INCREF(brush);
+    else
+        return NULL;
+    if(self->current_brush){
+        Py_DECREF(self->current_brush);
+    }
+    self->current_brush = brush;
+    LOCKED(self, gdImageSetBrush(self->imagedata, brush->imagedata));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *image_setantialiased(imageobject *self, PyObject *args)
+{
+    int c;
+
+    if(!PyArg_ParseTuple(args, "i", &c))
+        return NULL;
+
+    LOCKED(self, gdImageSetAntiAliased(self->imagedata, c));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+
+static PyObject *image_setclip(imageobject *self, PyObject *args)
+{
+    int tx,ty,bx,by,t;
+
+    if(!PyArg_ParseTuple(args, "(ii)(ii)", &tx, &ty, &bx, &by))
+        return NULL;
+
+    tx = X(tx); ty = Y(ty);
+    bx = X(bx); by = Y(by);
+
+    if(tx > bx) {
+        t = tx;
+        tx = bx;
+        bx = t;
+    }
+
+    if(ty > by) {
+        t = ty;
+        ty = by;
+        by = t;
+    }
+
+    LOCKED(self, gdImageSetClip(self->imagedata, tx, ty, bx, by));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *image_settile(imageobject *self, PyObject *args)
+{
+    imageobject *tile;
+    char *filename, *type; /* dummies */
+
+    if(PyArg_ParseTuple(args, "z|z", &filename, &type))
+        tile = (imageobject *)newimageobject(args);
+    else
+        if(PyErr_Clear(), PyArg_ParseTuple(args, "O!", &Imagetype, &tile))
+            Py_INCREF(tile);
+        else
+            return NULL;
+
+    if(self->current_tile) {
+        Py_DECREF(self->current_tile);
+    }
+
+    self->current_tile = tile;
+    LOCKED(self, gdImageSetTile(self->imagedata, tile->imagedata));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *image_setstyle(imageobject *self, PyObject *args)
+{
+    PyObject *style;
+    int size, i, *stylearray;
+
+    if(!PyArg_ParseTuple(args, "O!", &PyTuple_Type, &style)) {
+        PyErr_Clear();
+        if(PyArg_ParseTuple(args, "O!", &PyList_Type, &style))
+            style=PyList_AsTuple(style);
+        else
+            return NULL;
+    }
+
+    size = PyTuple_Size(style);
+
+    stylearray = (int *)calloc(size,sizeof(int));
+
+    for(i=0; i<size; i++)
+        stylearray[i] = PyInt_AS_LONG((PyIntObject *)PyTuple_GET_ITEM(style,i));
+
+    LOCKED(self, gdImageSetStyle(self->imagedata, stylearray, size));
+    free(stylearray);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *image_setthickness(imageobject *self, PyObject *args)
+{
+#if GD2_VERS <= 1
+    PyErr_SetString(PyExc_NotImplementedError,
+                    "setThickness() requires gd 2.0 or later");
+    return NULL;
+#else
+    int t;
+
+    if(!PyArg_ParseTuple(args, "i", &t))
+        return NULL;
+    LOCKED(self, gdImageSetThickness(self->imagedata, t));
+    Py_INCREF(Py_None);
+    return Py_None;
+#endif
+}
+
+static PyObject *image_alphablending(imageobject *self, PyObject *args)
+{
+#if GD2_VERS <= 1
+    PyErr_SetString(PyExc_NotImplementedError,
+                    "alphaBlending() requires gd 2.0 or later");
+    return NULL;
+#else
+    int blending;
+
+    if(!PyArg_ParseTuple(args, "i", &blending))
+        return NULL;
+    LOCKED(self, gdImageAlphaBlending(self->imagedata, blending));
+    Py_INCREF(Py_None);
+    return Py_None;
+#endif
+}
+
+static PyObject *image_alpha(imageobject *self, PyObject *args)
+{
+#if GD2_VERS <= 1
+    PyErr_SetString(PyExc_NotImplementedError,
+                    "alpha() requires gd 2.0 or later");
+    return NULL;
+#else
+    int color;
+
+    if(!PyArg_ParseTuple(args, "i", &color))
+        return NULL;
+    return Py_BuildValue("i", gdImageAlpha(self->imagedata, color));
+#endif
+}
+
+
+static PyObject *image_getpixel(imageobject *self, PyObject *args)
+{
+    int x,y,c;
+
+    if(!PyArg_ParseTuple(args, "(ii)", &x,&y))
+        return NULL;
+    LOCKED(self, c = gdImageGetPixel(self->imagedata, X(x),Y(y)));
+    return Py_BuildValue("i",c);
+}
+
+
+static PyObject *image_boundssafe(imageobject *self, PyObject *args)
+{
+    int x,y,safe;
+
+    if(!PyArg_ParseTuple(args, "(ii)", &x,&y))
+        return NULL;
+    LOCKED(self, safe = gdImageBoundsSafe(self->imagedata, X(x),Y(y)));
+    return Py_BuildValue("i",safe);
+}
+
+
+static PyObject *image_blue(imageobject *self, PyObject *args)
+{
+    int c;
+
+    if(!PyArg_ParseTuple(args, "i", &c))
+        return NULL;
+    return Py_BuildValue("i",gdImageBlue(self->imagedata,c));
+}
+
+
+static PyObject *image_green(imageobject *self, PyObject *args)
+{
+    int c;
+
+    if(!PyArg_ParseTuple(args, "i", &c))
+        return NULL;
+    return Py_BuildValue("i",gdImageGreen(self->imagedata,c));
+}
+
+
+static PyObject *image_red(imageobject *self, PyObject *args)
+{
+    int c;
+
+    if(!PyArg_ParseTuple(args, "i", &c))
+        return NULL;
+    return Py_BuildValue("i",gdImageRed(self->imagedata,c));
+}
+
+
+static PyObject *image_size(imageobject *self)
+{
+    return Py_BuildValue("(ii)",gdImageSX(self->imagedata),gdImageSY(self->imagedata));
+}
+
+
+static PyObject *image_char(imageobject *self, PyObject *args)
+{
+    int x,y,font,color;
+    char c;
+
+    if(!PyArg_ParseTuple(args, "i(ii)ii", &font,&x,&y,&c,&color))
+        return NULL;
+    LOCKED(self, gdImageChar(self->imagedata, fonts[font].func(), X(x), Y(y), c, color));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *image_charup(imageobject *self, PyObject *args)
+{
+    int x,y,font,color;
+    char c;
+
+    if(!PyArg_ParseTuple(args, "i(ii)si", &font,&x,&y,&c,&color))
+        return NULL;
+    LOCKED(self, gdImageCharUp(self->imagedata, fonts[font].func(), X(x), Y(y), c, color));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *image_get_bounding_rect(imageobject *self, PyObject *args)
+{
+#ifndef HAVE_LIBFREETYPE
+    PyErr_SetString(PyExc_NotImplementedError,
+                    "Freetype Support Not Available");
+    return NULL;
+#else
+    double ptsize, angle;
+    char *fontname, *str, *rc;
+    int x, y, brect[8];
+
+    if(!PyArg_ParseTuple(args, "sdd(ii)s",
+        &fontname, &ptsize, &angle, &x, &y, &str))
+            return NULL;
+
+    rc = gdImageStringTTF(NULL, brect, 0,
+        fontname, ptsize, angle, x, y, str);
+
+    if(rc != NULL){
+        PyErr_SetString(PyExc_ValueError, rc);
+        return NULL;
+    }
+
+    return Py_BuildValue("(iiiiiiii)",brect[0],brect[1],brect[2],brect[3],
+                 brect[4],brect[5],brect[6],brect[7]);
+#endif
+}
+
+
+static PyObject *image_string_ft(imageobject *self, PyObject *args)
+{
+#ifndef HAVE_LIBFREETYPE
+    PyErr_SetString(PyExc_NotImplementedError,
+                    "Freetype Support Not Available");
+    return NULL;
+#else
+#if GD2_VERS <= 1
+    PyErr_SetString(PyExc_NotImplementedError,
+                    "string_ft() requires gd 2.0 or later");
+    return NULL;
+#else
+    int x,y,fg;
+    double ptsize,angle;
+    char *fontname,*str,*rc;
+    int brect[8];
+
+    if(!PyArg_ParseTuple(args, "sdd(ii)si",
+        &fontname, &ptsize, &angle, &x,&y,&str,&fg))
+            return NULL;
+    rc = gdImageStringFT(NULL, brect, 0, fontname, ptsize, angle,
+                  0, 0, str); /* calculate the bounding rect */
+    if(rc != NULL){
+      PyErr_SetString(PyExc_ValueError, rc);
+      return NULL;
+    }
+    LOCKED(self, rc = gdImageStringTTF(self->imagedata, brect, fg, fontname,
+            ptsize, angle, x, y, str));
+    if(rc != NULL){
+        PyErr_SetString(PyExc_ValueError, rc);
+        return NULL;
+    }
+
+    return Py_BuildValue("(iiiiiiii)",
+        brect[0], brect[1], brect[2], brect[3],
+        brect[4], brect[5], brect[6], brect[7]);
+#endif
+#endif
+}
+
+
+static PyObject *image_string_ttf(imageobject *self, PyObject *args)
+{
+#ifndef HAVE_LIBFREETYPE
+    PyErr_SetString(PyExc_NotImplementedError,
+                    "Freetype Support Not Available");
+    return NULL;
+#else
+    int x,y,fg;
+    double ptsize,angle;
+    char *fontname,*str,*rc;
+    int brect[8];
+
+    if(!PyArg_ParseTuple(args, "sdd(ii)si",
+        &fontname, &ptsize, &angle, &x,&y,&str,&fg))
+            return NULL;
+    rc = gdImageStringTTF(NULL, brect, 0, fontname, ptsize, angle,
+                  0, 0, str); /* calculate the bounding rect */
+    if(rc != NULL){
+      PyErr_SetString(PyExc_ValueError, rc);
+      return NULL;
+    }
+    LOCKED(self, rc = gdImageStringTTF(self->imagedata, brect, fg, fontname,
+            ptsize, angle, x, y, str));
+    if(rc != NULL){
+        PyErr_SetString(PyExc_ValueError, rc);
+        return NULL;
+    }
+
+    return Py_BuildValue("(iiiiiiii)",
+        brect[0], brect[1], brect[2], brect[3],
+        brect[4], brect[5], brect[6], brect[7]);
+#endif
+}
+
+
+static PyObject *image_string(imageobject *self, PyObject *args)
+{
+    int x, y, font, color;
+    unsigned char *str;
+
+    if(!PyArg_ParseTuple(args, "i(ii)si", &font,&x,&y,&str,&color))
+        return NULL;
+    LOCKED(self, gdImageString(self->imagedata, fonts[font].func(), X(x), Y(y), str, color));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+#ifdef Py_UNICODEOBJECT_H
+static PyObject *image_string16(imageobject *self, PyObject *args)
+{
+    int x,y,font,color;
+    Py_UNICODE *ustr;
+
+    if(!PyArg_ParseTuple(args, "i(ii)ui", &font,&x,&y,&ustr,&color))
+        return NULL;
+    LOCKED(self, gdImageString16(self->imagedata, fonts[font].func(), X(x), Y(y), 
+                    (short unsigned int *)ustr, color));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+#endif
+
+static PyObject *image_stringup(imageobject *self, PyObject *args)
+{
+    int x, y, font, color;
+    unsigned char *str;
+
+    if(!PyArg_ParseTuple(args, "i(ii)si", &font,&x,&y,&str,&color))
+        return NULL;
+    LOCKED(self, gdImageStringUp(self->imagedata, fonts[font].func(), X(x), Y(y), str, color));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+#ifdef Py_UNICODEOBJECT_H
+static PyObject *image_stringup16(imageobject *self, PyObject *args)
+{
+    int x,y,font,color;
+    Py_UNICODE *ustr;
+
+    if(!PyArg_ParseTuple(args, "i(ii)ui", &font,&x,&y,&ustr,&color))
+        return NULL;
+    LOCKED(self, gdImageStringUp16(self->imagedata, fonts[font].func(), X(x), Y(y),
+                      (short unsigned int *)ustr, color));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+#endif
+
+static PyObject *image_colorallocate(imageobject *self, PyObject *args)
+{
+    int r,g,b,c;
+
+    if(!PyArg_ParseTuple(args, "(iii)", &r, &g, &b))
+        return NULL;
+    LOCKED(self, c = gdImageColorAllocate(self->imagedata, r, g, b));
+    return(Py_BuildValue("i",c));
+}
+
+static PyObject *image_colorallocatealpha(imageobject *self, PyObject *args)
+{
+#if GD2_VERS <= 1
+ PyErr_SetString(PyExc_NotImplementedError,
+   "colorAllocateAlpha() requires gd 2.0 or later");
+    return NULL;
+#else
+    int r,g,b,a,c;
+
+    if(!PyArg_ParseTuple(args, "(iiii)", &r, &g, &b, &a))
+        return NULL;
+    LOCKED(self, c = gdImageColorAllocateAlpha(self->imagedata,
+      r, g, b, a));
+    return(Py_BuildValue("i",c));
+#endif
+}
+
+static PyObject *image_colorclosest(imageobject *self, PyObject *args)
+{
+    int r,g,b,c;
+
+    if(!PyArg_ParseTuple(args, "(iii)", &r, &g, &b))
+        return NULL;
+    LOCKED(self, c = gdImageColorClosest(self->imagedata, r, g, b));
+    return(Py_BuildValue("i",c));
+}
+
+static PyObject *image_colorclosestalpha(imageobject *self, PyObject *args)
+{
+#if GD2_VERS <= 1
+ PyErr_SetString(PyExc_NotImplementedError,
+   "colorClosestAlpha() requires gd 2.0 or later");
+    return NULL;
+#else
+    int r,g,b,a,c;
+
+    if(!PyArg_ParseTuple(args, "(iiii)", &r, &g, &b, &a))
+        return NULL;
+    LOCKED(self, c = gdImageColorClosestAlpha(self->imagedata, r, g, b,
+      a));
+    return(Py_BuildValue("i",c));
+#endif
+}
+
+static PyObject *image_colorclosestHWB(imageobject *self, PyObject *args)
+{
+#if GD2_VERS <= 1
+ PyErr_SetString(PyExc_NotImplementedError,
+   "colorClosestHWB() requires gd 2.0 or later");
+    return NULL;
+#else
+    int r,g,b,c;
+
+    if(!PyArg_ParseTuple(args, "(iii)", &r, &g, &b))
+        return NULL;
+    LOCKED(self, c = gdImageColorClosestHWB(self->imagedata, r,
+      g, b));
+    return(Py_BuildValue("i",c));
+#endif
+}
+
+static PyObject *image_colorexact(imageobject *self, PyObject *args)
+{
+    int r,g,b,c;
+
+    if(!PyArg_ParseTuple(args, "(iii)", &r, &g, &b))
+        return NULL;
+    LOCKED(self, c = gdImageColorExact(self->imagedata, r, g, b));
+    return(Py_BuildValue("i",c));
+}
+
+static PyObject *image_colorresolve(imageobject *self, PyObject *args)
+{
+#if GD2_VERS <= 1
+ PyErr_SetString(PyExc_NotImplementedError,
+   "colorResolve() requires gd 2.0 or later");
+    return NULL;
+#else
+    int r,g,b,c;
+
+    if(!PyArg_ParseTuple(args, "(iii)", &r, &g, &b))
+        return NULL;
+    LOCKED(self, c = gdImageColorResolve(self->imagedata, r,
+      g, b));
+    return(Py_BuildValue("i",c));
+#endif
+}
+
+static PyObject *image_colorresolvealpha(imageobject *self, PyObject *args)
+{
+#if GD2_VERS <= 1
+ PyErr_SetString(PyExc_NotImplementedError,
+   "colorResolveAlpha() requires gd 2.0 or later");
+    return NULL;
+#else
+    int r,g,b,a,c;
+
+    if(!PyArg_ParseTuple(args, "(iiii)", &r, &g, &b, &a))
+        return NULL;
+    LOCKED(self, c = gdImageColorResolveAlpha(self->imagedata, r,
+      g, b, a));
+    return(Py_BuildValue("i",c));
+#endif
+}
+
+static PyObject *image_colorstotal(imageobject *self)
+{
+    return Py_BuildValue("i",gdImageColorsTotal(self->imagedata));
+}
+
+
+static PyObject *image_colorcomponents(imageobject *self, PyObject *args)
+{
+    int c,r,g,b;
+
+    if(!PyArg_ParseTuple(args, "i", &c))
+        return NULL;
+    r=gdImageRed(self->imagedata,c);
+    g=gdImageGreen(self->imagedata,c);
+    b=gdImageBlue(self->imagedata,c);
+    return Py_BuildValue("(iii)",r,g,b);
+}
+
+
+static PyObject *image_getclip(imageobject *self)
+{
+    int x1, y1, x2, y2;
+    LOCKED(self, gdImageGetClip(self->imagedata, &x1, &y1, &x2, &y2));
+    return Py_BuildValue("(ii)(ii)", x1, y1, x2, y2);
+}
+
+static PyObject *image_getinterlaced(imageobject *self)
+{
+    return Py_BuildValue("i",gdImageGetInterlaced(self->imagedata));
+}
+
+
+static PyObject *image_gettransparent(imageobject *self)
+{
+    return Py_BuildValue("i",gdImageGetTransparent(self->imagedata));
+}
+
+
+static PyObject *image_colordeallocate(imageobject *self, PyObject *args)
+{
+    int c;
+
+    if(!PyArg_ParseTuple(args, "i", &c))
+        return NULL;
+    LOCKED(self, gdImageColorDeallocate(self->imagedata, c));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *image_colortransparent(imageobject *self, PyObject *args)
+{
+    int c;
+
+    if(!PyArg_ParseTuple(args, "i", &c))
+        return NULL;
+    LOCKED(self, gdImageColorTransparent(self->imagedata, c));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *image_copyto(imageobject *self, PyObject *args)
+{
+    imageobject *dest;
+    int dx,dy,sx,sy,w,h,dw,dh;
+
+    dx=dy=sx=sy=0;
+    w = gdImageSX(self->imagedata);
+    h = gdImageSY(self->imagedata);
+    if(!PyArg_ParseTuple(args, "O!|(ii)(ii)(ii)", &Imagetype, &dest, &dx, &dy, &sx, &sy, &w, &h))
+        return NULL;
+    if(!image_check(dest))
+        return NULL;
+    dw = gdImageSX(dest->imagedata);
+    dh = gdImageSY(dest->imagedata);
+    UNLOCKED2(self, dest, blit_copy(dest->imagedata, self->imagedata, X(dx), Y(dy), X(sx), Y(sy), W(w), H(h)));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *image_copyresizedto(imageobject *self, PyObject *args)
+{
+    imageobject *dest;
+    int dx,dy,sx,sy,dw,dh,sw,sh;
+
+    dx=dy=sx=sy=0;
+    sw = gdImageSX(self->imagedata);
+    sh = gdImageSY(self->imagedata);
+    if(PyArg_ParseTuple(args, "O!|(ii)(ii)", &Imagetype, &dest, &dx, &dy, &sx, &sy))
+    {
+        dw = gdImageSX(dest->imagedata);
+        dh = gdImageSY(dest->imagedata);
+    }
+    else if(PyErr_Clear(), !PyArg_ParseTuple(args, "O!|(ii)(ii)(ii)(ii)", &Imagetype, &dest, &dx, &dy, &sx, &sy, &dw, &dh, &sw, &sh))
+        return NULL;
+    if(!image_check(dest))
+        return NULL;
+    UNLOCKED2(self, dest, gdImageCopyResized(dest->imagedata, self->imagedata, X(dx), Y(dy), X(sx), Y(sy), W(dw), H(dh), W(sw), H(sh)));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *image_copyresampledto(imageobject *self, PyObject *args, PyObject *kwds)
+{
+#if GD2_VERS <= 1
+ PyErr_SetString(PyExc_NotImplementedError,
+   "copyResampledTo() requires gd 2.0 or later");
+    return NULL;
+#else
+    static char *kwlist[] = {"filter", NULL};
+    imageobject *dest;
+    PyObject *empty;
+    char *filterName = NULL;
+    int dx,dy,sx,sy,dw,dh,sw,sh,filter,ok;
+
+    if(kwds && PyDict_Size(kwds) > 0) {
+        if(!(empty = PyTuple_New(0)))
+            return NULL;
+        ok = PyArg_ParseTupleAndKeywords(empty, kwds, "|z", kwlist, &filterName);
+        Py_DECREF(empty);
+        if(!ok)
+            return NULL;
+    }
+
+    dx=dy=sx=sy=0;
+    sw = gdImageSX(self->imagedata);
+    sh = gdImageSY(self->imagedata);
+    if(PyArg_ParseTuple(args, "O!|(ii)(ii)", &Imagetype, &dest, &dx, &dy,
+      &sx, &sy))
+    {
+        dw = gdImageSX(dest->imagedata);
+        dh = gdImageSY(dest->imagedata);
+    }
+    else if(PyErr_Clear(), !PyArg_ParseTuple(args, "O!|(ii)(ii)(ii)(ii)",
+      &Imagetype, &dest, &dx, &dy, &sx, &sy, &dw, &dh, &sw, &sh))
+        return NULL;
+    if(!image_check(dest))
+        return NULL;
+
+    if(!filterName) {
+        UNLOCKED2(self, dest, resample_copy(dest->imagedata, self->imagedata,
+          X(dx), Y(dy), X(sx), Y(sy), W(dw), H(dh), W(sw), H(sh)));
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    for(filter = 0; rs_filters[filter]; filter++)
+        if(strcmp(filterName, rs_filters[filter]) == 0)
+            break;
+    if(!rs_filters[filter]) {
+        PyErr_Format(PyExc_ValueError, "unknown filter '%.100s'", filterName);
+        return NULL;
+    }
+    if(!gdImageTrueColor(self->imagedata) || !gdImageTrueColor(dest->imagedata)) {
+        PyErr_SetString(PyExc_ValueError, "filters need truecolor images");
+        return NULL;
+    }
+    if(dest == self) {
+        PyErr_SetString(PyExc_ValueError, "can't resample an image onto itself");
+        return NULL;
+    }
+    if(W(dw) <= 0 || H(dh) <= 0 || W(sw) <= 0 || H(sh) <= 0
+    || X(sx) < 0 || Y(sy) < 0 || X(sx) + W(sw) > gdImageSX(self->imagedata)
+    || Y(sy) + H(sh) > gdImageSY(self->imagedata)) {
+        PyErr_SetString(PyExc_ValueError, "source rectangle must be inside the image, and sizes positive");
+        return NULL;
+    }
+
+    UNLOCKED2(self, dest, ok = resample_filtered(dest->imagedata, self->imagedata,
+      X(dx), Y(dy), X(sx), Y(sy), W(dw), H(dh), W(sw), H(sh), filter));
+    if(!ok)
+        return PyErr_NoMemory();
+
+    Py_INCREF(Py_None);
+    return Py_None;
+#endif
+}
+
+static PyObject *image_copymergeto(imageobject *self, PyObject *args)
+{
+#if GD2_VERS <= 1
+ PyErr_SetString(PyExc_NotImplementedError,
+   "copyMergeTo() requires gd 2.0 or later");
+    return NULL;
+#else
+    imageobject *dest;
+    int dx,dy,sx,sy,w,h,dw,dh,pct;
+
+    dx=dy=sx=sy=0;
+    w = gdImageSX(self->imagedata);
+    h = gdImageSY(self->imagedata);
+    pct = 100;
+    if(!PyArg_ParseTuple(args, "O!|(ii)(ii)(ii)i", &Imagetype, &dest, &dx, &dy, &sx, &sy, &w, &h, &pct))
+        return NULL;
+    if(!image_check(dest))
+        return NULL;
+    dw = gdImageSX(dest->imagedata);
+    dh = gdImageSY(dest->imagedata);
+    UNLOCKED2(self, dest, blit_merge(dest->imagedata, self->imagedata, X(dx), Y(dy), X(sx), Y(sy), W(w), H(h), pct, 0));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+#endif
+}
+
+static PyObject *image_copymergegrayto(imageobject *self, PyObject *args)
+{
+#if GD2_VERS <= 1
+ PyErr_SetString(PyExc_NotImplementedError,
+   "copyMergeGrayTo() requires gd 2.0 or later");
+    return NULL;
+#else
+    imageobject *dest;
+    int dx,dy,sx,sy,w,h,dw,dh,pct;
+
+    dx=dy=sx=sy=0;
+    w = gdImageSX(self->imagedata);
+    h = gdImageSY(self->imagedata);
+    pct = 100;
+    if(!PyArg_ParseTuple(args, "O!|(ii)(ii)(ii)i", &Imagetype, &dest, &dx, &dy, &sx, &sy, &w, &h, &pct))
+        return NULL;
+    if(!image_check(dest))
+        return NULL;
+    dw = gdImageSX(dest->imagedata);
+    dh = gdImageSY(dest->imagedata);
+    UNLOCKED2(self, dest, blit_merge(dest->imagedata, self->imagedata, X(dx), Y(dy), X(sx), Y(sy), W(w), H(h), pct, 1));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+#endif
+}
+
+static PyObject *image_topalette(imageobject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"colors", "dither", "method", NULL};
+    imageobject *rv;
+    gdImagePtr im;
+    char *method = "octree";
+    int colors = 256, dither = 0, kmeans;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "|iis", kwlist, &colors, &dither, &method))
+        return NULL;
+    if(colors < 2 || colors > 256) {
+        PyErr_SetString(PyExc_ValueError, "colors must be from 2 to 256");
+        return NULL;
+    }
+    if(strcmp(method, "octree") == 0)
+        kmeans = 0;
+    else if(strcmp(method, "kmeans") == 0)
+        kmeans = 1;
+    else {
+        PyErr_SetString(PyExc_ValueError, "method must be octree or kmeans");
+        return NULL;
+    }
+
+    UNLOCKED(self, im = quantize(self->imagedata, colors, dither, kmeans));
+    if(!im)
+        return PyErr_NoMemory();
+    if(!(rv = allocimageobject())) {
+        gdImageDestroy(im);
+        return NULL;
+    }
+    rv->imagedata = im;
+    return (PyObject *)rv;
+}
+
+static PyObject *image_copypaletteto(imageobject *self, PyObject *args)
+{
+#if GD2_VERS <= 1
+ PyErr_SetString(PyExc_NotImplementedError,
+   "copyPaletteTo() requires gd 2.0 or later");
+    return NULL;
+#else
+    imageobject *dest;
+    if(!PyArg_ParseTuple(args, "O!", &Imagetype, &dest) || !image_check(dest))
+        return NULL;
+
+    UNLOCKED2(self, dest, gdImagePaletteCopy(dest->imagedata,  self->imagedata));
+    Py_INCREF(Py_None);
+    return Py_None;
+#endif
+}
+
+static PyObject *image_compare(imageobject *self, PyObject *args)
+{
+#if GD2_VERS <= 1
+ PyErr_SetString(PyExc_NotImplementedError,
+   "compare() requires gd 2.0 or later");
+    return NULL;
+#else
+    imageobject *dest;
+    int cmp;
+
+    if(!PyArg_ParseTuple(args, "O!", &Imagetype, &dest) || !image_check(dest))
+        return NULL;
+
+    UNLOCKED2(self, dest, cmp = gdImageCompare(dest->imagedata,
+      self->imagedata));
+    return Py_BuildValue("i", cmp);
+#endif
+}
+
+static PyObject *image_interlace(imageobject *self, PyObject *args)
+{
+    int i;
+
+    if(!PyArg_ParseTuple(args, "i", &i))
+        return NULL;
+    LOCKED(self, gdImageInterlace(self->imagedata, i));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *image_savealpha(imageobject *self, PyObject *args)
+{
+    int i;
+
+    if(!PyArg_ParseTuple(args, "i", &i))
+        return NULL;
+    LOCKED(self, gdImageSaveAlpha(self->imagedata, i));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *image_origin(imageobject *self, PyObject *args)
+{
+    if(!PyArg_ParseTuple(args, "(ii)|ii",&self->origin_x,&self->origin_y,
+        &self->multiplier_x,&self->multiplier_y))
+        return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *image_getorigin(imageobject *self)
+{
+    return Py_BuildValue("((ii)ii)",self->origin_x,self->origin_y,self->multiplier_x,self->multiplier_y);
+}
+
+
+/*
+** Pixel export.  gd keeps each row of an image in its own allocation,
+** so only single rows can be handed out in place (row()); the image as
+** a whole is exported through the buffer interface in place when its
+** rows happen to be laid end to end, and otherwise as a read-only copy.
+** Truecolor pixels are native unsigned ints holding gd's 0xAARRGGBB
+** (alpha 0 opaque to 127 transparent); palette pixels are bytes.
+*/
+
+static int image_pixelsize(gdImagePtr im)
+{
+    return im->trueColor ? sizeof(int) : 1;
+}
+
+static void *image_row(gdImagePtr im, int y)
+{
+    return im->trueColor ? (void *)im->tpixels[y] : (void *)im->pixels[y];
+}
+
+static int rows_adjacent(gdImagePtr im)
+{
+    char *first = (char *)image_row(im, 0);
+    size_t rowsize = (size_t)im->sx * image_pixelsize(im);
+    int y;
+
+    for(y = 1; y < im->sy; y++)
+        if((char *)image_row(im, y) != first + y * rowsize)
+            return 0;
+    return 1;
+}
+
+/* all the rows, end to end, at dst */
+
+static void copy_pixels(gdImagePtr im, char *dst)
+{
+    size_t rowsize = (size_t)im->sx * image_pixelsize(im);
+    int y;
+
+    for(y = 0; y < im->sy; y++)
+        memcpy(dst + y * rowsize, image_row(im, y), rowsize);
+}
+
+/* an exported buffer's view->obj, which the buffer actually comes from:
+ * it owns the shape and strides, and the copy of the pixels if one was
+ * needed, and keeps the image alive.  (python 2.7's memoryview copies
+ * a view's internals into the views it passes on, and asks view->obj
+ * for them, so nothing can be freed through bf_releasebuffer.) */
+
+typedef struct {
+    PyObject_VAR_HEAD
+    PyObject *image;
+    void *buf;
+    int readonly, psize, ndim;
+    char *format;
+    Py_ssize_t shape[2], strides[2];
+    double data[1];             /* the copy, when needed */
+} exportobject;
+
+static int export_getbuffer(exportobject *self, Py_buffer *view, int flags)
+{
+    view->obj = NULL;
+    if(self->readonly && (flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError,
+            "image rows are not contiguous, only a read-only copy can be exported");
+        return -1;
+    }
+
+    view->obj = (PyObject *)self;
+    Py_INCREF(self);
+    view->buf = self->buf;
+    view->len = self->shape[0] * self->strides[0];
+    view->readonly = self->readonly;
+    view->itemsize = (flags & (PyBUF_FORMAT | PyBUF_ND)) ? self->psize : 1;
+    view->format = (flags & PyBUF_FORMAT) ? self->format : NULL;
+    view->ndim = (flags & PyBUF_ND) ? self->ndim : 1;
+    view->shape = (flags & PyBUF_ND) ? self->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static void export_dealloc(exportobject *self)
+{
+    Py_XDECREF(self->image);
+    PyObject_DEL(self);
+}
+
+static PyBufferProcs export_as_buffer = {
+    0, 0, 0, 0,                         /* old style buffer interface */
+    (getbufferproc)export_getbuffer,
+    0,
+};
+
+static PyTypeObject Exporttype = {
+    PyObject_HEAD_INIT(NULL)
+    0,                                  /*ob_size*/
+    "pixelexport",                      /*tp_name*/
+    offsetof(exportobject, data),       /*tp_basicsize*/
+    1,                                  /*tp_itemsize*/
+    /* methods */
+    (destructor)export_dealloc,         /*tp_dealloc*/
+    0,                                  /*tp_print*/
+    0,                                  /*tp_getattr*/
+    0,                                  /*tp_setattr*/
+    0,                                  /*tp_compare*/
+    0,                                  /*tp_repr*/
+    0,                                  /*tp_as_number*/
+    0,                                  /*tp_as_sequence*/
+    0,                                  /*tp_as_mapping*/
+    0,                                  /*tp_hash*/
+    0,                                  /*tp_call */
+    0,                                  /*tp_str */
+    0,                                  /*tp_getattro */
+    0,                                  /*tp_setattro */
+    &export_as_buffer,                  /*tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags */
+};
+
+static int image_getbuffer(imageobject *self, Py_buffer *view, int flags)
+{
+    gdImagePtr im = self->imagedata;
+    int psize = image_pixelsize(im), inplace = rows_adjacent(im), rv;
+    Py_ssize_t len = (Py_ssize_t)im->sx * im->sy * psize;
+    exportobject *ex;
+
+    view->obj = NULL;
+    if(!image_check(self))
+        return -1;
+    if(!inplace && (flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError,
+            "image rows are not contiguous, only a read-only copy can be exported");
+        return -1;
+    }
+
+    if(!(ex = PyObject_NEW_VAR(exportobject, &Exporttype, inplace ? 0 : len)))
+        return -1;
+    ex->image = (PyObject *)self;
+    Py_INCREF(self);
+    ex->readonly = !inplace;
+    ex->psize = psize;
+    ex->ndim = 2;
+    ex->format = im->trueColor ? "I" : "B";
+    ex->shape[0] = im->sy;
+    ex->shape[1] = im->sx;
+    ex->strides[0] = (Py_ssize_t)im->sx * psize;
+    ex->strides[1] = psize;
+
+    if(inplace) {
+        ex->buf = image_row(im, 0);
+    } else {
+        image_lock(self);
+        copy_pixels(im, (char *)ex->data);
+        image_unlock(self);
+        ex->buf = ex->data;
+    }
+
+    rv = export_getbuffer(ex, view, flags);
+    Py_DECREF(ex);
+    return rv;
+}
+
+static PyBufferProcs image_as_buffer = {
+    0, 0, 0, 0,                         /* old style buffer interface */
+    (getbufferproc)image_getbuffer,
+    0,
+};
+
+/* the NumPy array interface, version 3.  rows laid end to end are
+ * shared, otherwise the array gets a copy of the pixels. */
+
+static PyObject *image_array_interface(imageobject *self)
+{
+    gdImagePtr im = self->imagedata;
+    PyObject *data;
+    char *typestr;
+
+    if(rows_adjacent(im)) {
+        data = Py_BuildValue("(NO)", PyLong_FromVoidPtr(image_row(im, 0)), Py_False);
+    } else {
+        data = PyByteArray_FromStringAndSize(NULL,
+            (Py_ssize_t)im->sx * im->sy * image_pixelsize(im));
+        if(data) {
+            image_lock(self);
+            copy_pixels(im, PyByteArray_AS_STRING(data));
+            image_unlock(self);
+        }
+    }
+    if(!data)
+        return NULL;
+
+#ifdef WORDS_BIGENDIAN
+    typestr = im->trueColor ? ">u4" : "|u1";
+#else
+    typestr = im->trueColor ? "<u4" : "|u1";
+#endif
+    return Py_BuildValue("{s:(ii),s:s,s:N,s:i}", "shape", im->sy, im->sx,
+        "typestr", typestr, "data", data, "version", 3);
+}
+
+/* a row is exported through an exportobject of its own, so that views
+ * taken from the memoryview (slices, say) get the row back and not the
+ * whole image */
+
+static PyObject *image_getrow(imageobject *self, PyObject *args)
+{
+    gdImagePtr im = self->imagedata;
+    exportobject *ex;
+    Py_buffer view;
+    int y, rv;
+
+    if(!PyArg_ParseTuple(args, "i", &y))
+        return NULL;
+    if(y < 0 || y >= gdImageSY(im)) {
+        PyErr_SetString(PyExc_IndexError, "row out of range");
+        return NULL;
+    }
+
+    if(!(ex = PyObject_NEW_VAR(exportobject, &Exporttype, 0)))
+        return NULL;
+    ex->image = (PyObject *)self;
+    Py_INCREF(self);
+    ex->readonly = 0;
+    ex->psize = image_pixelsize(im);
+    ex->ndim = 1;
+    ex->format = im->trueColor ? "I" : "B";
+    ex->shape[0] = im->sx;
+    ex->strides[0] = ex->psize;
+    ex->shape[1] = ex->strides[1] = 0;
+    ex->buf = image_row(im, y);
+
+    rv = export_getbuffer(ex, &view, PyBUF_FULL);
+    Py_DECREF(ex);
+    if(rv < 0)
+        return NULL;
+    return PyMemoryView_FromBuffer(&view);
+}
+
+/*
+** Display lists.  A DisplayList records drawing calls as a flat array of
+** ints, each an opcode followed by its operands, with strings kept to one
+** side and copied images kept as private snapshots.  replay() then runs
+** the whole list onto an image in one call without the GIL, mapping
+** every coordinate through an offset and scale, and then through the
+** image's own origin and multiplier.
+*/
+
+enum {
+    DL_LINE = 1,            /* x1 y1 x2 y2 color */
+    DL_LINES,               /* n color x1 y1 ... xn yn */
+    DL_RECTANGLE,           /* x1 y1 x2 y2 color */
+    DL_FILLEDRECTANGLE,     /* x1 y1 x2 y2 color */
+    DL_POLYGON,             /* n color x1 y1 ... xn yn */
+    DL_FILLEDPOLYGON,       /* n color x1 y1 ... xn yn */
+    DL_ARC,                 /* cx cy w h s e color */
+    DL_FILLEDARC,           /* cx cy w h s e color style */
+    DL_FILLEDELLIPSE,       /* cx cy w h color */
+    DL_SETPIXEL,            /* x y color */
+    DL_STRING,              /* font x y text color */
+    DL_STRINGUP,            /* font x y text color */
+    DL_STRINGFT,            /* fontname text x y color ptsize angle */
+    DL_COPY,                /* image x y */
+    DL_ELLIPSE,             /* cx cy w h color */
+    DL_NOPS
+};
+
+#define DL_DOUBLE ((int)(sizeof(double) / sizeof(int)))  /* ints per double */
+#define NFONTS ((int)(sizeof(fonts) / sizeof(fonts[0])) - 1)
+
+typedef struct {
+    int *ops;
+    int nops, maxops;
+    char *text;                 /* strings, nul terminated */
+    int ntext, maxtext;
+    gdImagePtr *images;         /* snapshots for DL_COPY */
+    int nimages, maximages;
+    int maxpoints;              /* longest point list */
+    int ft;                     /* has DL_STRINGFT */
+} dlbuf;
+
+typedef struct {
+    PyObject_HEAD
+    dlbuf buf;
+    int replaying;              /* replays in progress */
+} displaylistobject;
+
+staticforward PyTypeObject DisplayListtype;
+
+static void dl_free(dlbuf *b)
+{
+    int i;
+
+    for(i = 0; i < b->nimages; i++)
+        gdImageDestroy(b->images[i]);
+    free(b->ops);
+    free(b->text);
+    free(b->images);
+    memset(b, 0, sizeof(*b));
+}
+
+/* make room for n more ints, and return where they go */
+
+static int *dl_grow(dlbuf *b, int n)
+{
+    int *p, max;
+
+    if(n > INT_MAX / 2 - b->nops) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    if(b->nops + n > b->maxops) {
+        max = MAX(b->maxops * 2, b->nops + n + 64);
+        if(!(p = realloc(b->ops, max * sizeof(int)))) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        b->ops = p;
+        b->maxops = max;
+    }
+    p = b->ops + b->nops;
+    b->nops += n;
+    return p;
+}
+
+static int dl_put(dlbuf *b, int n, ...)
+{
+    va_list va;
+    int *p, i;
+
+    if(!(p = dl_grow(b, n)))
+        return 0;
+    va_start(va, n);
+    for(i = 0; i < n; i++)
+        p[i] = va_arg(va, int);
+    va_end(va);
+    return 1;
+}
+
+/* copy str into the text area; returns its offset, or -1 */
+
+static int dl_text(dlbuf *b, const char *str)
+{
+    int len = strlen(str) + 1, max;
+    char *p;
+
+    if(b->ntext + len > b->maxtext) {
+        max = MAX(b->maxtext * 2, b->ntext + len + 256);
+        if(!(p = realloc(b->text, max))) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        b->text = p;
+        b->maxtext = max;
+    }
+    memcpy(b->text + b->ntext, str, len);
+    b->ntext += len;
+    return b->ntext - len;
+}
+
+static int dl_points(dlbuf *b, int op, int color, pointarray *pa)
+{
+    int *p;
+
+    if(!(p = dl_grow(b, 3 + 2 * pa->n)))
+        return 0;
+    p[0] = op;
+    p[1] = pa->n;
+    p[2] = color;
+    memcpy(p + 3, pa->pts, pa->n * sizeof(gdPoint));
+    b->maxpoints = MAX(b->maxpoints, pa->n);
+    return 1;
+}
+
+/* append the call op with args, which are parsed as by the image method
+ * of the same name.  returns 0 with an exception set on failure */
+
+static int dl_record(dlbuf *b, int op, PyObject *args)
+{
+    int x1, y1, x2, y2, color, fill = -1, s, e, style, font, ok, t;
+    int *p, fontoff, stroff;
+    double ptsize, angle;
+    char *str, *fontname;
+    PyObject *points;
+    imageobject *src;
+    gdImagePtr snap, *images;
+    pointarray pa;
+
+    switch(op) {
+    case DL_LINE:
+    case DL_RECTANGLE:
+    case DL_FILLEDRECTANGLE:
+        if(!PyArg_ParseTuple(args, op == DL_RECTANGLE ? "(ii)(ii)i|i" : "(ii)(ii)i",
+                &x1, &y1, &x2, &y2, &color, &fill))
+            return 0;
+        /* rectangle(p1, p2, color, fillcolor) fills and then outlines */
+        if(op == DL_RECTANGLE && PyTuple_GET_SIZE(args) > 3
+        && !dl_put(b, 6, DL_FILLEDRECTANGLE, x1, y1, x2, y2, fill))
+            return 0;
+        return dl_put(b, 6, op, x1, y1, x2, y2, color);
+
+    case DL_LINES:
+    case DL_POLYGON:
+    case DL_FILLEDPOLYGON:
+        if(!PyArg_ParseTuple(args, op == DL_POLYGON ? "Oi|i" : "Oi", &points, &color, &fill))
+            return 0;
+        if(!points_get(NULL, points, &pa))
+            return 0;
+        if(op == DL_LINES && pa.n < 2) {
+            points_release(&pa);
+            PyErr_SetString(PyExc_ValueError,
+                            "lines() requires sequence of len(2) or greater");
+            return 0;
+        }
+        ok = (fill == -1 || dl_points(b, DL_FILLEDPOLYGON, fill, &pa))
+            && dl_points(b, op, color, &pa);
+        points_release(&pa);
+        return ok;
+
+    case DL_ARC:
+    case DL_FILLEDARC:
+        if(!PyArg_ParseTuple(args, op == DL_ARC ? "(ii)(ii)iii" : "(ii)(ii)iiii",
+                &x1, &y1, &x2, &y2, &s, &e, &color, &style))
+            return 0;
+#if GD2_VERS <= 1
+        if(op == DL_FILLEDARC) {
+            PyErr_SetString(PyExc_NotImplementedError,
+                            "filledArc() requires gd 2.0 or later");
+            return 0;
+        }
+#endif
+        if(e<s) {t=e;e=s;s=t;}
+        if(op == DL_ARC)
+            return dl_put(b, 8, op, x1, y1, x2, y2, s, e, color);
+        return dl_put(b, 9, op, x1, y1, x2, y2, s, e, color, style);
+
+    case DL_ELLIPSE:
+    case DL_FILLEDELLIPSE:
+        if(!PyArg_ParseTuple(args, "(ii)(ii)i", &x1, &y1, &x2, &y2, &color))
+            return 0;
+        return dl_put(b, 6, op, x1, y1, x2, y2, color);
+
+    case DL_SETPIXEL:
+        if(!PyArg_ParseTuple(args, "(ii)i", &x1, &y1, &color))
+            return 0;
+        return dl_put(b, 4, op, x1, y1, color);
+
+    case DL_STRING:
+    case DL_STRINGUP:
+        if(!PyArg_ParseTuple(args, "i(ii)si", &font, &x1, &y1, &str, &color))
+            return 0;
+        if(font < 0 || font >= NFONTS) {
+            PyErr_SetString(PyExc_ValueError, "invalid font");
+            return 0;
+        }
+        if((stroff = dl_text(b, str)) < 0)
+            return 0;
+        return dl_put(b, 6, op, font, x1, y1, stroff, color);
+
+    case DL_STRINGFT:
+#if !defined(HAVE_LIBFREETYPE) || GD2_VERS <= 1
+        PyErr_SetString(PyExc_NotImplementedError,
+                        "Freetype Support Not Available");
+        return 0;
+#else
+    {
+        int brect[8];
+        char *rc;
+
+        if(!PyArg_ParseTuple(args, "sdd(ii)si",
+                &fontname, &ptsize, &angle, &x1, &y1, &str, &color))
+            return 0;
+        /* find out now if the font can't be loaded */
+        rc = gdImageStringFT(NULL, brect, 0, fontname, ptsize, angle, 0, 0, str);
+        if(rc != NULL) {
+            PyErr_SetString(PyExc_ValueError, rc);
+            return 0;
+        }
+        if((fontoff = dl_text(b, fontname)) < 0 || (stroff = dl_text(b, str)) < 0)
+            return 0;
+        if(!(p = dl_grow(b, 6 + 2 * DL_DOUBLE)))
+            return 0;
+        p[0] = op;
+        p[1] = fontoff;
+        p[2] = stroff;
+        p[3] = x1;
+        p[4] = y1;
+        p[5] = color;
+        memcpy(p + 6, &ptsize, sizeof(double));
+        memcpy(p + 6 + DL_DOUBLE, &angle, sizeof(double));
+        b->ft = 1;
+        return 1;
+    }
+#endif
+
+    case DL_COPY:
+        if(!PyArg_ParseTuple(args, "O!(ii)|(ii)(ii)", &Imagetype, &src,
+                &x1, &y1, &s, &e, &x2, &y2))
+            return 0;
+        if(!image_check(src))
+            return 0;
+        if(PyTuple_GET_SIZE(args) < 3)
+            s = e = 0;
+        if(PyTuple_GET_SIZE(args) < 4) {
+            x2 = gdImageSX(src->imagedata) - s;
+            y2 = gdImageSY(src->imagedata) - e;
+        }
+        /* only the part of the rectangle inside the source is kept */
+        if(s < 0) { x2 += s; x1 -= s; s = 0; }
+        if(e < 0) { y2 += e; y1 -= e; e = 0; }
+        x2 = MIN(x2, gdImageSX(src->imagedata) - s);
+        y2 = MIN(y2, gdImageSY(src->imagedata) - e);
+        if(x2 <= 0 || y2 <= 0)
+            return 1;
+
+        if(b->nimages == b->maximages) {
+            t = MAX(b->maximages * 2, 8);
+            if(!(images = realloc(b->images, t * sizeof(gdImagePtr)))) {
+                PyErr_NoMemory();
+                return 0;
+            }
+            b->images = images;
+            b->maximages = t;
+        }
+        LOCKED(src, snap = crop_image(src->imagedata, s, e, x2, y2));
+        if(!snap) {
+            PyErr_NoMemory();
+            return 0;
+        }
+        b->images[b->nimages++] = snap;
+        return dl_put(b, 4, op, b->nimages - 1, x1, y1);
+    }
+
+    PyErr_SetString(PyExc_ValueError, "unknown drawing command");
+    return 0;
+}
+
+static int dl_scale(int v, double scale)
+{
+    double d = v * scale;
+
+    if(scale == 1.0)
+        return v;
+    return (int)(d < 0 ? d - 0.5 : d + 0.5);
+}
+
+/*
+** Band rendering.  The image is cut into horizontal bands, and each
+** band replays the whole list on its own thread, skipping commands whose
+** bounding box misses it.  Every band draws through two private copies
+** of the gdImage struct, sharing the image's pixels: for fills, one whose
+** clip rectangle is cut down to the band; for lines and everything else,
+** one with the image's own clip, but with the rows outside the band
+** pointed at a scratch row, since gd clips line end points to the clip
+** rectangle and so could pick slightly different pixels.  Either way a
+** band only changes its own rows, in the same order as a serial replay,
+** so the result is identical.  That needs drawing to have no side
+** effects on the image, which rules out the special colors (styles keep
+** their place in the image) and, on palette images, copies and freetype
+** text (they allocate colors).
+*/
+
+#define BAND_MIN 32             /* rows */
+
+typedef struct {
+    gdImagePtr fill, stroke;
+    int y0, y1;
+} dl_band;
+
+/* draw the list b onto self, or just band of it; called without the GIL,
+ * with self locked.  returns NULL, or a message if something couldn't be
+ * drawn */
+
+static char *dl_run(imageobject *self, dlbuf *b, int ox, int oy, double scale, dl_band *band)
+{
+#define DX(v) X(dl_scale(v, scale) + ox)
+#define DY(v) Y(dl_scale(v, scale) + oy)
+#define DW(v) W(dl_scale(v, scale))
+#define DH(v) H(dl_scale(v, scale))
+#define SEES(ya, yb) (!band || (MAX(ya, yb) + pad >= band->y0 && MIN(ya, yb) - pad <= band->y1))
+
+    gdImagePtr src;
+    gdImagePtr fill = band ? band->fill : self->imagedata;
+    gdImagePtr stroke = band ? band->stroke : self->imagedata;
+    /* gd fills polygons with lines, which spill over the band's edge
+     * when they are thick */
+    gdImagePtr fillpoly = self->imagedata->thick > 1 ? stroke : fill;
+    gdPointPtr pts = NULL;
+    int *p = b->ops, *end = b->ops + b->nops;
+    int i, n, x1, y1, x2, y2, t, pad = self->imagedata->thick + 1;
+    char *err = NULL;
+    gdFontPtr font;
+
+    if(b->maxpoints && !(pts = malloc(b->maxpoints * sizeof(gdPoint))))
+        return "out of memory";
+
+    while(p < end && !err) {
+        switch(*p) {
+        case DL_LINE:
+            y1 = DY(p[2]);
+            y2 = DY(p[4]);
+            if(SEES(y1, y2))
+                gdImageLine(stroke, DX(p[1]), y1, DX(p[3]), y2, p[5]);
+            p += 6;
+            break;
+
+        case DL_LINES:
+        case DL_POLYGON:
+        case DL_FILLEDPOLYGON:
+            n = p[1];
+            y1 = INT_MAX;
+            y2 = INT_MIN;
+            for(i = 0; i < n; i++) {
+                pts[i].x = DX(p[3 + 2 * i]);
+                pts[i].y = DY(p[4 + 2 * i]);
+                y1 = MIN(y1, pts[i].y);
+                y2 = MAX(y2, pts[i].y);
+            }
+            if(n && SEES(y1, y2)) {
+                if(*p == DL_LINES)
+                    draw_lines(stroke, pts, n, p[2]);
+                else if(*p == DL_POLYGON)
+                    gdImagePolygon(stroke, pts, n, p[2]);
+                else
+                    gdImageFilledPolygon(fillpoly, pts, n, p[2]);
+            }
+            p += 3 + 2 * n;
+            break;
+
+        case DL_RECTANGLE:
+        case DL_FILLEDRECTANGLE:
+            x1 = DX(p[1]); y1 = DY(p[2]);
+            x2 = DX(p[3]); y2 = DY(p[4]);
+            if(x1 > x2) {t=x1;x1=x2;x2=t;}
+            if(y1 > y2) {t=y1;y1=y2;y2=t;}
+            if(!SEES(y1, y2))
+                ;
+            else if(*p == DL_RECTANGLE)
+                gdImageRectangle(stroke, x1, y1, x2, y2, p[5]);
+            else
+                gdImageFilledRectangle(fill, x1, y1, x2, y2, p[5]);
+            p += 6;
+            break;
+
+        case DL_ARC:
+        case DL_FILLEDARC:
+        case DL_ELLIPSE:
+        case DL_FILLEDELLIPSE:
+            y1 = DY(p[2]);
+            t = abs(DH(p[4])) / 2 + 1;
+            if(!SEES(y1 - t, y1 + t))
+                ;
+            else if(*p == DL_ARC)
+                gdImageArc(stroke, DX(p[1]), y1, DW(p[3]), DH(p[4]), p[5], p[6], p[7]);
+#if GD2_VERS > 1
+            else if(*p == DL_FILLEDARC)
+                gdImageFilledArc(stroke, DX(p[1]), y1, DW(p[3]), DH(p[4]),
+                                 p[5], p[6], p[7], p[8]);
+#endif
+            else if(*p == DL_ELLIPSE)
+                gdImageArc(stroke, DX(p[1]), y1, DW(p[3]), DH(p[4]), 0, 360, p[5]);
+            else if(*p == DL_FILLEDELLIPSE)
+                gdImageFilledEllipse(fill, DX(p[1]), y1, DW(p[3]), DH(p[4]), p[5]);
+            p += *p == DL_ARC ? 8 : *p == DL_FILLEDARC ? 9 : 6;
+            break;
+
+        case DL_SETPIXEL:
+            y1 = DY(p[2]);
+            if(SEES(y1, y1))
+                gdImageSetPixel(fill, DX(p[1]), y1, p[3]);
+            p += 4;
+            break;
+
+        case DL_STRING:
+        case DL_STRINGUP:
+            font = fonts[p[1]].func();
+            y1 = DY(p[3]);
+            if(*p == DL_STRING) {
+                if(SEES(y1, y1 + font->h))
+                    gdImageString(fill, font, DX(p[2]), y1,
+                                  (unsigned char *)b->text + p[4], p[5]);
+            } else {
+                if(SEES(y1 - (int)strlen(b->text + p[4]) * font->w, y1))
+                    gdImageStringUp(fill, font, DX(p[2]), y1,
+                                    (unsigned char *)b->text + p[4], p[5]);
+            }
+            p += 6;
+            break;
+
+#if defined(HAVE_LIBFREETYPE) && GD2_VERS > 1
+        case DL_STRINGFT:
+        {
+            double ptsize, angle;
+            int brect[8];
+
+            memcpy(&ptsize, p + 6, sizeof(double));
+            memcpy(&angle, p + 6 + DL_DOUBLE, sizeof(double));
+            err = gdImageStringFT(stroke, brect, p[5], b->text + p[1], ptsize * scale,
+                                  angle, DX(p[3]), DY(p[4]), b->text + p[2]);
+            p += 6 + 2 * DL_DOUBLE;
+            break;
+        }
+#endif
+
+        case DL_COPY:
+            src = b->images[p[1]];
+            x1 = DX(p[2]);
+            y1 = DY(p[3]);
+            x2 = DW(gdImageSX(src));
+            y2 = DH(gdImageSY(src));
+            if(!SEES(y1, y1 + y2))
+                ;
+            else if(x2 == gdImageSX(src) && y2 == gdImageSY(src))
+                blit_copy(stroke, src, x1, y1, 0, 0, x2, y2);
+            else
+                resample_copy(stroke, src, x1, y1, 0, 0, x2, y2,
+                              gdImageSX(src), gdImageSY(src));
+            p += 4;
+            break;
+
+        default:
+            err = "bad drawing command";
+            break;
+        }
+    }
+
+#undef DX
+#undef DY
+#undef DW
+#undef DH
+#undef SEES
+
+    free(pts);
+    return err;
+}
+
+/* can b be drawn onto im in bands with the same result? */
+
+static int dl_bandable(dlbuf *b, gdImagePtr im)
+{
+    int *p = b->ops, *end = b->ops + b->nops, color;
+
+    while(p < end) {
+        switch(*p) {
+        case DL_SETPIXEL:
+            color = p[3];
+            p += 4;
+            break;
+        case DL_LINES:
+        case DL_POLYGON:
+        case DL_FILLEDPOLYGON:
+            color = p[2];
+            p += 3 + 2 * p[1];
+            break;
+        case DL_ARC:
+        case DL_FILLEDARC:
+            color = p[7];
+            p += *p == DL_ARC ? 8 : 9;
+            break;
+        case DL_STRINGFT:
+            if(!im->trueColor)
+                return 0;
+            color = p[5];
+            p += 6 + 2 * DL_DOUBLE;
+            break;
+        case DL_COPY:
+            if(!im->trueColor)
+                return 0;
+            color = 0;
+            p += 4;
+            break;
+        default:
+            /* line, rectangles, ellipses, strings */
+            color = p[5];
+            p += 6;
+            break;
+        }
+        if(color < 0)
+            return 0;
+    }
+    return 1;
+}
+
+typedef struct {
+    imageobject *self;
+    dlbuf *b;
+    int ox, oy;
+    double scale;
+    int nbands;
+    char *err[2 * POOL_MAX];
+} dl_par;
+
+static void dl_band_run(void *arg, int i)
+{
+    dl_par *par = arg;
+    gdImagePtr im = par->self->imagedata;
+    struct gdImageStruct fill, stroke;
+    dl_band band;
+    void **rows, *scratch;
+    int y;
+
+    band.y0 = (int)((double)im->sy * i / par->nbands);
+    band.y1 = (int)((double)im->sy * (i + 1) / par->nbands) - 1;
+
+    rows = malloc(im->sy * sizeof(void *));
+    scratch = calloc(im->sx, sizeof(int));
+    if(!rows || !scratch) {
+        par->err[i] = "out of memory";
+        free(rows);
+        free(scratch);
+        return;
+    }
+    for(y = 0; y < im->sy; y++)
+        rows[y] = y < band.y0 || y > band.y1 ? scratch
+            : im->trueColor ? (void *)im->tpixels[y] : (void *)im->pixels[y];
+
+    /* filled polygons keep a buffer in the image */
+    fill = stroke = *im;
+    fill.polyInts = stroke.polyInts = NULL;
+    fill.polyAllocated = stroke.polyAllocated = 0;
+    gdImageSetClip(&fill, im->cx1, MAX(im->cy1, band.y0), im->cx2, MIN(im->cy2, band.y1));
+    if(im->trueColor)
+        stroke.tpixels = (int **)rows;
+    else
+        stroke.pixels = (unsigned char **)rows;
+
+    band.fill = &fill;
+    band.stroke = &stroke;
+    par->err[i] = dl_run(par->self, par->b, par->ox, par->oy, par->scale, &band);
+
+    gdFree(fill.polyInts);
+    gdFree(stroke.polyInts);
+    free(rows);
+    free(scratch);
+}
+
+/* draw b onto self as dl_run does, in bands over up to threads threads
+ * when that gives the same result */
+
+static char *dl_render(imageobject *self, dlbuf *b, int ox, int oy, double scale, int threads)
+{
+    dl_par par;
+    int i, nbands = MIN(2 * MIN(threads, POOL_MAX), gdImageSY(self->imagedata) / BAND_MIN);
+
+    if(nbands < 2 || !dl_bandable(b, self->imagedata))
+        return dl_run(self, b, ox, oy, scale, NULL);
+
+    par.self = self;
+    par.b = b;
+    par.ox = ox;
+    par.oy = oy;
+    par.scale = scale;
+    par.nbands = nbands;
+    par_run(nbands, threads, dl_band_run, &par);
+    for(i = 0; i < nbands; i++)
+        if(par.err[i])
+            return par.err[i];
+    return NULL;
+}
+
+static PyObject *dl_add(displaylistobject *self, int op, PyObject *args)
+{
+    if(self->replaying) {
+        PyErr_SetString(ErrorObject, "DisplayList is being replayed");
+        return NULL;
+    }
+    if(!dl_record(&self->buf, op, args))
+        return NULL;
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+#define DL_METHOD(name, op) \
+    static PyObject *name(displaylistobject *self, PyObject *args) \
+    { \
+        return dl_add(self, op, args); \
+    }
+
+DL_METHOD(dl_line, DL_LINE)
+DL_METHOD(dl_lines, DL_LINES)
+DL_METHOD(dl_rectangle, DL_RECTANGLE)
+DL_METHOD(dl_filledrectangle, DL_FILLEDRECTANGLE)
+DL_METHOD(dl_polygon, DL_POLYGON)
+DL_METHOD(dl_filledpolygon, DL_FILLEDPOLYGON)
+DL_METHOD(dl_arc, DL_ARC)
+DL_METHOD(dl_filledarc, DL_FILLEDARC)
+DL_METHOD(dl_ellipse, DL_ELLIPSE)
+DL_METHOD(dl_filledellipse, DL_FILLEDELLIPSE)
+DL_METHOD(dl_setpixel, DL_SETPIXEL)
+DL_METHOD(dl_string, DL_STRING)
+DL_METHOD(dl_stringup, DL_STRINGUP)
+DL_METHOD(dl_string_ft, DL_STRINGFT)
+DL_METHOD(dl_copy, DL_COPY)
+
+static PyObject *dl_replay(displaylistobject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"image", "offset", "scale", "threads", NULL};
+    imageobject *img;
+    int ox = 0, oy = 0, threads = 1;
+    double scale = 1.0;
+    char *err;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O!|(ii)di", kwlist,
+            &Imagetype, &img, &ox, &oy, &scale, &threads))
+        return NULL;
+    if(!image_check(img))
+        return NULL;
+    if(threads <= 0)
+        threads = ncpus();
+    if(scale <= 0) {
+        PyErr_SetString(PyExc_ValueError, "scale must be positive");
+        return NULL;
+    }
+
+#if defined(HAVE_LIBFREETYPE) && GD2_VERS > 1
+    /* not safe to do for the first time from two threads at once */
+    if(self->buf.ft)
+        gdFontCacheSetup();
+#endif
+
+    self->replaying++;
+    UNLOCKED(img, err = dl_render(img, &self->buf, ox, oy, scale, threads));
+    self->replaying--;
+
+    if(err) {
+        PyErr_SetString(PyExc_ValueError, err);
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *dl_clear(displaylistobject *self)
+{
+    if(self->replaying) {
+        PyErr_SetString(ErrorObject, "DisplayList is being replayed");
+        return NULL;
+    }
+    dl_free(&self->buf);
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *dl_size(displaylistobject *self)
+{
+    return Py_BuildValue("i", (int)(self->buf.nops * sizeof(int) + self->buf.ntext));
+}
+
+static struct PyMethodDef dl_methods[] = {
+
+ {"line",    (PyCFunction)dl_line,    1,
+    "line((x1,y1), (x2,y2), color)\n"
+    "record a line"},
+
+ {"lines",    (PyCFunction)dl_lines,    1,
+    "lines(points, color)\n"
+    "record a connected line through points"},
+
+ {"rectangle",    (PyCFunction)dl_rectangle,    1,
+    "rectangle((x1,y1), (x2,y2), color[, fillcolor])\n"
+    "record a rectangle, optionally filled"},
+
+ {"filledRectangle",    (PyCFunction)dl_filledrectangle,    1,
+    "filledRectangle((x1,y1), (x2,y2), color)\n"
+    "record a filled rectangle"},
+
+ {"polygon",    (PyCFunction)dl_polygon,    1,
+    "polygon(points, color[, fillcolor])\n"
+    "record a polygon, optionally filled"},
+
+ {"filledPolygon",    (PyCFunction)dl_filledpolygon,    1,
+    "filledPolygon(points, color)\n"
+    "record a filled polygon"},
+
+ {"arc",    (PyCFunction)dl_arc,    1,
+    "arc((x,y), (w,h), start, end, color)\n"
+    "record an arc"},
+
+ {"filledArc",    (PyCFunction)dl_filledarc,    1,
+    "filledArc((x,y), (w,h), start, end, color, style)\n"
+    "record a filled arc"},
+
+ {"ellipse",    (PyCFunction)dl_ellipse,    1,
+    "ellipse((x,y), (w,h), color)\n"
+    "record an ellipse"},
+
+ {"filledEllipse",    (PyCFunction)dl_filledellipse,    1,
+    "filledEllipse((x,y), (w,h), color)\n"
+    "record a filled ellipse"},
+
+ {"setPixel",    (PyCFunction)dl_setpixel,    1,
+    "setPixel((x,y), color)\n"
+    "record setting a pixel"},
+
+ {"string",    (PyCFunction)dl_string,    1,
+    "string(font, (x,y), s, color)\n"
+    "record a string in one of the built in fonts"},
+
+ {"stringUp",    (PyCFunction)dl_stringup,    1,
+    "stringUp(font, (x,y), s, color)\n"
+    "record a vertical string in one of the built in fonts"},
+
+ {"string_ft",    (PyCFunction)dl_string_ft,    1,
+    "string_ft(font, ptsize, angle, (x,y), s, color)\n"
+    "record a string in a freetype font; ptsize is scaled on replay"},
+
+ {"copy",    (PyCFunction)dl_copy,    1,
+    "copy(image, (dx,dy)[, (sx,sy), (w,h)])\n"
+    "record copying the w x h rectangle at (sx,sy) of image (by default, all\n"
+    "of it) to (dx,dy).  the pixels are copied now, so later changes to image\n"
+    "don't show in the list"},
+
+ {"replay",    (PyCFunction)dl_replay,    METH_VARARGS | METH_KEYWORDS,
+    "replay(image[, (dx,dy), scale, threads])\n"
+    "draw everything recorded onto image, with the coordinates and sizes\n"
+    "multiplied by scale and moved by (dx,dy), before the image's own origin\n"
+    "and multiplier are applied.  the GIL is released while drawing.  with\n"
+    "threads more than 1 (0 for the number of CPUs) the image is drawn in\n"
+    "horizontal bands on that many threads, with the same result"},
+
+ {"clear",    (PyCFunction)dl_clear,    1,
+    "clear()\n"
+    "forget everything recorded"},
+
+ {"size",    (PyCFunction)dl_size,    1,
+    "size()\n"
+    "returns the number of bytes of commands and text recorded"},
+
+ {NULL,        NULL}        /* sentinel */
+};
+
+static void dl_dealloc(displaylistobject *self)
+{
+    dl_free(&self->buf);
+    PyObject_DEL(self);
+}
+
+static PyObject *dl_getattr(PyObject *self, char *name)
+{
+    return Py_FindMethod(dl_methods, self, name);
+}
+
+static PyTypeObject DisplayListtype = {
+    PyObject_HEAD_INIT(NULL)
+    0,                                  /*ob_size*/
+    "DisplayList",                      /*tp_name*/
+    sizeof(displaylistobject),          /*tp_basicsize*/
+    0,                                  /*tp_itemsize*/
+    /* methods */
+    (destructor)dl_dealloc,             /*tp_dealloc*/
+    0,                                  /*tp_print*/
+    (getattrfunc)dl_getattr,            /*tp_getattr*/
+};
+
+static PyObject *gd_displaylist(PyObject *module, PyObject *args)
+{
+    displaylistobject *self;
+
+    if(!PyArg_ParseTuple(args, ""))
+        return NULL;
+    if(!(self = PyObject_NEW(displaylistobject, &DisplayListtype)))
+        return NULL;
+    memset(&self->buf, 0, sizeof(self->buf));
+    self->replaying = 0;
+    return (PyObject *)self;
+}
+
+/*
+** image.draw(): a batch of drawing commands run in one call.  Commands
+** given as tuples are parsed into a display list and played straight
+** back.  An array of ints is taken to be the display list's own command
+** layout, which is checked and then drawn from without copying.
+*/
+
+static struct {
+    char *name;
+    char *constant;
+    int op;
+} draw_ops[] = {
+    {"line",            "gdDrawLine",               DL_LINE},
+    {"lines",           "gdDrawLines",              DL_LINES},
+    {"rectangle",       "gdDrawRectangle",          DL_RECTANGLE},
+    {"filledRectangle", "gdDrawFilledRectangle",    DL_FILLEDRECTANGLE},
+    {"polygon",         "gdDrawPolygon",            DL_POLYGON},
+    {"filledPolygon",   "gdDrawFilledPolygon",      DL_FILLEDPOLYGON},
+    {"arc",             "gdDrawArc",                DL_ARC},
+    {"filledArc",       "gdDrawFilledArc",          DL_FILLEDARC},
+    {"ellipse",         "gdDrawEllipse",            DL_ELLIPSE},
+    {"filledEllipse",   "gdDrawFilledEllipse",      DL_FILLEDELLIPSE},
+    {"setPixel",        "gdDrawSetPixel",           DL_SETPIXEL},
+    {"string",          "gdDrawString",             DL_STRING},
+    {"stringUp",        "gdDrawStringUp",           DL_STRINGUP},
+    {"string_ft",       "gdDrawStringFT",           DL_STRINGFT},
+    {NULL, NULL, 0}
+};
+
+/* the opcode named by a command tuple's first item, or 0 */
+
+static int draw_op(PyObject *name)
+{
+    int i, op;
+
+    if(PyInt_Check(name)) {
+        op = PyInt_AS_LONG(name);
+        for(i = 0; draw_ops[i].name; i++)
+            if(draw_ops[i].op == op)
+                return op;
+    } else if(PyString_Check(name)) {
+        for(i = 0; draw_ops[i].name; i++)
+            if(strcmp(draw_ops[i].name, PyString_AS_STRING(name)) == 0)
+                return draw_ops[i].op;
+    }
+    return 0;
+}
+
+/* check that the n ints at ops are whole commands which need no text or
+ * images.  returns the longest point list, or -1 with an exception set */
+
+static int draw_check(const int *ops, Py_ssize_t n)
+{
+    Py_ssize_t i = 0, len;
+    int maxpoints = 0;
+
+    while(i < n) {
+        switch(ops[i]) {
+        case DL_SETPIXEL:
+            len = 4;
+            break;
+        case DL_LINE:
+        case DL_RECTANGLE:
+        case DL_FILLEDRECTANGLE:
+        case DL_ELLIPSE:
+        case DL_FILLEDELLIPSE:
+            len = 6;
+            break;
+        case DL_ARC:
+            len = 8;
+            break;
+        case DL_FILLEDARC:
+            len = 9;
+            break;
+        case DL_LINES:
+        case DL_POLYGON:
+        case DL_FILLEDPOLYGON:
+            if(i + 1 < n && ops[i + 1] >= (ops[i] == DL_LINES ? 2 : 0)
+            && ops[i + 1] <= (n - i - 3) / 2) {
+                len = 3 + 2 * ops[i + 1];
+                maxpoints = MAX(maxpoints, ops[i + 1]);
+                break;
+            }
+            PyErr_Format(PyExc_ValueError, "bad point count for drawing command at %ld", (long)i);
+            return -1;
+        default:
+            PyErr_Format(PyExc_ValueError, "unknown drawing command %d at %ld", ops[i], (long)i);
+            return -1;
+        }
+        if(len > n - i) {
+            PyErr_Format(PyExc_ValueError, "drawing command at %ld is cut short", (long)i);
+            return -1;
+        }
+        i += len;
+    }
+    return maxpoints;
+}
+
+static PyObject *image_draw(imageobject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"commands", "threads", NULL};
+    PyObject *cmds, *seq, *item, *rest;
+    Py_ssize_t i, n;
+    intarray a;
+    dlbuf b;
+    int op, ok = 1, threads = 1;
+    char *err = NULL;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|i", kwlist, &cmds, &threads))
+        return NULL;
+    if(threads <= 0)
+        threads = ncpus();
+
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+
+    if(PyObject_CheckBuffer(cmds) || PyObject_HasAttrString(cmds, "typecode")) {
+        if(!intarray_get(cmds, &a, 1))
+            return NULL;
+        if(a.n > INT_MAX / 2) {
+            PyErr_SetString(PyExc_ValueError, "too many drawing commands");
+            ok = 0;
+        } else if((b.maxpoints = draw_check(a.vals, a.n)) < 0) {
+            ok = 0;
+        } else {
+            ok = intarray_pin(&a);
+        }
+        b.ops = a.vals;
+        b.nops = a.n;
+    } else {
+        if(!(seq = PySequence_Fast(cmds, "commands must be a sequence of tuples or an array of ints")))
+            return NULL;
+        n = PySequence_Fast_GET_SIZE(seq);
+        for(i = 0; i < n && ok; i++) {
+            item = PySequence_Fast_GET_ITEM(seq, i);
+            if(!PyTuple_Check(item) || PyTuple_GET_SIZE(item) < 1) {
+                PyErr_SetString(PyExc_TypeError, "each command must be a tuple (name, args...)");
+                ok = 0;
+            } else if(!(op = draw_op(PyTuple_GET_ITEM(item, 0)))) {
+                PyErr_SetString(PyExc_ValueError, "unknown drawing command");
+                ok = 0;
+            } else if(!(rest = PyTuple_GetSlice(item, 1, PyTuple_GET_SIZE(item)))) {
+                ok = 0;
+            } else {
+                ok = dl_record(&b, op, rest);
+                Py_DECREF(rest);
+            }
+        }
+        Py_DECREF(seq);
+#if defined(HAVE_LIBFREETYPE) && GD2_VERS > 1
+        if(b.ft)
+            gdFontCacheSetup();
+#endif
+    }
+
+    if(ok)
+        UNLOCKED(self, err = dl_render(self, &b, 0, 0, 1.0, threads));
+
+    if(a.vals)
+        intarray_release(&a);
+    else
+        dl_free(&b);
+
+    if(!ok)
+        return NULL;
+    if(err) {
+        PyErr_SetString(PyExc_ValueError, err);
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static struct PyMethodDef image_methods[] = {
+
+ {"writeGif",    (PyCFunction)image_writegif,    1,
+    "writeGif(f)\n"
+    "write the image to f as a GIF, where f is either an open file object or a\n"
+    "file name."},
+
+ {"writePng",    (PyCFunction)image_writepng,    METH_VARARGS | METH_KEYWORDS,
+    "writePng(f[, level, strategy])\n"
+    "write the image to f as a PNG, where f is either an open file object or a\n"
+    "file name.  level is the zlib compression level, 0 to 9, or one of the\n"
+    "presets \"fast\", \"balanced\" or \"small\"; leave out for the default.\n"
+    "strategy is the row filter, as for PngWriter; truecolor images only,\n"
+    "ValueError for a palette image."},
+
+ {"writeJpeg",    (PyCFunction)image_writejpeg,    1,
+    "writeJpeg(f,quality)\n"
+    "write the image to f as a JPEG, where f is either an open file object or a\n"
+    "file name.  quality is an optional integer value giving the JPEG quality from\n"
+    "0 to 95%; leave out for default quality."},
+
+ {"writeWbmp",    (PyCFunction)image_writewbmp,    1,
+    "writeWbmp(f,fg)\n"
+    "write the image to f as a WBMP, where f is either an open file object or a\n"
+    "file name.  fg is a foreground color index which will be set in the output\n"
+    "file; see the gd documentation for a further explanation of this value."},
+
+ {"writeGd",    (PyCFunction)image_writegd,     1,
+    "writeGd(f)\n"
+    "write the image to f as a GD file, where f is either an open file object\n"
+    "or a file name."},
+
+ {"writeGd2",    (PyCFunction)image_writegd2,    1,
+    "writeGd(f,chunksize,fmt)\n"
+    "write the image to f as a GD2 file, where f is either an open file object\n"
+    "or a file name.  see the gd documentation for an explanation of the chunksize\n"
+    "and fmt arguments.  defaults will be used if not given."},
+
+ {"encode_many",    (PyCFunction)image_encode_many,    1,
+    "encode_many(formats[, threads])\n"
+    "encode the image in several formats at once, returning a list of strings.\n"
+    "formats is a sequence of format names (gif, png, jpeg, gd, gd2, wbmp) or\n"
+    "(name, options) tuples, where options is a dict: level for png, quality for jpeg,\n"
+    "chunksize and fmt for gd2, fg for wbmp.  the encodings run in parallel\n"
+    "on up to threads threads (default one per format)"},
+
+ {"setPixel",    (PyCFunction)image_setpixel,    1,
+    "setPixel((x,y), color)\n"
+    "set the pixel at (x,y) to color"},
+
+ {"setPixels",    (PyCFunction)image_setpixels,    1,
+    "setPixels(xs, ys, colors)\n"
+    "set the pixel at (xs[i],ys[i]) to colors[i] for each i, or all to colors\n"
+    "if it is a single color.  xs, ys and colors may be arrays (array.array,\n"
+    "NumPy or anything supporting the buffer interface) or sequences of ints.\n"
+    "returns the number of points inside the clipping rectangle."},
+
+ {"draw",    (PyCFunction)image_draw,    METH_VARARGS | METH_KEYWORDS,
+    "draw(commands[, threads])\n"
+    "run a batch of drawing commands in one call.  commands is a sequence of\n"
+    "tuples (name, args...), where name is the name of a drawing method (line,\n"
+    "lines, rectangle, filledRectangle, polygon, filledPolygon, arc, filledArc,\n"
+    "ellipse, filledEllipse, setPixel, string, stringUp or string_ft) or its\n"
+    "gdDraw constant, and args are as for that method; or it is an array of\n"
+    "ints holding gdDraw opcodes each followed by its operands.  threads is\n"
+    "as for DisplayList.replay()"},
+
+ {"line",    (PyCFunction)image_line,    1,
+    "line((x1,y1), (x2,y2), color)\n"
+    "draw a line from (x1,y1) to (x2,y2) in color"},
+
+ {"lines",    (PyCFunction)image_lines,    1,
+    "line(seq, color)\n"
+    "seq is a list of x,y tuples, or a flat array of x,y ints.\n"
+    "Draw a connected line in color"},
+
+
+ {"polygon",    (PyCFunction)image_polygon,    1,
+    "polygon(((x1,y1), (x2,y2), ..., (xn, yn)), color[, fillcolor])\n"
+    "draw a polygon using the list or tuple of points (minimum 3) in color,\n"
+    "optionally filled with fillcolor.  points may also be a flat array of\n"
+    "x,y ints (array.array('i'), NumPy or other buffer)"},
+
+ {"rectangle",    (PyCFunction)image_rectangle, 1,  "rectangle((x1,y1), (x2,y2), color[, fillcolor])\n"
+    "draw a rectangle with upper corner (x1,y1), lower corner (x2,y2) in color,\n"
+    "optionally filled with fillcolor"},
+
+ {"filledPolygon",    (PyCFunction)image_filledpolygon, 1,
+    "filledPolygon(((x1,y1), (x2,y2), ..., (xn, yn)), color)\n"
+    "draw a filled polygon using the list or tuple of points (minimum 3) in color.\n"
+    "points may also be a flat array of x,y ints"},
+
+ {"filledRectangle",    (PyCFunction)image_filledrectangle, 1,
+    "filledRectangle((x1,y1), (x2,y2), color)\n"
+    "draw a rectangle with upper corner (x1,y1), lower corner (x2,y2) in color"},
+
+ {"arc",    (PyCFunction)image_arc,    1,
+    "arc((x,y), (w,h), start, end, color)\n"
+    "draw an ellipse centered at (x,y) with width w, height h from start\n"
+    "degrees to end degrees in color."},
+
+ {"filledArc", (PyCFunction)image_filledarc, 1,
+  "filledArc((x,y), (w,h), start, end, color, style)\n"
+  "draw an ellipse centered at (x,y) with width w, height h from start\n"
+  "degrees to end degrees in color.  The style argument is a bitwise OR\n"
+  "of the following (gdArc, gdChord, gdPie, gdNoFill, gdEdged)."},
+
+ {"filledEllipse",    (PyCFunction)image_filledellipse,    1,
+    "filledEllipse((x,y), (w,h), color)\n"
+    "draw a filled ellipse centered at (x,y) with width w,\n"
+    "height h in color."},
+
+ {"fillToBorder",    (PyCFunction)image_filltoborder,    1,
+    "fillToBorder((x,y), border, color)\n"
+    "flood from point (x,y) to border color in color"},
+
+ {"fill",    (PyCFunction)image_fill,    1,
+    "fill((x,y), color)\n"
+    "flood from point (x,y) in color for those pixels with the same color\n"
+    "as the starting point"},
+
+ {"setBrush",    (PyCFunction)image_setbrush,    1,
+    "setBrush(image)\n"
+    "set the drawing brush to <image> (use gdBrushed when drawing)"},
+
+ {"setAntiAliased",    (PyCFunction)image_setantialiased, 1,  "setAntiAliased(color)\n"
+    "Set the foreground color to be used when drawing antialiased lines.  Use the gdAntiAliased in place of the color when drawing"},
+
+ {"setClip",    (PyCFunction)image_setclip, 1,  "setClip((x1,y1), (x2,y2))\n"
+    "Set the image clipping rectangle"},
+
+
+ {"setTile",    (PyCFunction)image_settile,    1,
+    "setTile(image)\n"
+    "set the fill tile to <image> (use gdTiled when filling)"},
+
+ {"setStyle",    (PyCFunction)image_setstyle,    1,
+    "setStyle(tuple)\n"
+    "set the line bit-style to tuple of colors (use gdStyled when drawing)"},
+
+ {"setThickness",    (PyCFunction)image_setthickness,    1,
+    "setThickness(thickness)\n"
+    "set the width of lines, polyons, and arcs."},
+
+ {"alphaBlending", (PyCFunction)image_alphablending, 1,
+    "alphaBlending(blending)\n"
+    "toggles alpha channel blending for trucolor images."},
+
+ {"alpha", (PyCFunction)image_alpha, 1,
+    "alpha(color)\n"
+    "returns the alpha component of the specified color."},
+
+ {"blue", (PyCFunction)image_blue, 1,
+    "blue(color)\n"
+    "returns the blue component of the specified color."},
+
+ {"green", (PyCFunction)image_green, 1,
+    "green(color)\n"
+    "returns the green component of the specified color."},
+
+ {"red", (PyCFunction)image_red, 1,
+    "red(color)\n"
+    "returns the red component of the specified color."},
+
+ {"getPixel",    (PyCFunction)image_getpixel,    1,
+    "getPixel((x,y))\n"
+    "color index of image at (x,y)"},
+
+ {"getPixels",    (PyCFunction)image_getpixels,    1,
+    "getPixels(xs, ys[, out])\n"
+    "colors of the image at (xs[i],ys[i]) for each i, in an array('i'), or\n"
+    "in out, a writable array of len(xs) ints, which is returned."},
+
+ {"boundsSafe",    (PyCFunction)image_boundssafe,    1,
+    "boundsSafe((x,y))\n"
+    "returns true if(x,y) is within image"},
+
+ {"size",    (PyCFunction)image_size,    1,
+    "size()\n"
+    "return the 2-tuple size of image"},
+
+ {"char",    (PyCFunction)image_char,1,
+    "char(font, (x,y), c, color)\n"
+    "draw string c at (x,y) using one of the pre-defined gdmodule fonts (gdFont*)"},
+
+ {"charUp",    (PyCFunction)image_charup,1,
+    "charUp(font, (x,y), c, color)\n"
+    "vertically draw string c at (x,y) using one of the pre-defined gdmodule\n"
+    "fonts (gdFont*)"},
+
+ {"get_bounding_rect",    (PyCFunction)image_get_bounding_rect,1,
+    "get_bounding_rect(font, ptsize, angle,(x,y), s)\n"
+    "get bounding rect of string s using the truetype font"},
+
+ {"string_ttf",    (PyCFunction)image_string_ttf,1,
+    "string_ttf(font, ptsize, angle, (x,y), s, color)\n"
+    "draw string s at (x,y) using the truetype font"},
+
+ {"string_ft",    (PyCFunction)image_string_ft,1,
+    "string_ft(font, ptsize, angle, (x,y), s, color)\n"
+    "draw string s at (x,y) using the truetype font"},
+
+ {"string",    (PyCFunction)image_string,1,
+    "string(font, (x,y), s, color)\n"
+    "draw string s at (x,y) using one of the pre-defined gdmodule fonts (gdFont*)"},
+
+#ifdef Py_UNICODEOBJECT_H
+ {"string16",    (PyCFunction)image_string16,1,
+    "string(font, (x,y), s, color)\n"
+    "draw unicode string s at (x,y) using one of the pre-defined gdmodule fonts (gdFont*)"},
+#endif
+
+ {"stringUp",    (PyCFunction)image_stringup,1,
+    "stringUp(font, (x,y), s, color)\n"
+    "vertically draw string s at (x,y) using one of the pre-defined gdmodule\n"
+    "fonts (gdFont*)"},
+
+#ifdef Py_UNICODEOBJECT_H
+ {"stringUp16",    (PyCFunction)image_stringup16,1,
+    "stringUp16(font, (x,y), s, color)\n"
+    "vertically draw unicode string s at (x,y) using one of the pre-defined gdmodule\n"
+    "fonts (gdFont*)"},
+#endif
+
+ {"colorAllocate",    (PyCFunction)image_colorallocate,1,
+    "colorAllocate((r,g,b))\n"
+    "allocate a color index to (r,g,b) (returns -1 if unable to)"},
+
+ {"colorAllocateAlpha",    (PyCFunction)image_colorallocatealpha,1,
+    "colorAllocateAlpha((r,g,b,a))\n"
+    "allocate a color index to (r,g,b,a) (returns -1 if unable to)"},
+
+ {"colorClosest",    (PyCFunction)image_colorclosest,    1,
+    "colorClosest((r,g,b))\n"
+    "return the color index closest to (r,g,b) (returns -1 if unable to)"},
+
+ {"colorClosestAlpha",    (PyCFunction)image_colorclosestalpha,    1,
+    "colorClosestAlpha((r,g,b,a))\n"
+    "return the color index closest to (r,g,b,a) (returns -1 if unable to)"},
+
+ {"colorClosestHWB",    (PyCFunction)image_colorclosestHWB,    1,
+    "colorClosestHWB((r,g,b))\n"
+    "return the color index closest in hue whiteness and blackness to (r,g,b) (returns -1 if unable to)"},
+
+ {"colorExact",    (PyCFunction)image_colorexact,    1,
+    "colorExact((r,g,b))\n"
+    "return an exact color index match for (r,g,b) (returns -1 if unable to)"},
+
+ {"colorResolve", (PyCFunction)image_colorresolve, 1,
+  "colorResolve((r,g,b))\n"
+  "returns the exact color (after possibly allocating) or the closes match."},
+
+ {"colorResolveAlpha", (PyCFunction)image_colorresolvealpha, 1,
+  "colorResolve((r,g,b,a))\n"
+  "returns the exact color (after possibly allocating) or the closes match."},
+
+ {"colorsTotal",    (PyCFunction)image_colorstotal,    1,
+    "colorsTotal()\n"
+    "returns the number of colors currently allocated"},
+
+ {"colorComponents",    (PyCFunction)image_colorcomponents,    1,
+    "colorComponents(color)\n"
+    "returns a 3-tulple of the (r,g,b) components of color"},
+
+ {"getClip",    (PyCFunction)image_getclip,    1,
+    "getClip()\n"
+    "returns (x1,y1), (x2,y2) of the image clip rectange"},
+
+ {"getInterlaced",    (PyCFunction)image_getinterlaced,    1,
+    "getInterlaced()\n"
+    "returns true if the image is interlaced"},
+
+ {"getTransparent",    (PyCFunction)image_gettransparent,    1,
     "getTransparent()\n"
     "returns transparent color index or -1"},
 
- {"colorDeallocate",    (PyCFunction)image_colordeallocate,    1,
-    "colorDeallocate(color)\n"
-    "deallocate color from the image palette"},
+ {"colorDeallocate",    (PyCFunction)image_colordeallocate,    1,
+    "colorDeallocate(color)\n"
+    "deallocate color from the image palette"},
+
+ {"colorTransparent",    (PyCFunction)image_colortransparent,    1,
+    "colorTransparent(color)\n"
+    "set the transparent color to color"},
+
+ {"copyTo",    (PyCFunction)image_copyto,    1,
+    "copyTo(image[, (dx,dy)[, (sx,sy)[, (w,h)]]])\n"
+    "copy from (sx,sy), width sw and height sh to destination image (dx,dy)"},
+
+ {"copyResizedTo",    (PyCFunction)image_copyresizedto,1,
+    "copyResizedTocopyTo(image[, (dx,dy)[, (sx,sy)[, (dw,dh)[, (sw,sh)]]]])\n"
+    "copy from (sx,sy), width sw and height sh to destination image (dx,dy), \n"
+    "width dw and height dh"},
+
+ {"copyResampledTo",    (PyCFunction)image_copyresampledto, METH_VARARGS | METH_KEYWORDS,
+    "copyResampledTo(image[, (dx,dy)[, (sx,sy)[, (dw,dh)[, (sw,sh)]]]][, filter=name])\n"
+    "copy from (sx,sy), width sw and height sh to destination image (dx,dy), \n"
+    "width dw and height dh using smooth pixel interpolation.  filter may be\n"
+    "box, bilinear, bicubic or lanczos3 (truecolor images only)."},
+
+ {"copyMergeTo",    (PyCFunction)image_copymergeto,    1,
+    "copyMergeTo(image[, (dx,dy)[, (sx,sy)[, (w,h)]], pct])\n"
+    "copy from (sx,sy), width sw and height sh to destination image (dx,dy)\n"
+    "If pct is 100 then this is equivalent to copyTo().  If pct is less\n"
+    "than 100 the images are merged." },
+
+ {"copyMergeGrayTo",    (PyCFunction)image_copymergegrayto,    1,
+    "copyMergeGrayTo(image[, (dx,dy)[, (sx,sy)[, (w,h)]], pct])\n"
+    "copy from (sx,sy), width sw and height sh to destination image (dx,dy)\n"
+    "If pct is 100 then this is equivalent to copyTo().  If pct is less\n"
+    "than 100 the images are merged.  The hue is preserved by first\n"
+    "converting the destination pixels to gray." },
+
+ {"copyPaletteTo", (PyCFunction)image_copypaletteto, 1,
+    "copyPaletteTo(image)\n"
+  "copy the palette from one image to another."},
+
+ {"toPalette", (PyCFunction)image_topalette, METH_VARARGS | METH_KEYWORDS,
+    "toPalette([colors[, dither[, method]]])\n"
+  "returns a palette image of this one in at most colors colors (256),\n"
+  "dithered if dither is true.  method is octree or kmeans (slower,\n"
+  "closer colors)."},
+
+ {"compare", (PyCFunction)image_compare, 1,
+    "compare(image)\n"
+  "compares this image with another.  Returns a bitmask whose values\n"
+  "are composed of CMP_IMAGE, CMP_NUM_COLORS, CMP_COLOR, CMP_SIZE_X,\n"
+  "CMP_SIZE_Y, CMP_TRANSPARENT, CMP_BACKGROUND, CMP_INTERLACE, CMP_TRUECOLOR"},
+
+ {"interlace",    (PyCFunction)image_interlace,    1,
+    "interlace()\n"
+    "set the interlace bit"},
+
+ {"origin",    (PyCFunction)image_origin,    1,
+    "origin((x,y)[,xmult,ymult])\n"
+    "set the origin of the image to (x,y) and multiply all x, y, width and\n"
+    "height factors by xmult and ymult (typically either 1 or -1)"},
+
+ {"getOrigin",    (PyCFunction)image_getorigin,    1,
+    "getOrigin()\n"
+    "returns the origin parameters ((x,y),xmult,ymult)"},
+
+ {"row",    (PyCFunction)image_getrow,    1,
+    "row(y)\n"
+    "returns a writable memoryview of the bytes of row y, shared with the\n"
+    "image.  truecolor pixels are native unsigned ints, 0xAARRGGBB; palette\n"
+    "pixels are bytes."},
+
+ {"saveAlpha",    (PyCFunction)image_savealpha,    1,
+    "saveAlpha(n)\n"
+    "if n = 1, alpha channel information will be saved"
+    " (assuming the format supports it, i.e. PNG)"},
+
+ {NULL,        NULL}        /* sentinel */
+};
+
+
+/*
+** Readers for the formats gd can only load from a FILE * (xbm) or a
+** filename (xpm), so that they can be read from memory and from
+** objects with a read() method like everything else.  They follow
+** gd's own readers: the results are the same as loading from a file.
+*/
+
+/* read everything left in a gdIOCtx into a NUL-terminated buffer,
+ * which the caller must free() */
+
+static char *read_whole_ctx(gdIOCtxPtr ctx, int *size)
+{
+    char *buf = NULL, *nbuf;
+    int len = 0, alloc = 0, n;
+
+    do {
+        if(alloc - len < 4096) {
+            alloc = alloc ? alloc * 2 : 65536;
+            if(!(nbuf = realloc(buf, alloc + 1))) {
+                free(buf);
+                return NULL;
+            }
+            buf = nbuf;
+        }
+        n = ctx->getBuf(ctx, buf + len, alloc - len);
+        if(n > 0)
+            len += n;
+    } while(n > 0);
+
+    buf[len] = '\0';
+    *size = len;
+    return buf;
+}
+
+/* read the next line of a memory buffer into line */
+
+static const char *xbm_line(const char *p, const char *end, char *line, int max)
+{
+    int n = 0;
+
+    while(p < end && *p != '\n') {
+        if(n < max - 1)
+            line[n++] = *p;
+        p++;
+    }
+    line[n] = '\0';
+    return p < end ? p + 1 : p;
+}
+
+static gdImagePtr xbm_from_ptr(int size, void *data)
+{
+    const char *p = (const char *)data, *end = p + size, *start;
+    char line[256], name[256], *t;
+    int w = 0, h = 0, bits = 8, v, d, x, y, b;
+    gdImagePtr im;
+
+    /* the #defines come first; the data starts after the '{' */
+    for(;;) {
+        if(p >= end)
+            return NULL;
+        start = p;
+        p = xbm_line(p, end, line, sizeof(line));
+        if(sscanf(line, "#define %255s %d", name, &v) == 2) {
+            if((t = strrchr(name, '_')) != NULL) {
+                if(strcmp(t, "_width") == 0)
+                    w = v;
+                else if(strcmp(t, "_height") == 0)
+                    h = v;
+            }
+            continue;
+        }
+        if((t = strchr(line, '{')) != NULL) {
+            if(strstr(line, "short"))
+                bits = 16;     /* X10 format */
+            p = start + (t - line) + 1;
+            break;
+        }
+    }
+
+    if(w <= 0 || h <= 0 || !(im = gdImageCreate(w, h)))
+        return NULL;
+    gdImageColorAllocate(im, 255, 255, 255);
+    gdImageColorAllocate(im, 0, 0, 0);
+
+    /* each row is padded out to a whole number of values, with the
+     * leftmost pixel in the lowest bit */
+    x = y = 0;
+    while(y < h) {
+        while(p < end && !(p[0] == '0' && p + 1 < end && (p[1] == 'x' || p[1] == 'X')))
+            p++;
+        if(p >= end) {
+            gdImageDestroy(im);
+            return NULL;
+        }
+        for(p += 2, v = 0; p < end; p++) {
+            if(*p >= '0' && *p <= '9') d = *p - '0';
+            else if(*p >= 'a' && *p <= 'f') d = *p - 'a' + 10;
+            else if(*p >= 'A' && *p <= 'F') d = *p - 'A' + 10;
+            else break;
+            v = (v << 4) | d;
+        }
+        for(b = 0; b < bits && x < w; b++, x++)
+            if(v & (1 << b))
+                gdImageSetPixel(im, x, y, 1);
+        if(x >= w) {
+            x = 0;
+            y++;
+        }
+    }
+
+    return im;
+}
+
+static gdImagePtr xbm_from_ctx(gdIOCtxPtr ctx)
+{
+    gdImagePtr im;
+    char *data;
+    int size;
+
+    if(!(data = read_whole_ctx(ctx, &size)))
+        return NULL;
+    im = xbm_from_ptr(size, data);
+    free(data);
+    return im;
+}
+
+#ifdef HAVE_LIBXPM
+/* a color spec, #rgb, #rrggbb, #rrrgggbbb, #rrrrggggbbbb or (with gd 2.1
+ * and later) an X11 color name, to 8 bit rgb.  returns 0 if unknown. */
+
+static int xpm_color(const char *c, int rgb[3])
+{
+    char hex[5];
+    int k, n;
+
+    if(*c != '#') {
+#ifdef HAVE_GD_COLOR_MAP
+        char name[64];
+
+        if(gdColorMapLookup(GD_COLOR_MAP_X11, c, &rgb[0], &rgb[1], &rgb[2]))
+            return 1;
+        /* X matches names without regard to case */
+        for(k = 0; c[k] && k < (int)sizeof(name) - 1; k++)
+            name[k] = tolower((unsigned char)c[k]);
+        name[k] = '\0';
+        return !c[k] && gdColorMapLookup(GD_COLOR_MAP_X11, name, &rgb[0], &rgb[1], &rgb[2]);
+#else
+        return 0;
+#endif
+    }
+
+    n = (strlen(c) - 1) / 3;
+    if(strlen(c) != 3 * n + 1 || n < 1 || n > 4)
+        return 0;
+    for(k = 0; k < 3; k++) {
+        memcpy(hex, c + 1 + k * n, n);
+        hex[n] = '\0';
+        rgb[k] = strtol(hex, NULL, 16);
+        if(n == 1)
+            rgb[k] *= 17;
+        else
+            rgb[k] >>= 4 * (n - 2);
+    }
+    return 1;
+}
+
+static gdImagePtr xpm_from_ptr(int size, void *data)
+{
+    XpmImage image;
+    gdImagePtr im = NULL;
+    char *buf, *c;
+    int *colors, i, j, rgb[3];
+    unsigned int *pixel;
+
+    /* libXpm wants a NUL-terminated string */
+    if(!(buf = malloc(size + 1)))
+        return NULL;
+    memcpy(buf, data, size);
+    buf[size] = '\0';
+    i = XpmCreateXpmImageFromBuffer(buf, &image, NULL);
+    free(buf);
+    if(i != XpmSuccess)
+        return NULL;
+
+    if(!(colors = calloc(image.ncolors, sizeof(int)))
+    || !(im = gdImageCreate(image.width, image.height)))
+        goto done;
+
+    for(i = 0; i < (int)image.ncolors; i++) {
+        colors[i] = 0;
+        if(!(c = image.colorTable[i].c_color))
+            continue;
+        if(strcmp(c, "None") == 0) {
+            if((colors[i] = gdImageGetTransparent(im)) == -1)
+                colors[i] = gdImageColorAllocate(im, 0, 0, 0);
+            if(colors[i] != -1)
+                gdImageColorTransparent(im, colors[i]);
+            continue;
+        }
+        /* an unknown color fails the load rather than coming out black */
+        if(!xpm_color(c, rgb)) {
+            gdImageDestroy(im);
+            im = NULL;
+            goto done;
+        }
+        colors[i] = gdImageColorResolve(im, rgb[0], rgb[1], rgb[2]);
+    }
+
+    pixel = image.data;
+    for(j = 0; j < (int)image.height; j++)
+        for(i = 0; i < (int)image.width; i++, pixel++)
+            if(*pixel < image.ncolors)
+                gdImageSetPixel(im, i, j, colors[*pixel]);
+
+done:
+    free(colors);
+    XpmFreeXpmImage(&image);
+    return im;
+}
+
+static gdImagePtr xpm_from_ctx(gdIOCtxPtr ctx)
+{
+    gdImagePtr im;
+    char *data;
+    int size;
+
+    if(!(data = read_whole_ctx(ctx, &size)))
+        return NULL;
+    im = xpm_from_ptr(size, data);
+    free(data);
+    return im;
+}
+#endif
+
+/*
+** Table of file types understood to gd "constructors"
+*/
+
+static struct {
+    char *ext;
+    gdImagePtr (*func)(FILE*);
+
+} ext_table[] = {
+
+#ifdef HAVE_LIBGIF
+    {"gif",  gdImageCreateFromGif},
+#endif
+#ifdef HAVE_LIBPNG
+    {"png",  gdImageCreateFromPng},
+#endif
+#ifdef HAVE_LIBJPEG
+    {"jpeg", gdImageCreateFromJpeg},
+    {"jpg",  gdImageCreateFromJpeg},
+    {"jfif", gdImageCreateFromJpeg},
+#endif
+    {"gd",   gdImageCreateFromGd},
+    {"gd2",  gdImageCreateFromGd2},
+    {"wbmp", gdImageCreateFromWBMP},
+    {"xbm",  gdImageCreateFromXbm}, /* this is internal to gd */
+
+    {NULL, NULL}
+};
+
+static struct {
+    char *ext;
+    gdImagePtr (*func)(gdIOCtxPtr);
+
+} ext_table_ctx[] = {
+
+#ifdef HAVE_LIBGIF
+    {"gif",  gdImageCreateFromGifCtx},
+#endif
+#ifdef HAVE_LIBPNG
+    {"png",  gdImageCreateFromPngCtx},
+#endif
+#ifdef HAVE_LIBJPEG
+    {"jpeg", gdImageCreateFromJpegCtx},
+    {"jpg",  gdImageCreateFromJpegCtx},
+    {"jfif", gdImageCreateFromJpegCtx},
+#endif
+    {"gd",   gdImageCreateFromGdCtx},
+    {"gd2",  gdImageCreateFromGd2Ctx},
+    {"wbmp", gdImageCreateFromWBMPCtx},
+    {"xbm",  xbm_from_ctx},
+#ifdef HAVE_LIBXPM
+    {"xpm",  xpm_from_ctx},
+#endif
+
+    {NULL, NULL}
+};
+
+#ifdef HAVE_LIBJPEG
+/*
+** Reduced size JPEG decoding.  libjpeg can produce the image at 1/2,
+** 1/4 or 1/8 of its size as part of the inverse DCT, which is much
+** cheaper than decoding it whole and then shrinking it, and needs only
+** a fraction of the memory.  gd gives us no way to ask for this, so
+** the image is decoded here, converting to a truecolor image the same
+** way gd does.
+*/
+
+struct jpeg_scaled_error {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+};
+
+static void jpeg_scaled_error_exit(j_common_ptr cinfo)
+{
+    longjmp(((struct jpeg_scaled_error *)cinfo->err)->jmp, 1);
+}
+
+static void jpeg_scaled_output_message(j_common_ptr cinfo)
+{
+    /* warnings about damaged data are not reported, as with gd */
+}
+
+/* source manager for data held in memory */
+
+static void jpeg_mem_init(j_decompress_ptr cinfo)
+{
+}
+
+static boolean jpeg_mem_fill(j_decompress_ptr cinfo)
+{
+    static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+
+    /* the data is truncated; end the image here */
+    cinfo->src->next_input_byte = eoi;
+    cinfo->src->bytes_in_buffer = 2;
+    return TRUE;
+}
+
+static void jpeg_mem_skip(j_decompress_ptr cinfo, long n)
+{
+    struct jpeg_source_mgr *src = cinfo->src;
+
+    if(n <= 0)
+        return;
+    if((size_t)n > src->bytes_in_buffer) {
+        jpeg_mem_fill(cinfo);
+        return;
+    }
+    src->next_input_byte += n;
+    src->bytes_in_buffer -= n;
+}
+
+static void jpeg_mem_term(j_decompress_ptr cinfo)
+{
+}
+
+/* pick the smallest scale at which the image can still be reduced to
+ * fit a maxw x maxh box without being enlarged */
+
+static int jpeg_fit_denom(int sx, int sy, int maxw, int maxh)
+{
+    int denom;
+
+    for(denom = 8; denom > 1; denom /= 2)
+        if(denom * maxw <= sx || denom * maxh <= sy)
+            break;
+    return denom;
+}
+
+/* decode len bytes of JPEG data at 1/denom scale (1, 2, 4 or 8), or if
+ * denom is 0 at the scale chosen by jpeg_fit_denom.  may be called
+ * without the GIL. */
+
+static gdImagePtr jpeg_scaled_from_ptr(const void *data, size_t len,
+    int denom, int maxw, int maxh)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_scaled_error jerr;
+    struct jpeg_source_mgr src;
+    gdImagePtr volatile im = NULL;
+    JSAMPROW volatile row = NULL;
+    JSAMPROW r;
+    int x, y, *tpix, inverted;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_scaled_error_exit;
+    jerr.pub.output_message = jpeg_scaled_output_message;
+
+    if(setjmp(jerr.jmp)) {
+        jpeg_destroy_decompress(&cinfo);
+        if(row)
+            free(row);
+        if(im)
+            gdImageDestroy(im);
+        return NULL;
+    }
+
+    jpeg_create_decompress(&cinfo);
+
+    src.next_input_byte = (const JOCTET *)data;
+    src.bytes_in_buffer = len;
+    src.init_source = jpeg_mem_init;
+    src.fill_input_buffer = jpeg_mem_fill;
+    src.skip_input_data = jpeg_mem_skip;
+    src.resync_to_restart = jpeg_resync_to_restart;
+    src.term_source = jpeg_mem_term;
+    cinfo.src = &src;
+
+    /* gd uses the Adobe marker to tell how CMYK data is stored */
+    jpeg_save_markers(&cinfo, JPEG_APP0 + 14, 256);
+    if(jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK)
+        longjmp(jerr.jmp, 1);
+
+    if(!denom)
+        denom = jpeg_fit_denom(cinfo.image_width, cinfo.image_height, maxw, maxh);
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = denom;
+
+    if(cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK)
+        cinfo.out_color_space = JCS_CMYK;
+    else
+        cinfo.out_color_space = JCS_RGB;
+    inverted = cinfo.saw_Adobe_marker;
+
+    jpeg_start_decompress(&cinfo);
+
+    if(!(im = gdImageCreateTrueColor(cinfo.output_width, cinfo.output_height)))
+        longjmp(jerr.jmp, 1);
+    gdImageInterlace(im, cinfo.progressive_mode != 0);
+    if(!(row = malloc(cinfo.output_width * cinfo.output_components)))
+        longjmp(jerr.jmp, 1);
+
+    for(y = 0; y < (int)cinfo.output_height; y++) {
+        r = row;
+        if(jpeg_read_scanlines(&cinfo, &r, 1) != 1)
+            longjmp(jerr.jmp, 1);
+        tpix = im->tpixels[y];
+        if(cinfo.out_color_space == JCS_RGB) {
+            for(x = 0; x < (int)cinfo.output_width; x++, r += 3)
+                tpix[x] = gdTrueColor(r[0], r[1], r[2]);
+        } else {
+            for(x = 0; x < (int)cinfo.output_width; x++, r += 4) {
+                int c = r[0], m = r[1], yy = r[2], k = r[3];
+
+                if(inverted) {
+                    c = 255 - c;
+                    m = 255 - m;
+                    yy = 255 - yy;
+                    k = 255 - k;
+                }
+                tpix[x] = gdTrueColor((255 - c) * (255 - k) / 255,
+                    (255 - m) * (255 - k) / 255, (255 - yy) * (255 - k) / 255);
+            }
+        }
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    free(row);
+    return im;
+}
+#endif
+
+/* decoders which read straight out of a block of memory; used for
+ * objects supporting the buffer interface */
+
+static struct {
+    char *ext;
+    gdImagePtr (*func)(int, void *);
+
+} ext_table_ptr[] = {
+
+#ifdef HAVE_LIBGIF
+    {"gif",  gdImageCreateFromGifPtr},
+#endif
+#ifdef HAVE_LIBPNG
+    {"png",  gdImageCreateFromPngPtr},
+#endif
+#ifdef HAVE_LIBJPEG
+    {"jpeg", gdImageCreateFromJpegPtr},
+    {"jpg",  gdImageCreateFromJpegPtr},
+    {"jfif", gdImageCreateFromJpegPtr},
+#endif
+    {"gd",   gdImageCreateFromGdPtr},
+    {"gd2",  gdImageCreateFromGd2Ptr},
+    {"wbmp", gdImageCreateFromWBMPPtr},
+    {"xbm",  xbm_from_ptr},
+#ifdef HAVE_LIBXPM
+    {"xpm",  xpm_from_ptr},
+#endif
+
+    {NULL, NULL}
+};
+
+
+/*
+** Code to act as a gdIOCtx wrapper for a python file object
+** (read-only; see PyFileWriteObj_gdIOCtx for writing)
+**
+** Data is read ahead in blocks of READ_CHUNK bytes, using readinto()
+** when the object has one and read() otherwise, and gd is served out
+** of that block.  What gd leaves unread is given back with seek() when
+** we are done, so a stream without a working seek() and tell() is only
+** ever asked for as much as gd wants.  gd calls these with the GIL
+** released (see newimageobject), so the GIL is only taken back to
+** refill the block.
+*/
+
+#define READ_CHUNK 65536
+
+struct PyFileIfaceObj_gdIOCtx {
+    gdIOCtx ctx;
+    PyObject *fileIfaceObj;
+    PyObject *bufObj;        // bytearray holding the block read ahead
+    PyObject *view;          // memoryview of it, for short readinto()s
+    char *buf;               // its contents
+    int len, off;            // bytes in buf, bytes already handed to gd
+    long base;               // position of the stream when we started
+    long bufpos;             // position of buf[0], relative to base
+    int use_readinto, seekable, eof;
+};
+
+/* read the next block, or just the want bytes gd asked for if what's
+ * left over can't be given back; the GIL must be held.  returns the
+ * length read. */
+
+static int PyFileIfaceObj_IOCtx_Fill(struct PyFileIfaceObj_gdIOCtx *pctx, int want)
+{
+    PyObject *rv, *target;
+    Py_ssize_t n = 0;
+    char *value;
+
+    pctx->bufpos += pctx->len;
+    pctx->len = pctx->off = 0;
+    if (pctx->eof)
+        return 0;
+
+    if (pctx->seekable || want > READ_CHUNK)
+        want = READ_CHUNK;
+    if (pctx->use_readinto && (want == READ_CHUNK || pctx->view)) {
+        if (want == READ_CHUNK) {
+            target = pctx->bufObj;
+            Py_INCREF(target);
+        } else {
+            target = PySequence_GetSlice(pctx->view, 0, want);
+        }
+        rv = target ? PyObject_CallMethod(pctx->fileIfaceObj, "readinto",
+            "(O)", target) : NULL;
+        Py_XDECREF(target);
+        if (rv && rv != Py_None)
+            n = PyNumber_AsSsize_t(rv, NULL);
+    } else {
+        rv = PyObject_CallMethod(pctx->fileIfaceObj, "read", "i", want);
+        if (rv && PyString_AsStringAndSize(rv, &value, &n) == 0)
+            memcpy(pctx->buf, value, MIN(n, want));
+    }
+    Py_XDECREF(rv);
+
+    /* as before, the python exception is thrown away since the gd
+     * library won't pass it up; gd sees a short read instead. */
+    if (PyErr_Occurred()) {
+        PyErr_Clear();
+        n = 0;
+    }
+    if (n <= 0) {
+        pctx->eof = 1;
+        n = 0;
+    }
+    pctx->len = (int)MIN(n, want);
+    return pctx->len;
+}
+
+int PyFileIfaceObj_IOCtx_GetC(gdIOCtx *ctx)
+{
+    struct PyFileIfaceObj_gdIOCtx *pctx = (struct PyFileIfaceObj_gdIOCtx *)ctx;
+    PyGILState_STATE gstate;
+
+    if (pctx->off == pctx->len) {
+        gstate = PyGILState_Ensure();
+        PyFileIfaceObj_IOCtx_Fill(pctx, 1);
+        PyGILState_Release(gstate);
+        if (pctx->len == 0)
+            return EOF;
+    }
+    return (int)(unsigned char)pctx->buf[pctx->off++];
+}
+
+int PyFileIfaceObj_IOCtx_GetBuf(gdIOCtx *ctx, void *data, int size)
+{
+    struct PyFileIfaceObj_gdIOCtx *pctx = (struct PyFileIfaceObj_gdIOCtx *)ctx;
+    PyGILState_STATE gstate;
+    int n, got = 0, have_gil = 0;
+
+    while (got < size) {
+        if (pctx->off == pctx->len) {
+            if (!have_gil) {
+                gstate = PyGILState_Ensure();
+                have_gil = 1;
+            }
+            if (!PyFileIfaceObj_IOCtx_Fill(pctx, size - got))
+                break;
+        }
+        n = MIN(size - got, pctx->len - pctx->off);
+        memcpy((char *)data + got, pctx->buf + pctx->off, n);
+        pctx->off += n;
+        got += n;
+    }
+    if (have_gil)
+        PyGILState_Release(gstate);
+    return got;
+}
+
+int PyFileIfaceObj_IOCtx_Seek(gdIOCtx *ctx, const int pos)
+{
+    struct PyFileIfaceObj_gdIOCtx *pctx = (struct PyFileIfaceObj_gdIOCtx *)ctx;
+    PyGILState_STATE gstate;
+    PyObject *rv;
+
+    /* the gd2 readers mostly seek within the block we already have */
+    if (pos >= pctx->bufpos && pos <= pctx->bufpos + pctx->len) {
+        pctx->off = pos - pctx->bufpos;
+        return 1;
+    }
+
+    gstate = PyGILState_Ensure();
+    rv = PyObject_CallMethod(pctx->fileIfaceObj, "seek", "l", pctx->base + pos);
+    if (rv) {
+        Py_DECREF(rv);
+        pctx->bufpos = pos;
+        pctx->len = pctx->off = 0;
+        pctx->eof = 0;
+    } else {
+        PyErr_Clear();
+    }
+    PyGILState_Release(gstate);
+    return rv != NULL;
+}
+
+long PyFileIfaceObj_IOCtx_Tell(gdIOCtx *ctx)
+{
+    struct PyFileIfaceObj_gdIOCtx *pctx = (struct PyFileIfaceObj_gdIOCtx *)ctx;
+
+    return pctx->bufpos + pctx->off;
+}
+
+void PyFileIfaceObj_IOCtx_Free(gdIOCtx *ctx)
+{
+    struct PyFileIfaceObj_gdIOCtx *pctx = (struct PyFileIfaceObj_gdIOCtx *)ctx;
+    PyGILState_STATE gstate;
+    PyObject *rv;
+
+    gstate = PyGILState_Ensure();
+    if (pctx->fileIfaceObj && pctx->seekable && pctx->off < pctx->len) {
+        /* give back what we read ahead but gd didn't use, so that
+         * whatever follows the image in the stream can still be read */
+        rv = PyObject_CallMethod(pctx->fileIfaceObj, "seek", "l",
+            pctx->base + pctx->bufpos + pctx->off);
+        if (rv) {
+            Py_DECREF(rv);
+        } else {
+            PyErr_Clear();
+        }
+        pctx->len = pctx->off = 0;
+    }
+    Py_CLEAR(pctx->view);
+    Py_CLEAR(pctx->bufObj);
+    Py_CLEAR(pctx->fileIfaceObj);
+    PyGILState_Release(gstate);
+    /* NOTE: we leave deallocation of the ctx structure itself to outside
+     * code for memory allocation symmetry.  This function is safe to
+     * call multiple times (gd should call it + we call it to be safe). */
+}
+
+struct PyFileIfaceObj_gdIOCtx * alloc_PyFileIfaceObj_IOCtx(PyObject *fileIfaceObj)
+{
+    struct PyFileIfaceObj_gdIOCtx *pctx;
+    PyObject *rv;
+
+    pctx = calloc(1, sizeof(struct PyFileIfaceObj_gdIOCtx));
+    if (!pctx)
+        return NULL;
+    if (!(pctx->bufObj = PyByteArray_FromStringAndSize(NULL, READ_CHUNK))) {
+        PyErr_Clear();
+        free(pctx);
+        return NULL;
+    }
+    pctx->buf = PyByteArray_AS_STRING(pctx->bufObj);
+    pctx->use_readinto = PyObject_HasAttrString(fileIfaceObj, "readinto");
+
+    /* gd's seek positions count from the start of the image, which
+     * need not be the start of the stream.  a tell() that works on a
+     * stream with a seek() that doesn't say otherwise means whatever is
+     * read ahead can be given back. */
+    if (PyObject_HasAttrString(fileIfaceObj, "tell")) {
+        if ((rv = PyObject_CallMethod(fileIfaceObj, "tell", NULL))) {
+            pctx->base = PyInt_AsLong(rv);
+            Py_DECREF(rv);
+            pctx->seekable = PyObject_HasAttrString(fileIfaceObj, "seek");
+        }
+        if (PyErr_Occurred()) {
+            PyErr_Clear();
+            pctx->base = 0;
+            pctx->seekable = 0;
+        }
+    }
+    if (pctx->seekable && PyObject_HasAttrString(fileIfaceObj, "seekable")) {
+        if ((rv = PyObject_CallMethod(fileIfaceObj, "seekable", NULL))) {
+            pctx->seekable = PyObject_IsTrue(rv) == 1;
+            Py_DECREF(rv);
+        }
+        if (PyErr_Occurred()) {
+            PyErr_Clear();
+            pctx->seekable = 0;
+        }
+    }
+    if (!pctx->seekable && pctx->use_readinto
+    && !(pctx->view = PyMemoryView_FromObject(pctx->bufObj)))
+        PyErr_Clear();              /* short reads will use read() */
+
+    pctx->ctx.getC = PyFileIfaceObj_IOCtx_GetC; 
+    pctx->ctx.getBuf = PyFileIfaceObj_IOCtx_GetBuf;
+    pctx->ctx.seek = PyFileIfaceObj_IOCtx_Seek;
+    pctx->ctx.tell = PyFileIfaceObj_IOCtx_Tell;
+    pctx->ctx.gd_free = PyFileIfaceObj_IOCtx_Free;
+    Py_INCREF(fileIfaceObj);
+    pctx->fileIfaceObj = fileIfaceObj;
+    return pctx;
+}
+
+void free_PyFileIfaceObj_IOCtx(struct PyFileIfaceObj_gdIOCtx *pctx)
+{
+    if (!pctx)
+        return;
+    assert(pctx->ctx.gd_free != NULL);
+    pctx->ctx.gd_free((gdIOCtxPtr)pctx);  // free its internal resources
+    free(pctx);
+}
+/*
+** Objects with only the old buffer interface (array.array, mmap) can't
+** be held while the GIL is let go of: nothing stops them from being
+** resized or closed in the meantime.  buffer_copy() takes a copy of
+** their data for the caller to free, or returns NULL with an exception
+** set.
+*/
+
+#define HAS_BUFFER(obj) (PyObject_CheckBuffer(obj) || PyObject_CheckReadBuffer(obj))
+
+static char *buffer_copy(PyObject *obj, Py_ssize_t *len)
+{
+    const void *p;
+    char *copy;
+
+    if(PyObject_AsReadBuffer(obj, &p, len) < 0)
+        return NULL;
+    if(!(copy = malloc(*len ? *len : 1)))
+        return (char *)PyErr_NoMemory();
+    memcpy(copy, p, *len);
+    return copy;
+}
+
+/*
+** Decode an image held in an object supporting the buffer interface
+** (str, bytearray, memoryview, array, mmap...).  gd reads new style
+** buffers in place; the buffer is held for the duration, so it can't
+** be resized or freed while the GIL is released.  Old style buffers
+** are copied first.  Returns 0 with an exception set on failure.
+*/
+
+static int decode_buffer(imageobject *self, PyObject *bufObj, char *ext)
+{
+    Py_buffer view;
+    char *copy = NULL;
+    void *buf;
+    Py_ssize_t len;
+    int i;
+
+    if(!ext) {
+        PyErr_SetString(PyExc_ValueError,
+            "image type required when reading from a buffer");
+        return 0;
+    }
+
+    for(i = 0; ext_table_ptr[i].ext != NULL; i++)
+        if(strcmp(ext, ext_table_ptr[i].ext) == 0)
+            break;
+
+    if(ext_table_ptr[i].ext == NULL) {
+        PyErr_SetString(PyExc_IOError,
+            "unsupported file type (only gif, png, jpeg, gd, gd2, wbmp, xbm & xpm can be read from a buffer)");
+        return 0;
+    }
+
+    if(PyObject_CheckBuffer(bufObj)) {
+        if(PyObject_GetBuffer(bufObj, &view, PyBUF_SIMPLE) < 0)
+            return 0;
+        buf = view.buf;
+        len = view.len;
+    } else if(!(buf = copy = buffer_copy(bufObj, &len))) {
+        return 0;
+    }
+
+    if(len <= INT_MAX) {
+        Py_BEGIN_ALLOW_THREADS
+        self->imagedata = ext_table_ptr[i].func((int)len, buf);
+        Py_END_ALLOW_THREADS
+    }
+
+    if(copy)
+        free(copy);
+    else
+        PyBuffer_Release(&view);
+
+    if(len > INT_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "image data too large");
+        return 0;
+    }
+
+    if(!self->imagedata) {
+        PyErr_SetString(PyExc_IOError,
+            "corrupt or invalid image data (may be unsupported)");
+        return 0;
+    }
+
+    return 1;
+}
+
+#ifdef HAVE_MMAP
+/*
+** Map a whole file into memory for one of the ext_table_ptr readers.
+** Returns NULL if the file can't be mapped (not a regular file, empty,
+** too big for gd, ...); the caller then falls back to stdio, which
+** also takes care of reporting open errors.  Must not be called with
+** the GIL held.
+*/
+
+static void *map_file(char *filename, size_t *len)
+{
+    struct stat st;
+    void *p;
+    int fd;
+
+    if((fd = open(filename, O_RDONLY)) < 0)
+        return NULL;
+    if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)
+    || st.st_size == 0 || st.st_size > INT_MAX) {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED)
+        return NULL;
+#ifdef MADV_SEQUENTIAL
+    madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+    *len = (size_t)st.st_size;
+    return p;
+}
+#endif
+
+/*
+** Code to create the imageobject
+*/
+
+static imageobject *allocimageobject(void)
+{
+    imageobject *self;
+
+    if(!(self = PyObject_NEW(imageobject, &Imagetype)))
+        return NULL;
+
+    self->current_tile = self->current_brush = NULL;
+    self->writer = 0;
+    self->origin_x = self->origin_y = 0;
+    self->multiplier_x = self->multiplier_y = 1;
+    self->imagedata = NULL;
+
+    if(!(self->lock = PyThread_allocate_lock())) {
+        PyErr_NoMemory();
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    return self;
+}
+
+/*
+** image(src, (w,h)[, trueColor], resample=1): src resized by
+** resampling rather than by picking the nearest pixels.  Nothing is
+** under the copy, so its alpha channel is kept as it is.
+*/
+
+static imageobject *resampledimage(PyObject *args)
+{
+    imageobject *self, *src;
+    int w, h, trueColor = 0, blending;
+
+    if(!PyArg_ParseTuple(args, "O!(ii)|i", &Imagetype, &src, &w, &h, &trueColor)
+            || !image_check(src))
+        return NULL;
+    if(w < 1 || h < 1) {
+        PyErr_SetString(PyExc_ValueError, "dimensions must be positive");
+        return NULL;
+    }
+    if(!(self = allocimageobject()))
+        return NULL;
+    if(!(self->imagedata = trueColor ? gdImageCreateTrueColor(w, h) : gdImageCreate(w, h))) {
+        Py_DECREF(self);
+        return (imageobject *)PyErr_NoMemory();
+    }
+
+    blending = self->imagedata->alphaBlendingFlag;
+    gdImageAlphaBlending(self->imagedata, 0);
+    UNLOCKED(src, resample_copy(self->imagedata, src->imagedata, 0, 0, 0, 0, w, h,
+                                gdImageSX(src->imagedata), gdImageSY(src->imagedata)));
+    gdImageAlphaBlending(self->imagedata, blending);
+    return self;
+}
+
+#ifdef HAVE_LIBJPEG
+static int is_jpeg_ext(char *ext)
+{
+    return strcmp(ext, "jpeg") == 0 || strcmp(ext, "jpg") == 0
+        || strcmp(ext, "jfif") == 0;
+}
+
+/*
+** The scale/max_size form of the image constructor: the JPEG image is
+** read from a filename, a buffer or an object with a read() method,
+** much as in newimageobject, and decoded reduced.
+*/
+
+static imageobject *newjpegimage(PyObject *args, int denom, int maxw, int maxh)
+{
+    imageobject *self;
+    PyObject *srcObj;
+    char *filename = NULL, *ext = NULL, *data = NULL;
+    size_t len = 0;
+    int size;
+
+    if(!PyArg_ParseTuple(args, "O|z", &srcObj, &ext))
+        return NULL;
+
+    if(PyString_Check(srcObj)) {
+        filename = PyString_AsString(srcObj);
+        if(!ext && (ext = strrchr(filename, '.')))
+            ext++;
+    }
+    if(!ext || !is_jpeg_ext(ext)) {
+        PyErr_SetString(PyExc_ValueError,
+            "scale and max_size can only be used with JPEG images");
+        return NULL;
+    }
+
+    if(!(self = allocimageobject()))
+        return NULL;
+
+    if(filename) {
+        FILE *fp = NULL;
+        int mapped = 0;
+
+        Py_BEGIN_ALLOW_THREADS
+#ifdef HAVE_MMAP
+        if((data = map_file(filename, &len)) != NULL)
+            mapped = 1;
+        else
+#endif
+        if((fp = fopen(filename, "rb")) != NULL) {
+            gdIOCtxPtr ctx = gdNewFileCtx(fp);
+
+            if(ctx) {
+                if((data = read_whole_ctx(ctx, &size)))
+                    len = size;
+                ctx->gd_free(ctx);
+            }
+            fclose(fp);
+        }
+        if(data)
+            self->imagedata = jpeg_scaled_from_ptr(data, len, denom, maxw, maxh);
+#ifdef HAVE_MMAP
+        if(mapped)
+            munmap(data, len);
+        else
+#endif
+        free(data);
+        Py_END_ALLOW_THREADS
+
+        if(!mapped && !fp) {
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError, filename);
+            Py_DECREF(self);
+            return NULL;
+        }
+    } else if(PyObject_CheckBuffer(srcObj)) {
+        Py_buffer view;
+
+        if(PyObject_GetBuffer(srcObj, &view, PyBUF_SIMPLE) < 0) {
+            Py_DECREF(self);
+            return NULL;
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        self->imagedata = jpeg_scaled_from_ptr(view.buf, view.len, denom, maxw, maxh);
+        Py_END_ALLOW_THREADS
+
+        PyBuffer_Release(&view);
+    } else if(PyObject_CheckReadBuffer(srcObj)) {
+        Py_ssize_t n;
+
+        if(!(data = buffer_copy(srcObj, &n))) {
+            Py_DECREF(self);
+            return NULL;
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        self->imagedata = jpeg_scaled_from_ptr(data, n, denom, maxw, maxh);
+        free(data);
+        Py_END_ALLOW_THREADS
+    } else if(PyObject_HasAttrString(srcObj, "read")) {
+        struct PyFileIfaceObj_gdIOCtx *ourIOCtx;
+
+        if(!(ourIOCtx = alloc_PyFileIfaceObj_IOCtx(srcObj))) {
+            Py_DECREF(self);
+            return (imageobject *)PyErr_NoMemory();
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        if((data = read_whole_ctx((gdIOCtxPtr)ourIOCtx, &size))) {
+            self->imagedata = jpeg_scaled_from_ptr(data, size, denom, maxw, maxh);
+            free(data);
+        }
+        Py_END_ALLOW_THREADS
+
+        free_PyFileIfaceObj_IOCtx(ourIOCtx);
+    } else {
+        PyErr_SetString(ErrorObject, "non-Image objects must have a read() method or support the buffer interface");
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    if(!self->imagedata) {
+        PyErr_SetString(PyExc_IOError, "corrupt or invalid image data");
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    return self;
+}
+#endif
+
+static imageobject *newimageobject(PyObject *args)
+{
+    imageobject *self, *srcimage;
+    int xdim=0, ydim=0, i, trueColor=0;
+    char *filename,*ext=0;
+    FILE *fp;
+    PyObject *readObj;
+
+    if(!(self = allocimageobject()))
+        return NULL;
+
+    if(PyArg_ParseTuple(args, "")) {
+        PyErr_SetString(PyExc_ValueError, 
+            "image size or source filename required");
+        Py_DECREF(self);
+        return NULL;
+    } else if(PyErr_Clear(), 
+        PyArg_ParseTuple(args, "O!|(ii)i", 
+            &Imagetype, &srcimage, &xdim, &ydim, &trueColor)) 
+    {
+        if(!image_check(srcimage)) {
+            Py_DECREF(self);
+            return NULL;
+        }
+        if(!xdim) xdim = gdImageSX(srcimage->imagedata);
+        if(!ydim) ydim = gdImageSY(srcimage->imagedata);
+#if GD2_VERS <= 1
+        trueColor = 0;
+#endif
+        if (!trueColor){
+            if(!(self->imagedata = gdImageCreate(xdim,ydim))) {
+                Py_DECREF(self);
+                return NULL;
+            }
+        }
+#if GD2_VERS > 1
+        else
+            if(!(self->imagedata = gdImageCreateTrueColor(xdim,ydim))) {
+                Py_DECREF(self);
+                return NULL;
+            }
+#endif
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(srcimage->lock, WAIT_LOCK);
+        if(xdim == gdImageSX(srcimage->imagedata) &&
+            ydim == gdImageSY(srcimage->imagedata))
+            gdImageCopy(self->imagedata,srcimage->imagedata,0,0,0,0,xdim,ydim);
+        else
+            gdImageCopyResized(self->imagedata,srcimage->imagedata,
+                0,0,0,0,xdim,ydim,gdImageSX(srcimage->imagedata),
+                gdImageSY(srcimage->imagedata));
+        PyThread_release_lock(srcimage->lock);
+        Py_END_ALLOW_THREADS
+    } else if(PyErr_Clear(), 
+        PyArg_ParseTuple(args, "(ii)|i", &xdim, &ydim, &trueColor)) 
+    {
+        if(!xdim || !ydim) {
+            PyErr_SetString(PyExc_ValueError, "dimensions cannot be 0");
+            Py_DECREF(self);
+            return NULL;
+        } 
+#if GD2_VERS <= 1
+        trueColor = 0;
+#endif
+        if (!trueColor){
+            if(!(self->imagedata = gdImageCreate(xdim,ydim))) {
+                Py_DECREF(self);
+                return NULL;
+            }
+        }
+#if GD2_VERS > 1
+        else
+            if(!(self->imagedata = gdImageCreateTrueColor(xdim,ydim))) {
+                Py_DECREF(self);
+                return NULL;
+            }
+#endif
+    } else if(PyErr_Clear(), PyArg_ParseTuple(args, "s|s", &filename, &ext)) {
+
+        if(!ext) {
+            if(!(ext = strrchr(filename,'.'))) {
+                PyErr_SetString(PyExc_IOError,
+                    "need an extension to determine file type (.gif|.png|.jpeg|.jpg|.gd|.gd2|.wbmp|.xpm|.xbm)");
+                Py_DECREF(self);
+                return NULL;
+            }
+            ext++;
+        }
+
+        if(strcmp(ext, "xpm") == 0) {
+#ifndef HAVE_LIBXPM
+            PyErr_SetString(PyExc_NotImplementedError,
+                    "XPM Support Not Available");
+            Py_DECREF(self);
+            return NULL;
+#else
+            /* gdImageCreateFromXpm takes a filename rather than a FILE * */
+
+            Py_BEGIN_ALLOW_THREADS
+            self->imagedata = gdImageCreateFromXpm(filename);
+            Py_END_ALLOW_THREADS
+
+            if(!self->imagedata) {
+                PyErr_SetString(PyExc_IOError, "corrupt or invalid image file");
+                Py_DECREF(self);
+                return(NULL);
+            }
+
+            return self;
+#endif
+        }
+
+#ifdef HAVE_MMAP
+        /* decode straight out of the page cache where gd has a reader
+         * for memory; pages are shared with anyone else mapping or
+         * reading the same file */
+        for(i = 0; ext_table_ptr[i].ext != NULL; i++) {
+
+            if(strcmp(ext, ext_table_ptr[i].ext) == 0) {
+                void *map;
+                size_t len;
+                int mapped;
+
+                Py_BEGIN_ALLOW_THREADS
+                if((mapped = (map = map_file(filename, &len)) != NULL)) {
+                    self->imagedata = ext_table_ptr[i].func((int)len, map);
+                    munmap(map, len);
+                }
+                Py_END_ALLOW_THREADS
+
+                if(!mapped)
+                    break;
+
+                if(!self->imagedata) {
+                    PyErr_SetString(PyExc_IOError,
+                        "corrupt or invalid image file (may be unsupported)");
+                    Py_DECREF(self);
+                    return(NULL);
+                }
+
+                return self;
+            }
+        }
+#endif
+
+        if(!(fp = fopen(filename,"rb"))) {
+            PyErr_SetFromErrno(PyExc_IOError);
+            Py_DECREF(self);
+            return(NULL);
+        }
+
+        for(i = 0; ext_table[i].ext != NULL; i++) {
+
+            if(strcmp(ext, ext_table[i].ext) == 0) {
+
+                Py_BEGIN_ALLOW_THREADS
+                self->imagedata = ext_table[i].func(fp);
+                Py_END_ALLOW_THREADS
+
+                if(!self->imagedata) {
+                    fclose(fp);
+                    PyErr_SetString(PyExc_IOError,
+                        "corrupt or invalid image file (may be unsupported)");
+                    Py_DECREF(self);
+                    return(NULL);
+                }
+
+                fclose(fp);
+                return self;
+            }
+        }
+
+        /* if we fall out, we didn't find the file type */
+
+        PyErr_SetString(PyExc_IOError,
+            "unsupported file type (only .gif|.png|.jpeg|.jpg|.gd|.gd2|.wbmp|.xbm|.xpm accepted)");
+
+        Py_DECREF(self);
+        return(NULL);
+
+    } else if(PyErr_Clear(), 
+        PyArg_ParseTuple(args, "Oz", &readObj, &ext)) 
+    {
+        struct PyFileIfaceObj_gdIOCtx *ourIOCtx = NULL;
+
+        /* array.array and mmap also have a read() method */
+        if (HAS_BUFFER(readObj)) {
+            if (!decode_buffer(self, readObj, ext)) {
+                Py_DECREF(self);
+                return NULL;
+            }
+            return self;
+        }
+        if (!PyObject_HasAttrString(readObj, "read")) {
+            PyErr_SetString(ErrorObject, "non-Image objects must have a read() method or support the buffer interface");
+            Py_DECREF(self);
+            return NULL;
+        }
+
+        ourIOCtx = alloc_PyFileIfaceObj_IOCtx(readObj);
+        if (!ourIOCtx) {
+            PyErr_NoMemory();
+            Py_DECREF(self);
+            return(NULL);
+        }
+
+        for(i = 0; ext_table_ctx[i].ext != NULL; i++) {
+
+            if(strcmp(ext, ext_table_ctx[i].ext) == 0) {
+
+                /* the IOCtx callbacks take the GIL back when they
+                 * need to call read() */
+                Py_BEGIN_ALLOW_THREADS
+                self->imagedata = ext_table_ctx[i].func((gdIOCtxPtr)ourIOCtx);
+                Py_END_ALLOW_THREADS
+
+                if(!self->imagedata) {
+                    free_PyFileIfaceObj_IOCtx(ourIOCtx);
+                    PyErr_SetString(PyExc_IOError,
+                        "corrupt or invalid image data (may be unsupported)");
+                    Py_DECREF(self);
+                    return(NULL);
+                }
+
+                free_PyFileIfaceObj_IOCtx(ourIOCtx);
+                return self;
+            }
+        }
+
+        /* if we fall out, we didn't find the file type */
+
+        PyErr_SetString(PyExc_IOError,
+            "unsupported file type (only gif, png, jpeg, gd, gd2, wbmp, xbm & xpm can be read from an object)");
+
+        free_PyFileIfaceObj_IOCtx(ourIOCtx);
+
+        Py_DECREF(self);
+        return(NULL);
+    } else {
+        PyErr_SetString(PyExc_ValueError, "invalid argument list");
+        Py_DECREF(self);
+        return(NULL);
+    }
+
+    return self;
+}
+
+
+static void image_dealloc(imageobject *self)
+{
+    if(self->current_brush) {
+        Py_DECREF(self->current_brush);
+    }
+
+    if(self->current_tile) {
+        Py_DECREF(self->current_tile);
+    }
+
+    if(self->imagedata) gdImageDestroy(self->imagedata);
+
+    if(self->lock) PyThread_free_lock(self->lock);
+
+    PyObject_DEL(self);
+}
+
+
+static PyObject *image_getattr(PyObject *self, char *name)
+{
+    if(!image_check((imageobject *)self))
+        return NULL;
+    if(strcmp(name, "__array_interface__") == 0)
+        return image_array_interface((imageobject *)self);
+    return Py_FindMethod(image_methods, self, name);
+}
+
+
+static PyObject *image_print(PyObject *self, FILE *fp, int flags)
+{
+    gdImagePtr im;
+
+    im = ((imageobject *)self)->imagedata;
+    fprintf(fp,"<%dx%d image object at 0x%lx>",gdImageSX(im),gdImageSY(im),
+      (unsigned long)self);
+    return 0;
+}
+
+
+static PyTypeObject Imagetype = {
+    PyObject_HEAD_INIT(NULL)
+    0,                                  /*ob_size*/
+    "image",                            /*tp_name*/
+    sizeof(imageobject),                /*tp_basicsize*/
+    0,                                  /*tp_itemsize*/
+    /* methods */
+    (destructor)image_dealloc,          /*tp_dealloc*/
+    (printfunc)image_print,             /*tp_print*/
+    (getattrfunc)image_getattr,         /*tp_getattr*/
+    0,                                  /*tp_setattr*/
+    0,                                  /*tp_compare*/
+    0,                                  /*tp_repr*/
+    0,                                  /*tp_as_number*/
+    0,                                  /*tp_as_sequence*/
+    0,                                  /*tp_as_mapping*/
+    0,                                  /*tp_hash*/
+    0,                                  /*tp_call */
+    0,                                  /*tp_str */
+    0,                                  /*tp_getattro */
+    0,                                  /*tp_setattro */
+    &image_as_buffer,                   /*tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags */
+};
+
+
+static PyObject *gd_image(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"scale", "max_size", "resample", NULL};
+    PyObject *empty, *sizeObj = NULL;
+    double scale = 0.0;
+    int denom, maxw = 0, maxh = 0, resample = 0, ok;
+
+    if(!kwds || PyDict_Size(kwds) == 0)
+        return (PyObject *)newimageobject(args);
+
+    if(!(empty = PyTuple_New(0)))
+        return NULL;
+    ok = PyArg_ParseTupleAndKeywords(empty, kwds, "|dOi", kwlist,
+        &scale, &sizeObj, &resample);
+    Py_DECREF(empty);
+    if(!ok)
+        return NULL;
+
+    if(scale == 0.0 && !sizeObj)
+        return (PyObject *)(resample ? resampledimage(args) : newimageobject(args));
+    if(resample) {
+        PyErr_SetString(PyExc_ValueError, "resample is for resizing an image, not with scale or max_size");
+        return NULL;
+    }
+
+    if(scale != 0.0 && sizeObj) {
+        PyErr_SetString(PyExc_ValueError, "give scale or max_size, not both");
+        return NULL;
+    }
+
+    if(sizeObj) {
+        if(!PyTuple_Check(sizeObj)) {
+            PyErr_SetString(PyExc_TypeError, "max_size must be a (w,h) tuple");
+            return NULL;
+        }
+        if(!PyArg_ParseTuple(sizeObj, "ii", &maxw, &maxh))
+            return NULL;
+        if(maxw < 1 || maxh < 1) {
+            PyErr_SetString(PyExc_ValueError, "max_size must be positive");
+            return NULL;
+        }
+        denom = 0;
+    } else {
+        if(scale <= 0.0 || scale > 1.0) {
+            PyErr_SetString(PyExc_ValueError, "scale must be greater than 0 and at most 1");
+            return NULL;
+        }
+        /* the smallest of 1, 1/2, 1/4, 1/8 not below scale */
+        for(denom = 8; denom > 1; denom /= 2)
+            if(1.0 / denom >= scale - 1e-9)
+                break;
+    }
+
+#ifdef HAVE_LIBJPEG
+    return (PyObject *)newjpegimage(args, denom, maxw, maxh);
+#else
+    PyErr_SetString(PyExc_NotImplementedError, "JPEG Support Not Available");
+    return NULL;
+#endif
+}
+
+
+/*
+** Header probing.  Just enough of each format is parsed to find the
+** image type and size, so a caller can vet an image without decoding
+** it.  The header is read either from memory or from a file, through
+** probe_read(), which fetches n bytes at a given offset.
+*/
 
- {"colorTransparent",    (PyCFunction)image_colortransparent,    1,
-    "colorTransparent(color)\n"
-    "set the transparent color to color"},
+struct probe_src {
+    const unsigned char *buf;   /* data in memory, or */
+    Py_ssize_t len;
+    FILE *fp;                   /* an open file */
+};
 
- {"copyTo",    (PyCFunction)image_copyto,    1,
-    "copyTo(image[, (dx,dy)[, (sx,sy)[, (w,h)]]])\n"
-    "copy from (sx,sy), width sw and height sh to destination image (dx,dy)"},
+struct probe_info {
+    char *type;
+    int sx, sy, trueColor, chunkSize;
+};
 
- {"copyResizedTo",    (PyCFunction)image_copyresizedto,1,
-    "copyResizedTocopyTo(image[, (dx,dy)[, (sx,sy)[, (dw,dh)[, (sw,sh)]]]])\n"
-    "copy from (sx,sy), width sw and height sh to destination image (dx,dy), \n"
-    "width dw and height dh"},
+static int probe_read(struct probe_src *src, long off, unsigned char *dst, int n)
+{
+    if(src->fp) {
+        if(fseek(src->fp, off, SEEK_SET) != 0)
+            return 0;
+        return fread(dst, 1, n, src->fp) == (size_t)n;
+    }
+    if(off < 0 || off + n > src->len)
+        return 0;
+    memcpy(dst, src->buf + off, n);
+    return 1;
+}
 
- {"copyResampledTo",    (PyCFunction)image_copyresampledto,1,
-    "copyResampledTo(image[, (dx,dy)[, (sx,sy)[, (dw,dh)[, (sw,sh)]]]])\n"
-    "copy from (sx,sy), width sw and height sh to destination image (dx,dy), \n"
-    "width dw and height dh using smooth pixel interpolation."},
+#define BE16(p) (((p)[0] << 8) | (p)[1])
+#define BE32(p) (((p)[0] << 24) | ((p)[1] << 16) | ((p)[2] << 8) | (p)[3])
+#define LE16(p) (((p)[1] << 8) | (p)[0])
 
- {"copyMergeTo",    (PyCFunction)image_copymergeto,    1,
-    "copyMergeTo(image[, (dx,dy)[, (sx,sy)[, (w,h)]], pct])\n"
-    "copy from (sx,sy), width sw and height sh to destination image (dx,dy)\n"
-    "If pct is 100 then this is equivalent to copyTo().  If pct is less\n"
-    "than 100 the images are merged." },
+/* walk the JPEG markers up to the first start-of-frame */
 
- {"copyMergeGrayTo",    (PyCFunction)image_copymergegrayto,    1,
-    "copyMergeGrayTo(image[, (dx,dy)[, (sx,sy)[, (w,h)]], pct])\n"
-    "copy from (sx,sy), width sw and height sh to destination image (dx,dy)\n"
-    "If pct is 100 then this is equivalent to copyTo().  If pct is less\n"
-    "than 100 the images are merged.  The hue is preserved by first\n"
-    "converting the destination pixels to gray." },
+static int probe_jpeg(struct probe_src *src, struct probe_info *info)
+{
+    unsigned char h[9];
+    long off = 2;
+    int marker;
+
+    for(;;) {
+        if(!probe_read(src, off, h, 2) || h[0] != 0xFF)
+            return 0;
+        marker = h[1];
+        if(marker == 0xFF) {        /* fill byte */
+            off++;
+            continue;
+        }
+        if(marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            off += 2;               /* markers without a length */
+            continue;
+        }
+        if(marker == 0xD9 || marker == 0xDA)
+            return 0;               /* no frame header before the data */
+        if(!probe_read(src, off + 2, h, 7))
+            return 0;
+        if(marker >= 0xC0 && marker <= 0xCF
+        && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            info->type = "jpeg";
+            info->sy = BE16(h + 3);
+            info->sx = BE16(h + 5);
+            info->trueColor = 1;
+            return 1;
+        }
+        off += 2 + BE16(h);
+    }
+}
 
- {"copyPaletteTo", (PyCFunction)image_copypaletteto, 1,
-    "copyPaletteTo(image)\n"
-  "copy the palette from one image to another."},
+static int probe_header(struct probe_src *src, struct probe_info *info)
+{
+    unsigned char h[26];
 
- {"compare", (PyCFunction)image_compare, 1,
-    "compare(image)\n"
-  "compares this image with another.  Returns a bitmask whose values\n"
-  "are composed of CMP_IMAGE, CMP_NUM_COLORS, CMP_COLOR, CMP_SIZE_X,\n"
-  "CMP_SIZE_Y, CMP_TRANSPARENT, CMP_BACKGROUND, CMP_INTERLACE, CMP_TRUECOLOR"},
+    memset(h, 0, sizeof(h));
+    if(!probe_read(src, 0, h, 4))
+        return 0;
 
- {"interlace",    (PyCFunction)image_interlace,    1,
-    "interlace()\n"
-    "set the interlace bit"},
+    info->chunkSize = 0;
+
+    if(memcmp(h, "\x89PNG", 4) == 0) {
+        if(!probe_read(src, 0, h, 26) || memcmp(h + 12, "IHDR", 4) != 0)
+            return 0;
+        info->type = "png";
+        info->sx = BE32(h + 16);
+        info->sy = BE32(h + 20);
+        /* gd loads RGB, RGBA and gray+alpha PNGs as truecolor */
+        info->trueColor = (h[25] == 2 || h[25] == 4 || h[25] == 6);
+        return 1;
+    }
 
- {"origin",    (PyCFunction)image_origin,    1,
-    "origin((x,y)[,xmult,ymult])\n"
-    "set the origin of the image to (x,y) and multiply all x, y, width and\n"
-    "height factors by xmult and ymult (typically either 1 or -1)"},
+    if(h[0] == 0xFF && h[1] == 0xD8 && h[2] == 0xFF)
+        return probe_jpeg(src, info);
+
+    if(memcmp(h, "GIF8", 4) == 0) {
+        if(!probe_read(src, 0, h, 10))
+            return 0;
+        info->type = "gif";
+        info->sx = LE16(h + 6);
+        info->sy = LE16(h + 8);
+        info->trueColor = 0;
+        return 1;
+    }
 
- {"getOrigin",    (PyCFunction)image_getorigin,    1,
-    "getOrigin()\n"
-    "returns the origin parameters ((x,y),xmult,ymult)"},
+    if(memcmp(h, "gd2", 4) == 0) {
+        if(!probe_read(src, 0, h, 14))
+            return 0;
+        info->type = "gd2";
+        info->sx = BE16(h + 6);
+        info->sy = BE16(h + 8);
+        info->chunkSize = BE16(h + 10);
+        info->trueColor = (BE16(h + 12) > GD2_FMT_COMPRESSED);
+        return 1;
+    }
 
- {"saveAlpha",    (PyCFunction)image_savealpha,    1,
-    "saveAlpha(n)\n"
-    "if n = 1, alpha channel information will be saved"
-    " (assuming the format supports it, i.e. PNG)"},
+    /* gd 2.x files start with a truecolor (0xFFFE) or palette (0xFFFF)
+     * signature; gd 1.x files have none and can't be recognized */
+    if(h[0] == 0xFF && (h[1] == 0xFE || h[1] == 0xFF)) {
+        if(!probe_read(src, 0, h, 6))
+            return 0;
+        info->type = "gd";
+        info->sx = BE16(h + 2);
+        info->sy = BE16(h + 4);
+        info->trueColor = (h[1] == 0xFE);
+        return 1;
+    }
 
- {NULL,        NULL}        /* sentinel */
-};
+    return 0;
+}
 
+static PyObject *gd_probe(PyObject *self, PyObject *args)
+{
+    struct probe_src src;
+    struct probe_info info;
+    PyObject *obj;
+    Py_buffer view;
+    const void *p;
+    Py_ssize_t len;
+    int ok;
+
+    if(!PyArg_ParseTuple(args, "O", &obj))
+        return NULL;
 
-/*
-** Table of file types understood to gd "constructors"
-*/
+    memset(&src, 0, sizeof(src));
 
-static struct {
-    char *ext;
-    gdImagePtr (*func)(FILE*);
+    if(PyString_Check(obj)) {
+        if(!(src.fp = fopen(PyString_AS_STRING(obj), "rb"))) {
+            PyErr_SetFromErrno(PyExc_IOError);
+            return NULL;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        ok = probe_header(&src, &info);
+        fclose(src.fp);
+        Py_END_ALLOW_THREADS
+    } else if(PyObject_CheckBuffer(obj)) {
+        if(PyObject_GetBuffer(obj, &view, PyBUF_SIMPLE) < 0)
+            return NULL;
+        src.buf = view.buf;
+        src.len = view.len;
+        ok = probe_header(&src, &info);
+        PyBuffer_Release(&view);
+    } else {
+        /* old style buffers (array.array, mmap) are safe to read in
+         * place, since the GIL is held throughout */
+        if(PyObject_AsReadBuffer(obj, &p, &len) < 0)
+            return NULL;
+        src.buf = p;
+        src.len = len;
+        ok = probe_header(&src, &info);
+    }
 
-} ext_table[] = {
+    if(!ok) {
+        PyErr_SetString(PyExc_IOError, "unrecognized or truncated image header");
+        return NULL;
+    }
 
-#ifdef HAVE_LIBGIF
-    {"gif",  gdImageCreateFromGif},
-#endif
-#ifdef HAVE_LIBPNG
-    {"png",  gdImageCreateFromPng},
-#endif
-#ifdef HAVE_LIBJPEG
-    {"jpeg", gdImageCreateFromJpeg},
-    {"jpg",  gdImageCreateFromJpeg},
-    {"jfif", gdImageCreateFromJpeg},
-#endif
-    {"gd",   gdImageCreateFromGd},
-    {"gd2",  gdImageCreateFromGd2},
-    {"xbm",  gdImageCreateFromXbm}, /* this is internal to gd */
+    if(strcmp(info.type, "gd2") == 0)
+        return Py_BuildValue("s(ii)ii", info.type, info.sx, info.sy,
+            info.trueColor, info.chunkSize);
 
-    {NULL, NULL}
-};
+    return Py_BuildValue("s(ii)iO", info.type, info.sx, info.sy,
+        info.trueColor, Py_None);
+}
 
-static struct {
-    char *ext;
-    gdImagePtr (*func)(gdIOCtxPtr);
 
-} ext_table_ctx[] = {
+/*
+** Thumbnails.  thumb_run() takes an image from file or memory through
+** to an encoded thumbnail without touching any Python objects, so the
+** whole pipeline runs without the GIL.  JPEG sources are decoded at
+** the smallest DCT scale that is still big enough (see newjpegimage).
+*/
 
-#ifdef HAVE_LIBPNG
-    {"png",  gdImageCreateFromPngCtx},
-#endif
-#ifdef HAVE_LIBJPEG
-    {"jpeg", gdImageCreateFromJpegCtx},
-    {"jpg",  gdImageCreateFromJpegCtx},
-    {"jfif", gdImageCreateFromJpegCtx},
-#endif
-    {"gd",   gdImageCreateFromGdCtx},
-    {"gd2",  gdImageCreateFromGd2Ctx},
+#define FIT_CONTAIN 0           /* fit within the box, never enlarged */
+#define FIT_COVER   1           /* fill the box, cropping the middle */
+#define FIT_STRETCH 2           /* exactly the box, ignoring aspect */
 
-    {NULL, NULL}
-};
+static char *fit_names[] = { "contain", "cover", "stretch", NULL };
 
+typedef struct {
+    char *path;                 /* read the source from this file, or */
+    const void *src;            /* from memory */
+    size_t srclen;
+    char *ext;                  /* source type, if it can't be probed */
+    int maxw, maxh, fit;
+    encode_job enc;             /* output format; the result goes in enc.data */
+    char *dstpath;              /* or is written to this file */
+    int sx, sy;                 /* size of the thumbnail */
+    double t_read, t_decode, t_resize, t_encode, t_write;
+    char *error;                /* why it failed, */
+    int err;                    /* errno for I/O errors, */
+    char *errfile;              /* and which file */
+    struct thumb_gate *gate;    /* limits images decoded at once, or NULL */
+} thumb_job;
 
 /*
-** Code to act as a gdIOCtx wrapper for a python file object
-** (read-only; write support would not be difficult to add)
+** batch_thumbnail() bounds the number of images decoded at any moment
+** with a set of slot locks: a job takes a free slot (waiting for one if
+** there are none) before decoding, and gives it back once its images
+** have been freed.
 */
 
-struct PyFileIfaceObj_gdIOCtx {
-    gdIOCtx ctx;
-    PyObject *fileIfaceObj;
-    PyObject *strObj;        // our reference to the data string we're currently
+struct thumb_gate {
+    PyThread_type_lock slot[POOL_MAX];
+    int nslots;
 };
 
-int PyFileIfaceObj_IOCtx_GetC(gdIOCtx *ctx)
+static int thumb_gate_enter(struct thumb_gate *g)
 {
-    struct PyFileIfaceObj_gdIOCtx *pctx = (struct PyFileIfaceObj_gdIOCtx *)ctx;
-    if (pctx->strObj) {
-        Py_DECREF(pctx->strObj);
-        pctx->strObj = NULL;
-    }
-    pctx->strObj = PyObject_CallMethod(pctx->fileIfaceObj, "read", "i", 1);
-    if (!pctx->strObj || !PyString_Check(pctx->strObj)) {
-        return EOF;
-    }
-    if (PyString_GET_SIZE(pctx->strObj) == 1) {
-        return (int)(unsigned char)PyString_AS_STRING(pctx->strObj)[0];
-    }
-    return EOF;
+    static int rr;              /* spreads out the waiters; races are harmless */
+    int k;
+
+    for(k = 0; k < g->nslots; k++)
+        if(PyThread_acquire_lock(g->slot[k], NOWAIT_LOCK))
+            return k;
+    k = (rr++ & 0x7fffffff) % g->nslots;
+    PyThread_acquire_lock(g->slot[k], WAIT_LOCK);
+    return k;
 }
 
-int PyFileIfaceObj_IOCtx_GetBuf(gdIOCtx *ctx, void *data, Py_ssize_t size)
+static void thumb_gate_leave(struct thumb_gate *g, int k)
 {
-    int err;
-    char *value;
-    struct PyFileIfaceObj_gdIOCtx *pctx = (struct PyFileIfaceObj_gdIOCtx *)ctx;
-    if (pctx->strObj) {
-        Py_DECREF(pctx->strObj);
-        pctx->strObj = NULL;
-    }
-    pctx->strObj = PyObject_CallMethod(pctx->fileIfaceObj, "read", "i", size);
-    if (!pctx->strObj) {
-        return 0;
-    }
-    err = PyString_AsStringAndSize(pctx->strObj, &value, &size);
-    if (err < 0) {
-        /* this throws away the python exception since the gd library
-         * won't pass it up properly.  gdmodule should create its own
-         * since the "file" couldn't be read properly.  */
-        PyErr_Clear();
-        return 0;
-    }
-    memcpy(data, value, size);
-    return size;
+    PyThread_release_lock(g->slot[k]);
 }
 
-void PyFileIfaceObj_IOCtx_Free(gdIOCtx *ctx)
+/*
+** Scratch memory.  File buffers and thumbnail images are handed on to
+** the next thumbnail rather than freed (up to SCRATCH_MAX of each, and
+** scratch_max bytes in all), since a run of thumbnails tends to read
+** similar files and produce the same size again and again.  The limit
+** is set with setThumbnailCache; 0 frees everything kept.
+*/
+
+#define SCRATCH_MAX   8
+#define SCRATCH_BYTES (16 << 20)
+
+static PyThread_type_lock scratch_mutex;     /* guards everything below */
+static struct { void *p; size_t alloc; } scratch_buf[SCRATCH_MAX];
+static int scratch_nbuf;
+static gdImagePtr scratch_im[SCRATCH_MAX];
+static int scratch_nim;
+static size_t scratch_bytes, scratch_max = SCRATCH_BYTES;
+
+#define scratch_size(im) ((size_t)(im)->sx * (im)->sy * sizeof(int))
+
+/* free the oldest images, then the oldest buffers, until at most limit
+ * bytes are kept; scratch_mutex must be held */
+
+static void scratch_trim(size_t limit)
 {
-    struct PyFileIfaceObj_gdIOCtx *pctx = (struct PyFileIfaceObj_gdIOCtx *)ctx;
-    if (pctx->strObj) {
-        Py_DECREF(pctx->strObj);
-        pctx->strObj = NULL;
+    while(scratch_bytes > limit && scratch_nim > 0) {
+        scratch_bytes -= scratch_size(scratch_im[0]);
+        gdImageDestroy(scratch_im[0]);
+        memmove(scratch_im, scratch_im + 1, --scratch_nim * sizeof(gdImagePtr));
     }
-    if (pctx->fileIfaceObj) {
-        Py_DECREF(pctx->fileIfaceObj);
-        pctx->fileIfaceObj = NULL;
+    while(scratch_bytes > limit && scratch_nbuf > 0) {
+        scratch_bytes -= scratch_buf[0].alloc;
+        free(scratch_buf[0].p);
+        memmove(scratch_buf, scratch_buf + 1, --scratch_nbuf * sizeof(scratch_buf[0]));
     }
-    /* NOTE: we leave deallocation of the ctx structure itself to outside
-     * code for memory allocation symmetry.  This function is safe to
-     * call multiple times (gd should call it + we call it to be safe). */
 }
 
-struct PyFileIfaceObj_gdIOCtx * alloc_PyFileIfaceObj_IOCtx(PyObject *fileIfaceObj)
+static void *scratch_get(size_t *alloc)
 {
-    struct PyFileIfaceObj_gdIOCtx *pctx;
-    pctx = calloc(1, sizeof(struct PyFileIfaceObj_gdIOCtx));
-    if (!pctx)
-        return NULL;
-    pctx->ctx.getC = PyFileIfaceObj_IOCtx_GetC; 
-    pctx->ctx.getBuf = PyFileIfaceObj_IOCtx_GetBuf;
-    pctx->ctx.gd_free = PyFileIfaceObj_IOCtx_Free;
-    Py_INCREF(fileIfaceObj);
-    pctx->fileIfaceObj = fileIfaceObj;
-    return pctx;
+    void *p = NULL;
+
+    *alloc = 0;
+    if(scratch_mutex) {
+        PyThread_acquire_lock(scratch_mutex, WAIT_LOCK);
+        if(scratch_nbuf > 0) {
+            scratch_nbuf--;
+            p = scratch_buf[scratch_nbuf].p;
+            *alloc = scratch_buf[scratch_nbuf].alloc;
+            scratch_bytes -= *alloc;
+        }
+        PyThread_release_lock(scratch_mutex);
+    }
+    return p;
 }
 
-void free_PyFileIfaceObj_IOCtx(struct PyFileIfaceObj_gdIOCtx *pctx)
+static void scratch_put(void *p, size_t alloc)
 {
-    if (!pctx)
+    if(!p)
         return;
-    assert(pctx->ctx.gd_free != NULL);
-    pctx->ctx.gd_free((gdIOCtxPtr)pctx);  // free its internal resources
-    free(pctx);
+    if(scratch_mutex) {
+        PyThread_acquire_lock(scratch_mutex, WAIT_LOCK);
+        if(scratch_nbuf < SCRATCH_MAX && alloc <= scratch_max) {
+            scratch_buf[scratch_nbuf].p = p;
+            scratch_buf[scratch_nbuf].alloc = alloc;
+            scratch_nbuf++;
+            scratch_bytes += alloc;
+            p = NULL;
+            scratch_trim(scratch_max);
+        }
+        PyThread_release_lock(scratch_mutex);
+    }
+    free(p);
 }
-/*
-** Code to create the imageobject
-*/
 
-static imageobject *newimageobject(PyObject *args)
-{
-    imageobject *self, *srcimage;
-    int xdim=0, ydim=0, i, trueColor=0;
-    char *filename,*ext=0;
-    FILE *fp;
-    PyObject *readObj;
-
-    if(!(self = PyObject_NEW(imageobject, &Imagetype)))
-        return NULL;
+/* a w x h truecolor image, set up as if new; the pixels are not cleared */
 
-    self->current_tile = self->current_brush = NULL;
-    self->origin_x = self->origin_y = 0;
-    self->multiplier_x = self->multiplier_y = 1;
-    self->imagedata = NULL;
+static gdImagePtr scratch_image(int w, int h)
+{
+    gdImagePtr im = NULL;
+    int i;
 
-    if(PyArg_ParseTuple(args, "")) {
-        PyErr_SetString(PyExc_ValueError, 
-            "image size or source filename required");
-        Py_DECREF(self);
-        return NULL;
-    } else if(PyErr_Clear(), 
-        PyArg_ParseTuple(args, "O!|(ii)i", 
-            &Imagetype, &srcimage, &xdim, &ydim, &trueColor)) 
-    {
-        if(!xdim) xdim = gdImageSX(srcimage->imagedata);
-        if(!ydim) ydim = gdImageSY(srcimage->imagedata);
-#if GD2_VERS <= 1
-        trueColor = 0;
-#endif
-        if (!trueColor){
-            if(!(self->imagedata = gdImageCreate(xdim,ydim))) {
-                Py_DECREF(self);
-                return NULL;
-            }
-        }
-#if GD2_VERS > 1
-        else
-            if(!(self->imagedata = gdImageCreateTrueColor(xdim,ydim))) {
-                Py_DECREF(self);
-                return NULL;
-            }
-#endif
-        if(xdim == gdImageSX(srcimage->imagedata) &&
-            ydim == gdImageSY(srcimage->imagedata))
-            gdImageCopy(self->imagedata,srcimage->imagedata,0,0,0,0,xdim,ydim);
-        else
-            gdImageCopyResized(self->imagedata,srcimage->imagedata,
-                0,0,0,0,xdim,ydim,gdImageSX(srcimage->imagedata),
-                gdImageSY(srcimage->imagedata));
-    } else if(PyErr_Clear(), 
-        PyArg_ParseTuple(args, "(ii)|i", &xdim, &ydim, &trueColor)) 
-    {
-        if(!xdim || !ydim) {
-            PyErr_SetString(PyExc_ValueError, "dimensions cannot be 0");
-            Py_DECREF(self);
-            return NULL;
-        } 
-#if GD2_VERS <= 1
-        trueColor = 0;
-#endif
-        if (!trueColor){
-            if(!(self->imagedata = gdImageCreate(xdim,ydim))) {
-                Py_DECREF(self);
-                return NULL;
-            }
-        }
-#if GD2_VERS > 1
-        else
-            if(!(self->imagedata = gdImageCreateTrueColor(xdim,ydim))) {
-                Py_DECREF(self);
-                return NULL;
+    if(scratch_mutex) {
+        PyThread_acquire_lock(scratch_mutex, WAIT_LOCK);
+        for(i = scratch_nim - 1; i >= 0; i--)
+            if(scratch_im[i]->sx == w && scratch_im[i]->sy == h) {
+                im = scratch_im[i];
+                scratch_bytes -= scratch_size(im);
+                memmove(scratch_im + i, scratch_im + i + 1,
+                    (--scratch_nim - i) * sizeof(gdImagePtr));
+                break;
             }
-#endif
-    } else if(PyErr_Clear(), PyArg_ParseTuple(args, "s|s", &filename, &ext)) {
-
-        if(!ext) {
-            if(!(ext = strrchr(filename,'.'))) {
-                PyErr_SetString(PyExc_IOError,
-                    "need an extension to determine file type (.png|.jpeg|.jpg|.gd|.gd2|.xpm|.xbm)");
-                Py_DECREF(self);
-                return NULL;
+        PyThread_release_lock(scratch_mutex);
+    }
+    if(!im)
+        return gdImageCreateTrueColor(w, h);
+
+    im->transparent = -1;
+    im->interlace = 0;
+    im->saveAlphaFlag = 0;
+    im->alphaBlendingFlag = 1;
+    gdImageSetClip(im, 0, 0, w - 1, h - 1);
+    return im;
+}
+
+static void scratch_put_image(gdImagePtr im)
+{
+    if(scratch_mutex) {
+        PyThread_acquire_lock(scratch_mutex, WAIT_LOCK);
+        if(scratch_size(im) <= scratch_max) {
+            /* when full, the oldest size makes way */
+            if(scratch_nim == SCRATCH_MAX) {
+                scratch_bytes -= scratch_size(scratch_im[0]);
+                gdImageDestroy(scratch_im[0]);
+                memmove(scratch_im, scratch_im + 1, --scratch_nim * sizeof(gdImagePtr));
             }
-            ext++;
+            scratch_im[scratch_nim++] = im;
+            scratch_bytes += scratch_size(im);
+            im = NULL;
+            scratch_trim(scratch_max);
         }
+        PyThread_release_lock(scratch_mutex);
+    }
+    if(im)
+        gdImageDestroy(im);
+}
 
-        if(strcmp(ext, "xpm") == 0) {
-#ifndef HAVE_LIBXPM
-            PyErr_SetString(PyExc_NotImplementedError,
-                    "XPM Support Not Available");
-            Py_DECREF(self);
-            return NULL;
-#else
-            /* gdImageCreateFromXpm takes a filename rather than a FILE * */
+static PyObject *gd_setthumbnailcache(PyObject *self, PyObject *args)
+{
+    long maxbytes;
 
-            if(!(self->imagedata = gdImageCreateFromXpm(filename))) {
-                PyErr_SetString(PyExc_IOError, "corrupt or invalid image file");
-                Py_DECREF(self);
-                return(NULL);
-            }
+    if(!PyArg_ParseTuple(args, "l", &maxbytes))
+        return NULL;
+    if(maxbytes < 0) {
+        PyErr_SetString(PyExc_ValueError, "cache size cannot be negative");
+        return NULL;
+    }
+    if(!scratch_mutex) {
+        PyErr_SetString(ErrorObject, "thumbnail cache not available");
+        return NULL;
+    }
 
-            return self;
-#endif
-        }
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(scratch_mutex, WAIT_LOCK);
+    scratch_max = (size_t)maxbytes;
+    scratch_trim(scratch_max);
+    PyThread_release_lock(scratch_mutex);
+    Py_END_ALLOW_THREADS
 
-        if(!(fp = fopen(filename,"rb"))) {
-            PyErr_SetFromErrno(PyExc_IOError);
-            Py_DECREF(self);
-            return(NULL);
-        }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
 
-        for(i = 0; ext_table[i].ext != NULL; i++) {
+static double thumb_clock(void)
+{
+    struct timeval tv;
 
-            if(strcmp(ext, ext_table[i].ext) == 0) {
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
 
-                if(!(self->imagedata = ext_table[i].func(fp))) {
-                    fclose(fp);
-                    PyErr_SetString(PyExc_IOError,
-                        "corrupt or invalid image file (may be unsupported)");
-                    Py_DECREF(self);
-                    return(NULL);
-                }
+/* read all of a file into a scratch buffer; 0 with errno set on failure */
+
+static int thumb_read_file(char *path, void **buf, size_t *len, size_t *alloc)
+{
+    FILE *fp;
+    size_t n;
+    void *nbuf;
+    int err;
 
+    *len = 0;
+    if(!(fp = fopen(path, "rb")))
+        return 0;
+    *buf = scratch_get(alloc);
+    for(;;) {
+        if(*alloc - *len < 65536) {
+            n = *alloc ? *alloc * 2 : 1 << 20;
+            if(!(nbuf = realloc(*buf, n))) {
                 fclose(fp);
-                return self;
+                errno = ENOMEM;
+                return 0;
             }
+            *buf = nbuf;
+            *alloc = n;
         }
+        if((n = fread((char *)*buf + *len, 1, *alloc - *len, fp)) == 0)
+            break;
+        *len += n;
+    }
+    err = ferror(fp) ? errno : 0;
+    fclose(fp);
+    if(err) {
+        errno = err;
+        return 0;
+    }
+    return 1;
+}
 
-        /* if we fall out, we didn't find the file type */
+static int thumb_run(thumb_job *job)
+{
+    struct probe_src ps;
+    struct probe_info info;
+    void *data = NULL;
+    size_t len = 0, alloc = 0;
+    gdImagePtr im = NULL, th = NULL;
+    encode_batch eb;
+    char *type;
+    double t = thumb_clock(), t0, s;
+    int i, mapped = 0, sx, sy, w, h, cx = 0, cy = 0, cw, ch, slot = -1;
+    FILE *fp;
 
-        PyErr_SetString(PyExc_IOError,
-            "unsupported file type (only .gif|.png|.jpeg|.jpg|.gd|.gd2|.xbm|.xpm accepted)");
+    job->error = job->errfile = NULL;
+    job->err = 0;
+    job->enc.data = NULL;
+    job->enc.size = 0;
+    job->t_read = job->t_decode = job->t_resize = job->t_encode = job->t_write = 0.0;
+
+    /* read */
+    if(job->path) {
+#ifdef HAVE_MMAP
+        if((data = map_file(job->path, &len)) != NULL)
+            mapped = 1;
+        else
+#endif
+        if(!thumb_read_file(job->path, &data, &len, &alloc)) {
+            job->err = errno;
+            job->errfile = job->path;
+            job->error = "can't read file";
+            goto done;
+        }
+    } else {
+        data = (void *)job->src;
+        len = job->srclen;
+    }
+    t0 = thumb_clock();
+    job->t_read = t0 - t;
+    t = t0;
+
+    /* decode */
+    if(len > INT_MAX) {
+        job->error = "image data too large";
+        goto done;
+    }
+    ps.buf = data;
+    ps.len = len;
+    ps.fp = NULL;
+    type = probe_header(&ps, &info) ? info.type : job->ext;
+    if(!type) {
+        job->error = "unrecognized image type";
+        goto done;
+    }
+    if(job->gate) {
+        slot = thumb_gate_enter(job->gate);
+        t = thumb_clock();      /* time spent waiting isn't decoding */
+    }
+#ifdef HAVE_LIBJPEG
+    if(is_jpeg_ext(type)) {
+        int denom = 1;
+
+        if(type == info.type) {
+            if(job->fit == FIT_CONTAIN)
+                denom = jpeg_fit_denom(info.sx, info.sy, job->maxw, job->maxh);
+            else
+                for(denom = 8; denom > 1; denom /= 2)
+                    if(denom * job->maxw <= info.sx && denom * job->maxh <= info.sy)
+                        break;
+        }
+        im = jpeg_scaled_from_ptr(data, len, denom, 0, 0);
+    } else
+#endif
+    {
+        for(i = 0; ext_table_ptr[i].ext != NULL; i++)
+            if(strcmp(type, ext_table_ptr[i].ext) == 0)
+                break;
+        if(ext_table_ptr[i].ext == NULL) {
+            job->error = "unsupported image type";
+            goto done;
+        }
+        im = ext_table_ptr[i].func((int)len, data);
+    }
+    if(!im) {
+        job->error = "corrupt or invalid image data (may be unsupported)";
+        goto done;
+    }
+    t0 = thumb_clock();
+    job->t_decode = t0 - t;
+    t = t0;
+
+    /* resize */
+    sx = cw = gdImageSX(im);
+    sy = ch = gdImageSY(im);
+    switch(job->fit) {
+    case FIT_CONTAIN:
+        s = MIN((double)job->maxw / sx, (double)job->maxh / sy);
+        if(s > 1.0)
+            s = 1.0;
+        w = MAX(1, (int)(sx * s + 0.5));
+        h = MAX(1, (int)(sy * s + 0.5));
+        break;
+    case FIT_COVER:
+        w = job->maxw;
+        h = job->maxh;
+        s = MAX((double)w / sx, (double)h / sy);
+        cw = MIN(sx, MAX(1, (int)(w / s + 0.5)));
+        ch = MIN(sy, MAX(1, (int)(h / s + 0.5)));
+        cx = (sx - cw) / 2;
+        cy = (sy - ch) / 2;
+        break;
+    default:
+        w = job->maxw;
+        h = job->maxh;
+        break;
+    }
+    if(w == sx && h == sy) {
+        th = im;
+    } else {
+        if(!(th = scratch_image(w, h))) {
+            job->error = "out of memory";
+            goto done;
+        }
+        gdImageAlphaBlending(th, 0);
+        resample_copy(th, im, 0, 0, cx, cy, w, h, cw, ch);
+    }
+    gdImageSaveAlpha(th, 1);
+    job->sx = w;
+    job->sy = h;
+    t0 = thumb_clock();
+    job->t_resize = t0 - t;
+    t = t0;
+
+    /* encode */
+    eb.im = th;
+    eb.jobs = &job->enc;
+    encode_one(&eb, 0);
+    if(!job->enc.data) {
+        job->error = "encoding failed";
+        goto done;
+    }
+    t0 = thumb_clock();
+    job->t_encode = t0 - t;
+    t = t0;
+
+    /* write */
+    if(job->dstpath) {
+        /* once open, the file is always closed; the first failure is
+         * the one reported */
+        if(!(fp = fopen(job->dstpath, "wb"))) {
+            job->err = errno;
+        } else {
+            if(fwrite(job->enc.data, 1, job->enc.size, fp) != (size_t)job->enc.size)
+                job->err = errno ? errno : EIO;
+            if(fclose(fp) != 0 && !job->err)
+                job->err = errno ? errno : EIO;
+        }
+        if(job->err) {
+            job->errfile = job->dstpath;
+            job->error = "can't write file";
+        }
+        gdFree(job->enc.data);
+        job->enc.data = NULL;
+        job->t_write = thumb_clock() - t;
+    }
 
-        Py_DECREF(self);
-        return(NULL);
+done:
+#ifdef HAVE_MMAP
+    if(mapped)
+        munmap(data, len);
+    else
+#endif
+    if(job->path)
+        scratch_put(data, alloc);
+    if(th && th != im)
+        scratch_put_image(th);
+    if(im)
+        gdImageDestroy(im);
+    if(slot >= 0)
+        thumb_gate_leave(job->gate, slot);
+    return job->error == NULL;
+}
 
-    } else if(PyErr_Clear(), 
-        PyArg_ParseTuple(args, "Oz", &readObj, &ext)) 
-    {
-        struct PyFileIfaceObj_gdIOCtx *ourIOCtx = NULL;
+/* fill in the output format of a thumbnail job; quality < 0 means the
+ * format's default */
 
-        if (!PyObject_HasAttrString(readObj, "read")) {
-            PyErr_SetString(ErrorObject, "non-Image objects must have a read() method");
-            Py_DECREF(self);
-            return NULL;
-        }
+static int thumb_format(thumb_job *job, char *format, int quality)
+{
+    int i;
 
-        ourIOCtx = alloc_PyFileIfaceObj_IOCtx(readObj);
-        if (!ourIOCtx) {
-            PyErr_NoMemory();
-            Py_DECREF(self);
-            return(NULL);
+    for(i = 0; encode_formats[i].name; i++)
+        if(strcmp(format, encode_formats[i].name) == 0)
+            break;
+    if(!encode_formats[i].name) {
+        PyErr_Format(PyExc_ValueError, "can't encode %s", format);
+        return 0;
+    }
+    job->enc.fmt = encode_formats[i].fmt;
+    job->enc.arg1 = encode_formats[i].def1;
+    job->enc.arg2 = encode_formats[i].def2;
+
+    if(quality >= 0) {
+        if(job->enc.fmt == 'j' && quality <= 100)
+            job->enc.arg1 = quality;
+        else if(job->enc.fmt == 'p' && quality <= 9)
+            job->enc.arg1 = quality;
+        else {
+            PyErr_Format(PyExc_ValueError, "invalid quality for %s", format);
+            return 0;
         }
+    }
+    return 1;
+}
 
-        for(i = 0; ext_table_ctx[i].ext != NULL; i++) {
+static int thumb_fit(char *fit)
+{
+    int i;
 
-            if(strcmp(ext, ext_table_ctx[i].ext) == 0) {
+    for(i = 0; fit_names[i]; i++)
+        if(strcmp(fit, fit_names[i]) == 0)
+            return i;
+    PyErr_SetString(PyExc_ValueError, "fit must be contain, cover or stretch");
+    return -1;
+}
 
-                if(!(self->imagedata = ext_table_ctx[i].func((gdIOCtxPtr)ourIOCtx))) {
-                    free_PyFileIfaceObj_IOCtx(ourIOCtx);
-                    PyErr_SetString(PyExc_IOError,
-                        "corrupt or invalid image data (may be unsupported)");
-                    Py_DECREF(self);
-                    return(NULL);
-                }
+/* turn a failed job into an exception */
 
-                free_PyFileIfaceObj_IOCtx(ourIOCtx);
-                return self;
-            }
-        }
+static void thumb_raise(thumb_job *job)
+{
+    if(job->err == ENOMEM || strcmp(job->error, "out of memory") == 0)
+        PyErr_NoMemory();
+    else if(job->err) {
+        errno = job->err;
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, job->errfile);
+    } else
+        PyErr_SetString(PyExc_IOError, job->error);
+}
 
-        /* if we fall out, we didn't find the file type */
+static PyObject *thumb_timings(thumb_job *job)
+{
+    return Py_BuildValue("{s:(ii),s:i,s:d,s:d,s:d,s:d,s:d}",
+        "size", job->sx, job->sy, "bytes", job->enc.size,
+        "read", job->t_read, "decode", job->t_decode,
+        "resize", job->t_resize, "encode", job->t_encode,
+        "write", job->t_write);
+}
 
-        PyErr_SetString(PyExc_IOError,
-            "unsupported file type (only png, jpeg, gd, & gd2 can be read from an object)");
+/* the Python end of a thumbnail job.  src and dst are held until
+ * thumb_cleanup(), since the job points into them while it runs
+ * without the GIL. */
 
-        free_PyFileIfaceObj_IOCtx(ourIOCtx);
+typedef struct {
+    PyObject *src, *dst;
+    Py_buffer view;
+    int have_view;
+    char *readbuf;
+} thumb_py;
 
-        Py_DECREF(self);
-        return(NULL);
+static char *thumb_kwlist[] = {"src", "dst", "max_size", "format", "quality", "fit", NULL};
+
+/* set up job from thumbnail()'s arguments.  src objects with a read()
+ * method are read here, if allow_read; otherwise src must be a filename
+ * or a buffer. */
+
+static int thumb_setup(PyObject *args, PyObject *kwds, thumb_job *job,
+    thumb_py *py, int allow_read)
+{
+    PyObject *srcObj, *dstObj;
+    char *format = NULL, *fit = "contain";
+    Py_ssize_t len;
+    int quality = -1, size;
+
+    memset(job, 0, sizeof(*job));
+    memset(py, 0, sizeof(*py));
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "OO(ii)|zis", thumb_kwlist,
+            &srcObj, &dstObj, &job->maxw, &job->maxh, &format, &quality, &fit))
+        return 0;
+    Py_INCREF(srcObj);
+    py->src = srcObj;
+    Py_INCREF(dstObj);
+    py->dst = dstObj;
+
+    if(job->maxw < 1 || job->maxh < 1) {
+        PyErr_SetString(PyExc_ValueError, "max_size must be positive");
+        return 0;
+    }
+    if((job->fit = thumb_fit(fit)) < 0)
+        return 0;
+
+    if(PyString_Check(py->dst)) {
+        job->dstpath = PyString_AS_STRING(py->dst);
+        if(!format && (format = strrchr(job->dstpath, '.')))
+            format++;
+    } else if(py->dst != Py_None && !PyObject_HasAttrString(py->dst, "write")) {
+        PyErr_SetString(ErrorObject, "dst must be a filename, an object with a write method, or None");
+        return 0;
+    }
+    if(!thumb_format(job, format ? format : "jpeg", quality))
+        return 0;
+
+    if(PyString_Check(srcObj)) {
+        job->path = PyString_AS_STRING(srcObj);
+        if((job->ext = strrchr(job->path, '.')))
+            job->ext++;
+    } else if(PyObject_CheckBuffer(srcObj)) {
+        if(PyObject_GetBuffer(srcObj, &py->view, PyBUF_SIMPLE) < 0)
+            return 0;
+        py->have_view = 1;
+        job->src = py->view.buf;
+        job->srclen = py->view.len;
+    } else if(PyObject_CheckReadBuffer(srcObj)) {
+        if(!(py->readbuf = buffer_copy(srcObj, &len)))
+            return 0;
+        job->src = py->readbuf;
+        job->srclen = len;
+    } else if(allow_read && PyObject_HasAttrString(srcObj, "read")) {
+        struct PyFileIfaceObj_gdIOCtx *ourIOCtx;
+
+        if(!(ourIOCtx = alloc_PyFileIfaceObj_IOCtx(srcObj))) {
+            PyErr_NoMemory();
+            return 0;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        py->readbuf = read_whole_ctx((gdIOCtxPtr)ourIOCtx, &size);
+        Py_END_ALLOW_THREADS
+        free_PyFileIfaceObj_IOCtx(ourIOCtx);
+        if(!py->readbuf) {
+            PyErr_NoMemory();
+            return 0;
+        }
+        job->src = py->readbuf;
+        job->srclen = size;
     } else {
-        PyErr_SetString(PyExc_ValueError, "invalid argument list");
-        Py_DECREF(self);
-        return(NULL);
+        PyErr_SetString(ErrorObject, allow_read
+            ? "src must be a filename, an object with a read method, or support the buffer interface"
+            : "src must be a filename or support the buffer interface");
+        return 0;
     }
+    return 1;
+}
 
-    return self;
+static void thumb_cleanup(thumb_py *py)
+{
+    if(py->have_view) {
+        PyBuffer_Release(&py->view);
+        py->have_view = 0;
+    }
+    free(py->readbuf);
+    py->readbuf = NULL;
+    Py_CLEAR(py->src);
+    Py_CLEAR(py->dst);
 }
 
+/* the result of a finished job: its timings dict, with the thumbnail
+ * written to dst or added to the dict; or NULL with the job's error
+ * raised */
 
-static void image_dealloc(imageobject *self)
+static PyObject *thumb_result(thumb_job *job, thumb_py *py, int ok)
 {
-    if(self->current_brush) {
-        Py_DECREF(self->current_brush);
-    }
+    PyObject *result = NULL, *str, *rv;
 
-    if(self->current_tile) {
-        Py_DECREF(self->current_tile);
+    if(!ok) {
+        thumb_raise(job);
+        goto done;
     }
 
-    if(self->imagedata) gdImageDestroy(self->imagedata);
+    if(!(result = thumb_timings(job)))
+        goto done;
 
-    PyObject_DEL(self);
-}
+    if(job->enc.data) {
+        if(!(str = PyString_FromStringAndSize(job->enc.data, job->enc.size))) {
+            Py_CLEAR(result);
+        } else if(py->dst == Py_None) {
+            if(PyDict_SetItemString(result, "data", str) < 0)
+                Py_CLEAR(result);
+        } else {
+            if(!(rv = PyObject_CallMethod(py->dst, "write", "(O)", str)))
+                Py_CLEAR(result);
+            Py_XDECREF(rv);
+        }
+        Py_XDECREF(str);
+    }
 
+done:
+    if(job->enc.data) {
+        gdFree(job->enc.data);
+        job->enc.data = NULL;
+    }
+    return result;
+}
 
-static PyObject *image_getattr(PyObject *self, char *name)
+static PyObject *gd_thumbnail(PyObject *module, PyObject *args, PyObject *kwds)
 {
-    return Py_FindMethod(image_methods, self, name);
+    thumb_job job;
+    thumb_py py;
+    PyObject *result;
+    int ok;
+
+    if(!thumb_setup(args, kwds, &job, &py, 1)) {
+        thumb_cleanup(&py);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ok = thumb_run(&job);
+    Py_END_ALLOW_THREADS
+
+    result = thumb_result(&job, &py, ok);
+    thumb_cleanup(&py);
+    return result;
 }
 
+/*
+** batch_thumbnail: many thumbnail jobs spread over the thread pool.
+** par_run hands the jobs out one at a time, so a thread which finishes
+** early simply takes the next, and no Python code runs until all of
+** them are done.
+*/
+
+typedef struct {
+    thumb_job *jobs;
+    int *ok;
+} thumb_batch;
 
-static PyObject *image_print(PyObject *self, FILE *fp, int flags)
+static void thumb_one(void *arg, int i)
 {
-    gdImagePtr im;
+    thumb_batch *tb = (thumb_batch *)arg;
 
-    im = ((imageobject *)self)->imagedata;
-    fprintf(fp,"<%dx%d image object at 0x%lx>",gdImageSX(im),gdImageSY(im),
-      (unsigned long)self);
-    return 0;
+    tb->ok[i] = thumb_run(&tb->jobs[i]);
 }
 
+static PyObject *gd_batch_thumbnail(PyObject *module, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"jobs", "threads", "max_decoded", NULL};
+    PyObject *seq, *item, *empty = NULL, *result = NULL, *r;
+    PyObject *type, *value, *tb;
+    struct thumb_gate gate;
+    thumb_batch batch;
+    thumb_py *py = NULL;
+    int i, n, parsed = 0, threads = 0, max_decoded = 0, ok;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|ii", kwlist,
+            &seq, &threads, &max_decoded))
+        return NULL;
+    /* a tuple of our own, so that the list of jobs can't change while
+     * they run */
+    if(!(seq = PySequence_Tuple(seq))) {
+        if(PyErr_ExceptionMatches(PyExc_TypeError))
+            PyErr_SetString(PyExc_TypeError, "batch_thumbnail() requires a sequence of jobs");
+        return NULL;
+    }
 
-static PyTypeObject Imagetype = {
-    PyObject_HEAD_INIT(NULL)
-    0,                                  /*ob_size*/
-    "image",                            /*tp_name*/
-    sizeof(imageobject),                /*tp_basicsize*/
-    0,                                  /*tp_itemsize*/
-    /* methods */
-    (destructor)image_dealloc,          /*tp_dealloc*/
-    (printfunc)image_print,             /*tp_print*/
-    (getattrfunc)image_getattr,         /*tp_getattr*/
-    0,                                  /*tp_setattr*/
-    0,                                  /*tp_compare*/
-    0,                                  /*tp_repr*/
-    0,                                  /*tp_as_number*/
-    0,                                  /*tp_as_sequence*/
-    0,                                  /*tp_as_mapping*/
-    0,                                  /*tp_hash*/
-    0,                                  /*tp_call */
-    0,                                  /*tp_str */
-    0,0,0,0,                            /*tp_xxx1-4 */
-};
+    if(threads <= 0)
+        threads = ncpus();
+    if(max_decoded <= 0)
+        max_decoded = threads;
+    max_decoded = MIN(max_decoded, POOL_MAX);
+
+    n = PyTuple_GET_SIZE(seq);
+    batch.jobs = calloc(n ? n : 1, sizeof(thumb_job));
+    batch.ok = calloc(n ? n : 1, sizeof(int));
+    py = calloc(n ? n : 1, sizeof(thumb_py));
+    if(!batch.jobs || !batch.ok || !py || !(empty = PyTuple_New(0))) {
+        if(!PyErr_Occurred())
+            PyErr_NoMemory();
+        goto done;
+    }
+
+    for(parsed = 0; parsed < n; parsed++) {
+        item = PyTuple_GET_ITEM(seq, parsed);
+        if(PyTuple_Check(item))
+            ok = thumb_setup(item, NULL, &batch.jobs[parsed], &py[parsed], 0);
+        else if(PyDict_Check(item))
+            ok = thumb_setup(empty, item, &batch.jobs[parsed], &py[parsed], 0);
+        else {
+            PyErr_SetString(PyExc_TypeError,
+                "batch_thumbnail() jobs must be tuples or dicts of thumbnail() arguments");
+            ok = 0;
+        }
+        if(!ok) {
+            thumb_cleanup(&py[parsed]);
+            goto done;
+        }
+        batch.jobs[parsed].gate = &gate;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
 
+    /* the slot locks come from par_run's supply, acquired, and are
+     * made free here; after the run they are all free again */
+    gate.nslots = 0;
+    if(pool_mutex) {
+        PyThread_acquire_lock(pool_mutex, WAIT_LOCK);
+        while(gate.nslots < max_decoded && (gate.slot[gate.nslots] = pool_get_lock()))
+            gate.nslots++;
+        PyThread_release_lock(pool_mutex);
+    }
+    for(i = 0; i < gate.nslots; i++)
+        PyThread_release_lock(gate.slot[i]);
+    if(!gate.nslots)
+        for(i = 0; i < n; i++)
+            batch.jobs[i].gate = NULL;
+
+    par_run(n, threads, thumb_one, &batch);
+
+    for(i = 0; i < gate.nslots; i++)
+        PyThread_acquire_lock(gate.slot[i], WAIT_LOCK);
+    if(gate.nslots) {
+        PyThread_acquire_lock(pool_mutex, WAIT_LOCK);
+        for(i = 0; i < gate.nslots; i++)
+            pool_put_lock(gate.slot[i]);
+        PyThread_release_lock(pool_mutex);
+    }
+
+    Py_END_ALLOW_THREADS
+
+    /* failures become exception objects in the list, in place of the
+     * result */
+    if(!(result = PyList_New(n)))
+        goto done;
+    for(i = 0; i < n; i++) {
+        r = thumb_result(&batch.jobs[i], &py[i], batch.ok[i]);
+        thumb_cleanup(&py[i]);
+        if(!r) {
+            PyErr_Fetch(&type, &value, &tb);
+            PyErr_NormalizeException(&type, &value, &tb);
+            Py_XDECREF(type);
+            Py_XDECREF(tb);
+            if(!(r = value)) {
+                Py_INCREF(Py_None);
+                r = Py_None;
+            }
+        }
+        PyList_SET_ITEM(result, i, r);
+    }
+
+done:
+    if(batch.jobs) {
+        for(i = 0; i < parsed; i++) {
+            thumb_cleanup(&py[i]);
+            if(batch.jobs[i].enc.data)
+                gdFree(batch.jobs[i].enc.data);
+        }
+    }
+    free(batch.jobs);
+    free(batch.ok);
+    free(py);
+    Py_XDECREF(empty);
+    Py_DECREF(seq);
+    return result;
+}
 
-static PyObject *gd_image(PyObject *self, PyObject *args)
+static PyObject *gd_frombuffer(PyObject *self, PyObject *args)
 {
-    return (PyObject *)newimageobject(args);
+    imageobject *img;
+    PyObject *bufObj;
+    char *ext;
+
+    if(!PyArg_ParseTuple(args, "Os", &bufObj, &ext))
+        return NULL;
+
+    if(!(img = allocimageobject()))
+        return NULL;
+
+    if(!decode_buffer(img, bufObj, ext)) {
+        Py_DECREF(img);
+        return NULL;
+    }
+
+    return (PyObject *)img;
 }
 
 
@@ -2137,11 +9283,80 @@ static PyObject *gd_fontSSize(PyObject *self, PyObject *args)
 */
 
 static struct PyMethodDef gd_methods[] = {
-    {"image", gd_image, 1,
+    {"image", (PyCFunction)gd_image, METH_VARARGS | METH_KEYWORDS,
         "image(image[,(w,h)] | file | file,type | (w,h))\n"
-        "create GD image from file of type gif, png, jpeg, gd, gd, gd2, xbm, or xpm.\n"
+        "create GD image from file of type gif, png, jpeg, gd, gd2, wbmp, xbm, or xpm.\n"
         "the existing image, optionally resized to width w and height h\n"
-        "or blank with width w and height h"},
+        "or blank with width w and height h.\n"
+        "JPEG images may be decoded reduced by giving scale=1/2, 1/4 or 1/8,\n"
+        "or max_size=(w,h) to use the smallest of these which still leaves the\n"
+        "image at least large enough to be shrunk to fit w x h"},
+    {"frombuffer", gd_frombuffer, 1,
+        "frombuffer(data, type)\n"
+        "create GD image from the encoded image held in data (a string or any\n"
+        "object supporting the buffer interface) of type gif, png, jpeg, gd,\n"
+        "gd2, wbmp, xbm or xpm.  the data is decoded in place, without being\n"
+        "copied"},
+#ifdef HAVE_LIBGIF
+    {"GifAnimWriter", (PyCFunction)gd_gifanimwriter, METH_VARARGS | METH_KEYWORDS,
+        "GifAnimWriter(f[, loops, global_palette])\n"
+        "start writing an animated GIF to f, an object with a write method.\n"
+        "frames are added with addFrame(), and each is written as it is added.\n"
+        "loops is the number of times to repeat (0, the default, for ever; -1\n"
+        "for no looping).  if global_palette is true (the default) the first\n"
+        "frame's palette is used by every frame with the same palette"},
+#endif
+#ifdef HAVE_LIBPNG
+    {"PngWriter", (PyCFunction)gd_pngwriter, METH_VARARGS | METH_KEYWORDS,
+        "PngWriter(f, (w,h)[, alpha, level, window, strategy])\n"
+        "start writing a w x h PNG to f, an object with a write method.  the\n"
+        "rows are supplied with writeRows(), a band at a time, and compressed\n"
+        "as they come.  alpha adds an alpha channel; level (0-9, -1 for the\n"
+        "default, or a preset as for writePng) and window (8-15) are the zlib\n"
+        "compression level and window size in bits; strategy is the row filter\n"
+        "(none, sub, up, average, paeth or adaptive)"},
+#endif
+    {"DisplayList", gd_displaylist, 1,
+        "DisplayList()\n"
+        "a new, empty display list.  drawing calls made on it are recorded, and\n"
+        "can be replayed onto any image, at any offset and scale, with replay()"},
+    {"probe", gd_probe, 1,
+        "probe(file | data)\n"
+        "read just the header of the image in the named file, or held in data\n"
+        "(any object supporting the buffer interface), and return a tuple\n"
+        "(type, (w,h), truecolor, chunksize).  type is gif, png, jpeg, gd or\n"
+        "gd2; chunksize is None except for gd2 images"},
+    {"thumbnail", (PyCFunction)gd_thumbnail, METH_VARARGS | METH_KEYWORDS,
+        "thumbnail(src, dst, (w,h)[, format, quality, fit])\n"
+        "make a thumbnail of the image in src (a filename, an object with a\n"
+        "read method, or a buffer) no bigger than w x h, and write it to dst\n"
+        "(a filename, an object with a write method, or None to return it).\n"
+        "format defaults to dst's extension, or jpeg; quality is the JPEG\n"
+        "quality or PNG compression level.  fit is contain (the default),\n"
+        "cover or stretch.  the work is done without the GIL.  returns a dict\n"
+        "of the thumbnail's size, its length in bytes, the seconds spent on\n"
+        "each stage, and for dst None its data"},
+    {"batch_thumbnail", (PyCFunction)gd_batch_thumbnail, METH_VARARGS | METH_KEYWORDS,
+        "batch_thumbnail(jobs[, threads, max_decoded])\n"
+        "run many thumbnail() jobs, each a tuple or dict of its arguments, on\n"
+        "threads native threads (default, the number of CPUs).  sources must\n"
+        "be filenames or buffers.  at most max_decoded images (default, the\n"
+        "number of threads) are held decoded at once.  returns a list with,\n"
+        "for each job, thumbnail()'s result or the exception it raised"},
+    {"setThumbnailCache", gd_setthumbnailcache, 1,
+        "setThumbnailCache(maxbytes)\n"
+        "keep at most maxbytes (16MB by default) of file buffers and thumbnail\n"
+        "images for reuse by later thumbnails.  0 frees them all"},
+    {"setEncodeCache", gd_setencodecache, 1,
+        "setEncodeCache(maxbytes)\n"
+        "cache the output of the image write methods, up to maxbytes of it,\n"
+        "so that writing the same pixels with the same settings again just\n"
+        "copies out the earlier result.  0 (the default) turns the cache off\n"
+        "and empties it"},
+    {"encodeCacheInfo", gd_encodecacheinfo, 1,
+        "encodeCacheInfo()\n"
+        "returns a dict of the encode cache's hits, misses, entries, bytes\n"
+        "and maxbytes"},
     {"fontstrsize", gd_fontSSize, 1,
         "fontstrsize(font, string)\n"
         "return a tuple containing the size in pixels of the given string in the\n"
@@ -2157,6 +9372,25 @@ void DLLEXPORT init_gd(void)
     PyObject *m, *d, *v;
     int i=0;
 
+    /* image methods release the GIL, and the file object IOCtx
+     * callbacks need PyGILState to get it back */
+    PyEval_InitThreads();
+
+#ifdef HAVE_LIBPNG
+    PngWritertype.ob_type = &PyType_Type;
+#endif
+#ifdef HAVE_LIBGIF
+    GifAnimtype.ob_type = &PyType_Type;
+#endif
+    Exporttype.ob_type = &PyType_Type;
+    DisplayListtype.ob_type = &PyType_Type;
+
+    /* used by par_run(); without it everything runs on one thread */
+    pool_mutex = PyThread_allocate_lock();
+    scratch_mutex = PyThread_allocate_lock();
+    cache_mutex = PyThread_allocate_lock();
+    rs_mutex = PyThread_allocate_lock();
+
     /* Create the module and add the functions */
     m = Py_InitModule("_gd", gd_methods);
 
@@ -2244,6 +9478,12 @@ void DLLEXPORT init_gd(void)
     PyDict_SetItemString(d, "CMP_TRUECOLOR", v);
 #endif
 
+    /* opcodes for image.draw() */
+    for(i = 0; draw_ops[i].name; i++) {
+        v = Py_BuildValue("i", draw_ops[i].op);
+        PyDict_SetItemString(d, draw_ops[i].constant, v);
+    }
+
     /* Check for errors */
     if(PyErr_Occurred())
         Py_FatalError("can't initialize module gd");
@@ -0,0 +1,118 @@
+#!/usr/bin/env python
+
+# gdbench.py -- rough timings for gdmodule.
+#
+# usage:  python gdbench.py [threads]
+#
+# Encoding releases the global interpreter lock, so PNG throughput
+# should rise with the number of threads until the cores run out.
+#
+# The PNG compression presets are also compared, for encode time and
+# output size, on truecolor and palette charts.
+#
+# Lastly a large JPEG is thumbnailed both a step at a time from Python
+# and with gd.thumbnail(), which decodes it at reduced size.
+
+import gd, sys, time, threading, cStringIO
+
+def chart(w = 1024, h = 768, truecolor = 1):
+    "build an image that looks more or less like a line chart"
+    im = gd.image((w, h), truecolor)
+    white = im.colorAllocate((255, 255, 255))
+    grid = im.colorAllocate((220, 220, 220))
+    black = im.colorAllocate((0, 0, 0))
+    colors = [ im.colorAllocate(c) for c in
+        ((200, 40, 40), (40, 120, 200), (40, 160, 60)) ]
+    im.filledRectangle((0, 0), (w-1, h-1), white)
+    for x in range(40, w, 40):
+        im.line((x, 0), (x, h-1), grid)
+    for y in range(40, h, 40):
+        im.line((0, y), (w-1, y), grid)
+    for n, c in enumerate(colors):
+        pts = [ (x, h/2 + int((h/3) * ((x * (n+3)) % 97 - 48) / 48.0))
+                for x in range(0, w, 8) ]
+        im.lines(pts, c)
+        im.string(gd.gdFontMediumBold, (20, 20 + n*16), "series %d" % n, c)
+    im.rectangle((0, 0), (w-1, h-1), black)
+    return im
+
+def encode_png(im, count):
+    for i in range(count):
+        f = cStringIO.StringIO()
+        im.writePng(f)
+
+def thread_scaling(maxthreads):
+    # one image per thread; threads sharing an image would just queue
+    # up on its lock
+    images = [ chart() for i in range(maxthreads) ]
+    print "PNG encode throughput (1024x768 truecolor chart)"
+    n = 1
+    while n <= maxthreads:
+        workers = [ threading.Thread(target = encode_png, args = (images[i], 20))
+                    for i in range(n) ]
+        start = time.time()
+        for t in workers:
+            t.start()
+        for t in workers:
+            t.join()
+        print "  %2d thread(s): %7.1f images/sec" % (n, (n * 20) / (time.time() - start))
+        n = n * 2
+
+def time_png(write, count = 10):
+    "returns (milliseconds per image, bytes) for count calls of write(f)"
+    start = time.time()
+    for i in range(count):
+        f = cStringIO.StringIO()
+        write(f)
+    return (time.time() - start) * 1000.0 / count, len(f.getvalue())
+
+def png_presets():
+    presets = [ None, "fast", "balanced", "small" ]
+    for truecolor in (1, 0):
+        im = chart(truecolor = truecolor)
+        w, h = im.size()
+        print "PNG presets (%dx%d %s chart)" % \
+            (w, h, ("palette", "truecolor")[truecolor])
+        for p in presets:
+            ms, size = time_png(lambda f: im.writePng(f, level = p))
+            print "  writePng  %-8s %7.1f ms %8d bytes" % (p or "default", ms, size)
+        if not truecolor:
+            continue
+        # for truecolor images both apply the preset's row filters
+        def banded(f, p):
+            wr = gd.PngWriter(f, (w, h), level = p)
+            wr.writeRows(im)
+            wr.close()
+        for p in presets:
+            ms, size = time_png(lambda f: banded(f, p))
+            print "  PngWriter %-8s %7.1f ms %8d bytes" % (p or "default", ms, size)
+
+def thumbnails(count = 5):
+    big = chart(4000, 3000)
+    f = cStringIO.StringIO()
+    big.writeJpeg(f, 90)
+    data = f.getvalue()
+    print "JPEG thumbnails (4000x3000 to fit 200x200)"
+    start = time.time()
+    for i in range(count):
+        im = gd.image(cStringIO.StringIO(data), "jpeg")
+        th = gd.image((200, 150), 1)
+        im.copyResampledTo(th, (0, 0), (0, 0), (200, 150), im.size())
+        th.writeJpeg(cStringIO.StringIO())
+    print "  step by step  %7.1f ms" % ((time.time() - start) * 1000.0 / count)
+    start = time.time()
+    for i in range(count):
+        r = gd.thumbnail(buffer(data), None, (200, 200))
+    print "  gd.thumbnail  %7.1f ms  (decode %.1f, resize %.1f, encode %.1f)" % \
+        ((time.time() - start) * 1000.0 / count, r["decode"] * 1000.0,
+         r["resize"] * 1000.0, r["encode"] * 1000.0)
+
+if __name__ == "__main__":
+    maxthreads = 8
+    if len(sys.argv) > 1:
+        maxthreads = int(sys.argv[1])
+    thread_scaling(maxthreads)
+    png_presets()
+    thumbnails()
+
+# end of file.
@@ -9,6 +9,7 @@
 """
 
 import _gd
+import types
 from _gd import *
 del image
 
@@ -16,11 +17,11 @@ del image
 
 class image:
 
-    def __init__(self, *args):
+    def __init__(self, *args, **kw):
         if isinstance(args[0], image):
             args = list(args)
             args[0] = args[0]._image
-        self.__dict__["_image"] = _gd.image(*args)
+        self.__dict__["_image"] = _gd.image(*args, **kw)
 
     def __getattr__(self, name):
         return getattr(self._image, name)
@@ -28,22 +29,14 @@ class image:
     def __setattr__(self, name, value):
         return setattr(self._image, name, value)
 
-    def lines(self, points, color):
-        "draw a line along the sequence of points in the list or tuple using color"
-        prev = tuple(points[0])
-        for p in points[1:]:
-            p = tuple(p)
-            self._image.line(prev, p, color)
-            prev = p
-
     def copyTo(self, im, *args):
         return self._image.copyTo(im._image, *args)
 
     def copyResizedTo(self, im, *args):
         return self._image.copyResizedTo(im._image, *args)
 
-    def copyResampledTo(self, im, *args):
-        return self._image.copyResampledTo(im._image, *args)
+    def copyResampledTo(self, im, *args, **kw):
+        return self._image.copyResampledTo(im._image, *args, **kw)
 
     def copyMergeTo(self, im, *args):
         return self._image.copyMergeTo(im._image, *args)
@@ -63,4 +56,52 @@ class image:
     def setTile(self, im, *args):
         return self._image.setTile(im._image, *args)
 
+    def toPalette(self, *args, **kw):
+        im = types.InstanceType(image)
+        im.__dict__["_image"] = self._image.toPalette(*args, **kw)
+        return im
+
+class PngWriter:
+
+    def __init__(self, *args, **kw):
+        self.__dict__["_writer"] = _gd.PngWriter(*args, **kw)
+
+    def __getattr__(self, name):
+        return getattr(self._writer, name)
+
+    def writeRows(self, im, *args):
+        return self._writer.writeRows(im._image, *args)
+
+class GifAnimWriter:
+
+    def __init__(self, *args, **kw):
+        self.__dict__["_writer"] = _gd.GifAnimWriter(*args, **kw)
+
+    def __getattr__(self, name):
+        return getattr(self._writer, name)
+
+    def addFrame(self, im, *args):
+        return self._writer.addFrame(im._image, *args)
+
+class DisplayList:
+
+    def __init__(self, *args, **kw):
+        self.__dict__["_list"] = _gd.DisplayList(*args, **kw)
+
+    def __getattr__(self, name):
+        return getattr(self._list, name)
+
+    def copy(self, im, *args):
+        return self._list.copy(im._image, *args)
+
+    def replay(self, im, *args, **kw):
+        return self._list.replay(im._image, *args, **kw)
+
+def frombuffer(data, type, **kw):
+    "create an image from the encoded image data in a string or buffer object"
+    if isinstance(data, str):
+        # image() would take a string for a filename
+        data = buffer(data)
+    return image(data, type, **kw)
+
 # end of file.